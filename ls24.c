@@ -0,0 +1,1860 @@
+/**
+ * @file ls24.c
+ *
+ * Copyright (c) 2015 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief lsコマンド風のプログラムを作るNo.24
+ * ユーザ名、グループ名のキャッシュ
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2026/10/17
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#define PATH_MAX 4096
+#define HALF_YEAR_SECOND (365 * 24 * 60 * 60 / 2)
+#define DIRENT_BUF_DEFAULT (256 * 1024)
+#define DIRENT_BUF_MIN (4 * 1024)
+#define DIRENT_BUF_MAX (64 * 1024 * 1024)
+#define STAT_QUEUE_SIZE 1024
+#define URING_ENTRIES 256
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define SORT_INSERTION_MAX 32
+#define ID_CACHE_INITIAL_SIZE 64
+
+#ifndef S_IXUGO
+#define S_IXUGO (S_IXUSR | S_IXGRP | S_IXOTH)
+#endif
+
+/**
+ * 隠しファイルの表示方針
+ */
+enum {
+  FILTER_DEFAULT, /**< '.'から始まるもの以外を表示する */
+  FILTER_ALMOST,  /**< '.'と'..'以外を表示する */
+  FILTER_ALL,     /**< すべて表示する */
+};
+
+/**
+ * 短縮形を持たないオプション
+ */
+enum {
+  OPT_BUFFER_SIZE = 256, /**< getdents64のバッファサイズ */
+  OPT_THREADS,           /**< 情報取得のスレッド数 */
+  OPT_IO_URING,          /**< io_uringによる情報取得 */
+  OPT_STATS,             /**< 統計情報の表示 */
+};
+
+/**
+ * getdents64で取得するディレクトリエントリ
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * getdents64によるディレクトリエントリの読み出し
+ */
+struct dir_reader {
+  int fd;
+  char *buf;
+  size_t pos;
+  size_t end;
+};
+
+/**
+ * 子ディレクトリを開くために保持する親ディレクトリのfd
+ * 参照している子ディレクトリがすべて処理されたところでcloseする
+ */
+struct dir_fd {
+  int fd;
+  int ref;
+};
+
+/**
+ * 再帰呼び出しのためのディレクトリ名を保持するリンクリスト
+ */
+struct dir_path {
+  char path[PATH_MAX + 1];
+  const char *name;
+  struct dir_fd *parent;
+  int depth;
+  struct dir_path *next;
+};
+
+/**
+ * アリーナの領域の塊
+ */
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  max_align_t data[];
+};
+
+/**
+ * 先頭から順に切り出していくメモリ領域
+ * 個別の開放はできず、reset_arenaで一括して開放する。
+ * 開放した塊は手放さずに次の確保で再利用する。
+ */
+struct arena {
+  struct arena_chunk *head;
+  struct arena_chunk *current;
+  size_t used;
+};
+
+/**
+ * ファイル情報の格納
+ * 構造体と名前、リンク先はアリーナに格納し、リンク先はシンボリックリンクの場合のみ持つ。
+ * statの結果は表示に使う項目のみを保持する。
+ */
+struct info {
+  const char *name;
+  const char *link;
+  off_t size;
+  dev_t rdev;
+  time_t mtime;
+  mode_t mode;
+  mode_t link_mode;
+  uid_t uid;
+  gid_t gid;
+  unsigned int nlink;
+  int error;
+  bool link_ok;
+};
+
+/**
+ * ファイル情報を格納する可変長リスト
+ */
+struct info_list {
+  struct info **array;
+  int size;
+  int used;
+  struct arena *arena;
+  struct arena *links;
+};
+
+/**
+ * ソート用のキー
+ * 名前の8バイトをビッグエンディアンで詰めた値を持ち、
+ * 大小関係がstrcmpの該当8バイトの比較と一致する。
+ */
+struct sort_key {
+  uint64_t prefix;
+  struct info *info;
+};
+
+/**
+ * uid/gidと名前の対応
+ */
+struct id_entry {
+  unsigned int id;
+  bool used;
+  char *name;
+};
+
+/**
+ * uid/gidから名前を引くオープンアドレス法のハッシュテーブル
+ * 名前が見つからなかったものもNULLとして記録する
+ */
+struct id_cache {
+  struct id_entry *table;
+  size_t size;
+  size_t used;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/**
+ * ワーカースレッドへ依頼する情報取得
+ */
+struct stat_job {
+  struct info *info;
+  struct arena *links;
+  int dirfd;
+  unsigned char d_type;
+};
+
+/**
+ * 情報取得を行うワーカースレッドと依頼のキュー
+ */
+struct stat_pool {
+  struct stat_job jobs[STAT_QUEUE_SIZE];
+  int head;
+  int count;
+  int pending;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t done;
+};
+
+/**
+ * io_uringへ依頼する情報取得
+ */
+struct uring_job {
+  struct info *info;
+  struct statx stx;
+  int res;
+};
+
+/**
+ * io_uringのリングと依頼待ちの情報取得
+ */
+struct uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct uring_job jobs[URING_ENTRIES];
+  int used;
+};
+
+static void *xmalloc(size_t n);
+static void *xrealloc(void *ptr, size_t size);
+static bool parse_size(const char *str, size_t *size);
+static struct dir_path *parse_cmd_args(int argc, char**argv);
+static void get_mode_string(mode_t mode, char *str);
+static void print_type_indicator(mode_t mode);
+static char *resolve_user(unsigned int uid);
+static char *resolve_group(unsigned int gid);
+static struct id_entry *find_id_entry(struct id_entry *table, size_t size, unsigned int id);
+static const char *lookup_id(struct id_cache *cache, unsigned int id, char *(*resolve)(unsigned int));
+static void print_user(uid_t uid);
+static void print_group(gid_t gid);
+static void print_stats(void);
+static void get_time_string(char *str, time_t time);
+static void print_name_with_color(const char *name, mode_t mode, bool link_ok);
+static struct dir_fd *new_dir_fd(int fd);
+static void release_dir_fd(struct dir_fd *dir_fd);
+static struct dir_path *new_dir_path(const char *path, struct dir_fd *parent, int depth, struct dir_path *next);
+static void *arena_alloc(struct arena *arena, size_t size, size_t align);
+static const char *arena_strdup(struct arena *arena, const char *str, size_t len);
+static void reset_arena(struct arena *arena);
+static void init_info_list(struct info_list *list, int size);
+static void free_info_list(struct info_list *list);
+static void add_info(struct info_list *list, struct info *info);
+static void init_stat_mask(void);
+static void check_statx(void);
+static void statx_to_stat(const struct statx *stx, struct stat *st);
+static int stat_entry(int dirfd, const char *path, int flags, unsigned int mask, struct stat *st);
+static bool need_stat(unsigned char d_type);
+static void set_info_stat(struct info *info, const struct stat *st);
+static void read_link(int dirfd, const char *path, struct info *info, struct arena *links);
+static int fill_info(int dirfd, const char *path, struct info *info, unsigned char d_type, struct arena *links);
+static struct info *alloc_info(struct info_list *list, const char *name);
+static struct info *new_info(int dirfd, const char *path, const char *name, unsigned char d_type, struct info_list *list);
+static void *stat_worker(void *arg);
+static struct stat_pool *get_stat_pool(void);
+static void submit_stat_job(struct stat_pool *pool, int dirfd, struct info *info, unsigned char d_type, struct arena *links);
+static void wait_stat_jobs(struct stat_pool *pool);
+static void remove_failed_info(struct info_list *list, const char *path);
+static struct uring *new_uring(void);
+static struct uring *get_uring(void);
+static void submit_uring_statx(struct uring *ring, int index, int dirfd, const char *path, int flags, unsigned int mask);
+static void wait_uring(struct uring *ring, int count);
+static void run_uring_jobs(struct uring *ring, int dirfd, struct arena *links);
+static void add_uring_job(struct uring *ring, int dirfd, struct info *info, struct arena *links);
+static uint64_t name_prefix(const char *name);
+static int compare_key(const struct sort_key *a, const struct sort_key *b, size_t offset);
+static void insertion_sort_keys(struct sort_key *keys, size_t n, size_t offset);
+static void radix_sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n, int shift, size_t offset);
+static void sort_list(struct info_list *list);
+static void print_info(struct info *info);
+static const char *find_filename(const char *path);
+static bool open_dir_reader(struct dir_reader *reader, int dirfd, const char *path);
+static struct linux_dirent64 *read_dir_entry(struct dir_reader *reader);
+static bool is_batch_end(const struct dir_reader *reader);
+static void close_dir_reader(struct dir_reader *reader);
+static void list_dir(struct dir_path *base);
+
+/**
+ * 隠しファイルの表示方針
+ */
+static int filter = FILTER_DEFAULT;
+/**
+ * 色付き表示する
+ */
+static bool color = false;
+/**
+ * 属性を示す文字を表示する
+ */
+static bool classify = false;
+/**
+ * ロングフォーマットで表示する
+ */
+static bool long_format = false;
+/**
+ * 半年前のUNIX時間
+ */
+static time_t half_year_ago;
+/**
+ * 再帰的な表示
+ */
+static bool recursive = false;
+/**
+ * getdents64の読み出しバッファ
+ */
+static char *dirent_buf = NULL;
+/**
+ * getdents64の読み出しバッファのサイズ
+ */
+static size_t dirent_buf_size = DIRENT_BUF_DEFAULT;
+/**
+ * エントリ自身について取得する情報のstatxマスク
+ */
+static unsigned int stat_mask = STATX_TYPE;
+/**
+ * シンボリックリンクのリンク先について取得する情報のstatxマスク
+ * 0の場合はリンク先を調べない
+ */
+static unsigned int link_stat_mask = 0;
+/**
+ * リンク先文字列を読み出す
+ */
+static bool need_link = false;
+/**
+ * statxが使えない環境ではfstatatを使う
+ */
+static bool statx_unsupported = false;
+/**
+ * 情報取得のスレッド数、1以下の場合はメインスレッドで行う
+ */
+static long stat_threads = 0;
+/**
+ * 情報取得を行うワーカースレッド
+ */
+static struct stat_pool *stat_pool = NULL;
+/**
+ * io_uringによる情報取得を行う
+ */
+static bool use_uring = false;
+/**
+ * io_uringのリング、使えない場合はNULL
+ */
+static struct uring *uring = NULL;
+/**
+ * リンク先の格納はワーカースレッドからも行うため排他する
+ */
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * 1ディレクトリ分のエントリ情報構造体と名前を格納するアリーナ
+ */
+static struct arena entry_arena;
+/**
+ * 1ディレクトリ分のリンク先を格納するアリーナ
+ */
+static struct arena link_arena;
+/**
+ * 統計情報を表示する
+ */
+static bool show_stats = false;
+/**
+ * uidからユーザ名へのキャッシュ
+ */
+static struct id_cache user_cache;
+/**
+ * gidからグループ名へのキャッシュ
+ */
+static struct id_cache group_cache;
+
+/**
+ * @brief malloc結果がNULLだった場合にexitする。
+ * @param[IN] size 確保サイズ
+ * @retrun 確保された領域へのポインタ
+ */
+static void *xmalloc(size_t n) {
+  void *p = malloc(n);
+  if (p == NULL) {
+    perror("");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * @brief realloc結果がNULLだった場合にexitする。
+ * @param[IN] ptr 拡張する領域ポインタ
+ * @param[IN] size 確保サイズ
+ * @retrun 確保された領域へのポインタ
+ */
+static void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (p == NULL) {
+    perror("");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * @brief サイズ指定文字列をパースする
+ * 末尾にK/Mを付けた場合はKiB/MiB単位とする
+ *
+ * @param[IN] str 文字列
+ * @param[OUT] size サイズの格納先
+ * @return 成功した場合true
+ */
+static bool parse_size(const char *str, size_t *size) {
+  char *end;
+  unsigned long value = strtoul(str, &end, 10);
+  if (end == str) {
+    return false;
+  }
+  if (*end == 'K' || *end == 'k') {
+    value *= 1024;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    value *= 1024 * 1024;
+    end++;
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  *size = value;
+  return true;
+}
+
+/**
+ * @brief コマンドライン引数をパースする
+ * @param[IN] argc 引数の数
+ * @param[IN/OUT] argv 引数配列
+ * @return パス
+ */
+static struct dir_path *parse_cmd_args(int argc, char**argv) {
+  int opt;
+  const struct option longopts[] = {
+      { "all", no_argument, NULL, 'a' },
+      { "almost-all", no_argument, NULL, 'A' },
+      { "color", no_argument, NULL, 'C' },
+      { "classify", no_argument, NULL, 'F' },
+      { "long-format", no_argument, NULL, 'l' },
+      { "recursive", no_argument, NULL, 'R' },
+      { "buffer-size", required_argument, NULL, OPT_BUFFER_SIZE },
+      { "threads", required_argument, NULL, OPT_THREADS },
+      { "io-uring", no_argument, NULL, OPT_IO_URING },
+      { "stats", no_argument, NULL, OPT_STATS },
+      { 0, 0, 0, 0 },
+  };
+  while ((opt = getopt_long(argc, argv, "aACFlR", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        filter = FILTER_ALL;
+        break;
+      case 'A':
+        filter = FILTER_ALMOST;
+        break;
+      case 'C':
+        if (isatty(STDOUT_FILENO)) {
+          color = true;
+        }
+        break;
+      case 'F':
+        classify = true;
+        break;
+      case 'l':
+        long_format = true;
+        half_year_ago = time(NULL) - HALF_YEAR_SECOND;
+        break;
+      case 'R':
+        recursive = true;
+        break;
+      case OPT_BUFFER_SIZE:
+        if (!parse_size(optarg, &dirent_buf_size)
+            || dirent_buf_size < DIRENT_BUF_MIN
+            || dirent_buf_size > DIRENT_BUF_MAX) {
+          fprintf(stderr, "invalid buffer size: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      case OPT_THREADS: {
+        char *end;
+        stat_threads = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || stat_threads < 1) {
+          fprintf(stderr, "invalid number of threads: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      }
+      case OPT_IO_URING:
+        use_uring = true;
+        break;
+      case OPT_STATS:
+        show_stats = true;
+        break;
+      default:
+        return NULL;
+    }
+  }
+  init_stat_mask();
+  check_statx();
+  if (stat_threads == 0) {
+    stat_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (argc <= optind) {
+    return new_dir_path("./", NULL, 0, NULL);
+  } else {
+    struct dir_path *head;
+    struct dir_path **work = &head;
+    int i;
+    for (i = optind; i < argc; i++) {
+      *work = new_dir_path(argv[i], NULL, 0, NULL);
+      work = &(*work)->next;
+    }
+    return head;
+  }
+}
+
+/**
+ * @brief モード文字列を作成する
+ * @param[IN]  mode モードパラメータ
+ * @param[OUT] str  文字列の出力先、11バイト以上のバッファを指定
+ */
+static void get_mode_string(mode_t mode, char *str) {
+  str[0] = (S_ISBLK(mode))  ? 'b' :
+           (S_ISCHR(mode))  ? 'c' :
+           (S_ISDIR(mode))  ? 'd' :
+           (S_ISREG(mode))  ? '-' :
+           (S_ISFIFO(mode)) ? 'p' :
+           (S_ISLNK(mode))  ? 'l' :
+           (S_ISSOCK(mode)) ? 's' : '?';
+  str[1] = mode & S_IRUSR ? 'r' : '-';
+  str[2] = mode & S_IWUSR ? 'w' : '-';
+  str[3] = mode & S_ISUID ? (mode & S_IXUSR ? 's' : 'S') : (mode & S_IXUSR ? 'x' : '-');
+  str[4] = mode & S_IRGRP ? 'r' : '-';
+  str[5] = mode & S_IWGRP ? 'w' : '-';
+  str[6] = mode & S_ISGID ? (mode & S_IXGRP ? 's' : 'S') : (mode & S_IXGRP ? 'x' : '-');
+  str[7] = mode & S_IROTH ? 'r' : '-';
+  str[8] = mode & S_IWOTH ? 'w' : '-';
+  str[9] = mode & S_ISVTX ? (mode & S_IXOTH ? 't' : 'T') : (mode & S_IXOTH ? 'x' : '-');
+  str[10] = '\0';
+}
+
+/**
+ * @brief ファイルタイプ別のインジケータを出力する
+ * @param[IN] mode モードパラメータ
+ */
+static void print_type_indicator(mode_t mode) {
+  if (S_ISREG(mode)) {
+    if (mode & S_IXUGO) {
+      putchar('*');
+    }
+  } else {
+    if (S_ISDIR(mode)) {
+      putchar('/');
+    } else if (S_ISLNK(mode)) {
+      putchar('@');
+    } else if (S_ISFIFO(mode)) {
+      putchar('|');
+    } else if (S_ISSOCK(mode)) {
+      putchar('=');
+    }
+  }
+}
+
+/**
+ * @brief uidからユーザ名を取得する
+ * @param[IN] uid ユーザID
+ * @return ユーザ名の複製、見つからない場合NULL
+ */
+static char *resolve_user(unsigned int uid) {
+  struct passwd *passwd = getpwuid(uid);
+  return passwd != NULL ? strdup(passwd->pw_name) : NULL;
+}
+
+/**
+ * @brief gidからグループ名を取得する
+ * @param[IN] gid グループID
+ * @return グループ名の複製、見つからない場合NULL
+ */
+static char *resolve_group(unsigned int gid) {
+  struct group *group = getgrgid(gid);
+  return group != NULL ? strdup(group->gr_name) : NULL;
+}
+
+/**
+ * @brief ハッシュテーブルからidの格納位置を探す
+ * @param[IN] table ハッシュテーブル
+ * @param[IN] size テーブルサイズ、2の累乗
+ * @param[IN] id 探すid
+ * @return idが格納されている位置、なければ格納すべき空き位置
+ */
+static struct id_entry *find_id_entry(struct id_entry *table, size_t size, unsigned int id) {
+  size_t mask = size - 1;
+  size_t i = (id * 2654435761u) & mask;
+  while (table[i].used && table[i].id != id) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+/**
+ * @brief キャッシュを通してidから名前を引く
+ * キャッシュにない場合のみresolveを呼び出し、見つからなかった結果も記録する。
+ * 使用率が半分を超えた場合はテーブルを倍に拡張する。
+ *
+ * @param[IN/OUT] cache キャッシュ
+ * @param[IN] id 引くid
+ * @param[IN] resolve 名前を取得する関数
+ * @return 名前、見つからない場合NULL
+ */
+static const char *lookup_id(struct id_cache *cache, unsigned int id, char *(*resolve)(unsigned int)) {
+  struct id_entry *entry;
+  if (cache->table == NULL) {
+    cache->size = ID_CACHE_INITIAL_SIZE;
+    cache->table = xmalloc(sizeof(struct id_entry) * cache->size);
+    memset(cache->table, 0, sizeof(struct id_entry) * cache->size);
+  }
+  entry = find_id_entry(cache->table, cache->size, id);
+  if (entry->used) {
+    cache->hits++;
+    return entry->name;
+  }
+  cache->misses++;
+  if ((cache->used + 1) * 2 > cache->size) {
+    size_t i;
+    size_t size = cache->size * 2;
+    struct id_entry *table = xmalloc(sizeof(struct id_entry) * size);
+    memset(table, 0, sizeof(struct id_entry) * size);
+    for (i = 0; i < cache->size; i++) {
+      if (cache->table[i].used) {
+        *find_id_entry(table, size, cache->table[i].id) = cache->table[i];
+      }
+    }
+    free(cache->table);
+    cache->table = table;
+    cache->size = size;
+    entry = find_id_entry(table, size, id);
+  }
+  entry->id = id;
+  entry->used = true;
+  entry->name = resolve(id);
+  cache->used++;
+  return entry->name;
+}
+
+/**
+ * @brief ユーザ名を表示する
+ * @param[IN] uid ユーザID
+ */
+static void print_user(uid_t uid) {
+  const char *name = lookup_id(&user_cache, uid, resolve_user);
+  if (name != NULL) {
+    printf("%8s ", name);
+  } else {
+    printf("%8d ", uid);
+  }
+}
+
+/**
+ * @brief グループ名を表示する
+ * @param[IN] gid グループID
+ */
+static void print_group(gid_t gid) {
+  const char *name = lookup_id(&group_cache, gid, resolve_group);
+  if (name != NULL) {
+    printf("%8s ", name);
+  } else {
+    printf("%8d ", gid);
+  }
+}
+
+/**
+ * @brief 統計情報を標準エラーへ表示する
+ */
+static void print_stats(void) {
+  fprintf(stderr, "user cache: %lu hits, %lu misses\n",
+          user_cache.hits, user_cache.misses);
+  fprintf(stderr, "group cache: %lu hits, %lu misses\n",
+          group_cache.hits, group_cache.misses);
+}
+
+/**
+ * @brief 時刻表示文字列を作成する
+ * 半年以上前の場合は月-日 年
+ * 半年以内の場合は月-日 時:分
+ *
+ * @param[OUT] str  格納先、12byte以上のバッファを指定
+ * @param[IN]  time 文字列を作成するUNIX時間
+ */
+static void get_time_string(char *str, time_t time) {
+  if (time - half_year_ago > 0) {
+    strftime(str, 12, "%m/%d %H:%M", localtime(&time));
+  } else {
+    strftime(str, 12, "%m/%d  %Y", localtime(&time));
+  }
+}
+
+/**
+ * @brief ファイル名を色付き表示する
+ *
+ * @param[IN] name ファイル名
+ * @param[IN] mode mode値
+ * @param[IN] link_ok リンク先が存在しない場合にfalse
+ */
+static void print_name_with_color(const char *name, mode_t mode, bool link_ok) {
+  if (!link_ok) {
+    printf("\033[31m");
+  } else if (S_ISREG(mode)) {
+    if (mode & S_ISUID) {
+      printf("\033[37;41m");
+    } else if (mode & S_ISGID) {
+      printf("\033[30;43m");
+    } else if (mode & S_IXUGO) {
+      printf("\033[01;32m");
+    } else {
+      printf("\033[0m");
+    }
+  } else if (S_ISDIR(mode)) {
+    if ((mode & S_ISVTX) && (mode & S_IWOTH)) {
+      printf("\033[30;42m");
+    } else if (mode & S_IWOTH) {
+      printf("\033[34;42m");
+    } else if (mode & S_ISVTX) {
+      printf("\033[37;44m");
+    } else {
+      printf("\033[01;34m");
+    }
+  } else if (S_ISLNK(mode)) {
+    printf("\033[01;36m");
+  } else if (S_ISFIFO(mode)) {
+    printf("\033[33m");
+  } else if (S_ISSOCK(mode)) {
+    printf("\033[01;35m");
+  } else if (S_ISBLK(mode)) {
+    printf("\033[01;33m");
+  } else if (S_ISCHR(mode)) {
+    printf("\033[01;33m");
+  }
+  printf("%s", name);
+  printf("\033[0m");
+}
+
+/**
+ * @brief struct dir_fdのファクトリーメソッド
+ * @param[IN] fd ディレクトリのfd
+ * @return struct dir_fdへのポインタ
+ */
+static struct dir_fd *new_dir_fd(int fd) {
+  struct dir_fd *d = xmalloc(sizeof(struct dir_fd));
+  d->fd = fd;
+  d->ref = 0;
+  return d;
+}
+
+/**
+ * @brief struct dir_fdの参照を解放する
+ * 参照がなくなった場合はfdをcloseする
+ *
+ * @param[IN] dir_fd 解放する構造体、NULLの場合は何もしない
+ */
+static void release_dir_fd(struct dir_fd *dir_fd) {
+  if (dir_fd == NULL) {
+    return;
+  }
+  dir_fd->ref--;
+  if (dir_fd->ref == 0) {
+    close(dir_fd->fd);
+    free(dir_fd);
+  }
+}
+
+/**
+ * @brief struct subdirのファクトリーメソッド
+ * 親ディレクトリのfdが指定された場合は、親からの相対でオープンできるよう
+ * パス末尾の名前部分を保持する。
+ *
+ * @param[IN] path パス
+ * @param[IN] parent 親ディレクトリのfd、NULLの場合はpathをそのまま使う
+ * @param[IN] depth 深さ
+ * @param[IN] next 次の要素へのポインタ
+ * @return struct subdirへのポインタ
+ */
+static struct dir_path *new_dir_path(const char *path, struct dir_fd *parent, int depth, struct dir_path *next) {
+  struct dir_path *s = xmalloc(sizeof(struct dir_path));
+  if (path != NULL) {
+    strncpy(s->path, path, sizeof(s->path));
+  }
+  s->name = parent != NULL ? find_filename(s->path) : s->path;
+  s->parent = parent;
+  s->depth = depth;
+  s->next = next;
+  return s;
+}
+
+/**
+ * @brief アリーナから領域を切り出す
+ * 現在の塊に空きがない場合は次の塊へ進み、塊がなければ新たに確保する。
+ *
+ * @param[IN/OUT] arena 確保元
+ * @param[IN] size 確保サイズ
+ * @param[IN] align アライメント、2の累乗でmax_align_t以下
+ * @return 確保された領域へのポインタ
+ */
+static void *arena_alloc(struct arena *arena, size_t size, size_t align) {
+  struct arena_chunk *chunk = arena->current;
+  size_t used = (arena->used + align - 1) & ~(align - 1);
+  if (chunk == NULL || chunk->size - used < size) {
+    struct arena_chunk *next = chunk != NULL ? chunk->next : arena->head;
+    if (next == NULL || next->size < size) {
+      size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+      struct arena_chunk *new_chunk = xmalloc(sizeof(struct arena_chunk) + chunk_size);
+      new_chunk->size = chunk_size;
+      new_chunk->next = next;
+      if (chunk != NULL) {
+        chunk->next = new_chunk;
+      } else {
+        arena->head = new_chunk;
+      }
+      next = new_chunk;
+    }
+    chunk = next;
+    arena->current = chunk;
+    used = 0;
+  }
+  arena->used = used + size;
+  return (char *)chunk->data + used;
+}
+
+/**
+ * @brief アリーナへ文字列を格納する
+ * @param[IN/OUT] arena 格納先
+ * @param[IN] str 文字列、終端文字は不要
+ * @param[IN] len 文字列の長さ
+ * @return 格納された'\0'終端の文字列
+ */
+static const char *arena_strdup(struct arena *arena, const char *str, size_t len) {
+  char *p = arena_alloc(arena, len + 1, 1);
+  memcpy(p, str, len);
+  p[len] = '\0';
+  return p;
+}
+
+/**
+ * @brief アリーナから切り出したすべての領域を開放する
+ * 塊はそのまま残し、先頭から再利用する。
+ *
+ * @param[IN/OUT] arena 対象のアリーナ
+ */
+static void reset_arena(struct arena *arena) {
+  arena->current = arena->head;
+  arena->used = 0;
+}
+
+/**
+ * @brief 可変長リストを初期化する
+ * エントリ情報構造体と文字列はディレクトリ単位のアリーナへ格納する。
+ *
+ * @param[OUT] list 初期化する構造体
+ * @param[IN] size 初期サイズ
+ */
+static void init_info_list(struct info_list *list, int size) {
+  list->array = xmalloc(sizeof(struct info*) * size);
+  list->size = size;
+  list->used = 0;
+  list->arena = &entry_arena;
+  list->links = &link_arena;
+}
+
+/**
+ * @brief 可変長リスト内のメモリを開放する
+ * リスト内に登録されたinfoと文字列もアリーナごと合わせて開放する。
+ *
+ * @param[IN] list 開放する構造体
+ */
+static void free_info_list(struct info_list *list) {
+  free(list->array);
+  reset_arena(list->arena);
+  reset_arena(list->links);
+}
+
+/**
+ * @brief 可変長リストへ情報を格納する
+ * 格納場所がない場合は拡張を行う
+ *
+ * @param[IN/OUT] list 格納先構造体
+ * @param[IN] info 格納するデータ
+ */
+static void add_info(struct info_list *list, struct info *info) {
+  if (list->size == list->used) {
+    list->size = list->size * 2;
+    list->array = xrealloc(list->array, sizeof(struct info*) * list->size);
+  }
+  list->array[list->used] = info;
+  list->used++;
+}
+
+/**
+ * @brief 表示オプションから取得が必要な情報を決定する
+ * ソートと再帰のためファイルタイプは常に必要とする。
+ * 属性を示す文字と色付けには許可属性が、
+ * ロングフォーマットには表示するすべての項目が必要になる。
+ * リンク先の情報は色付けでのみ、リンク先文字列はロングフォーマットでのみ使う。
+ */
+static void init_stat_mask(void) {
+  stat_mask = STATX_TYPE;
+  if (classify || color) {
+    stat_mask |= STATX_MODE;
+  }
+  if (long_format) {
+    stat_mask |= STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID
+        | STATX_SIZE | STATX_MTIME;
+  }
+  link_stat_mask = color ? (STATX_TYPE | STATX_MODE) : 0;
+  need_link = long_format;
+}
+
+/**
+ * @brief statxが使えるかを調べる
+ * ワーカースレッドから参照するため、スレッド起動前に確定させておく。
+ */
+static void check_statx(void) {
+  struct statx stx;
+  if (statx(AT_FDCWD, "/", 0, STATX_TYPE, &stx) != 0 && errno == ENOSYS) {
+    statx_unsupported = true;
+  }
+}
+
+/**
+ * @brief 指定された情報のみを取得しstruct statへ格納する
+ * statxが使えない場合はfstatatで全情報を取得する。
+ * 取得しなかった項目は0となる。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからの相対パス
+ * @param[IN] flags AT_SYMLINK_NOFOLLOWなどのフラグ
+ * @param[IN] mask 取得する情報のstatxマスク
+ * @param[OUT] st 格納先
+ * @return 成功した場合0、失敗した場合はerrnoを設定し-1
+ */
+static int stat_entry(int dirfd, const char *path, int flags, unsigned int mask, struct stat *st) {
+  struct statx stx;
+  if (statx_unsupported) {
+    return fstatat(dirfd, path, st, flags);
+  }
+  if (statx(dirfd, path, flags, mask, &stx) != 0) {
+    return -1;
+  }
+  statx_to_stat(&stx, st);
+  return 0;
+}
+
+/**
+ * @brief statxの結果をstruct statへ変換する
+ * @param[IN] stx statxの結果
+ * @param[OUT] st 格納先
+ */
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+/**
+ * @brief エントリの情報取得にstatが必要かを判定する
+ * ファイルタイプ以外の情報が不要な場合は、d_typeが分かっていればstatしない。
+ *
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @return statが必要な場合true
+ */
+static bool need_stat(unsigned char d_type) {
+  return stat_mask != STATX_TYPE || d_type == DT_UNKNOWN;
+}
+
+/**
+ * @brief statの結果から表示に使う項目をエントリ情報構造体へ格納する
+ * @param[OUT] info 格納先
+ * @param[IN] st statの結果
+ */
+static void set_info_stat(struct info *info, const struct stat *st) {
+  info->mode = st->st_mode;
+  info->nlink = st->st_nlink;
+  info->uid = st->st_uid;
+  info->gid = st->st_gid;
+  info->size = st->st_size;
+  info->rdev = st->st_rdev;
+  info->mtime = st->st_mtim.tv_sec;
+}
+
+/**
+ * @brief シンボリックリンクのリンク先を読み出して格納する
+ * 読み出せなかった場合は何もしない。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[OUT] info 格納先
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void read_link(int dirfd, const char *path, struct info *info, struct arena *links) {
+  char buf[PATH_MAX + 1];
+  int link_len = readlinkat(dirfd, path, buf, PATH_MAX);
+  if (link_len > 0) {
+    pthread_mutex_lock(&link_mutex);
+    info->link = arena_strdup(links, buf, link_len);
+    pthread_mutex_unlock(&link_mutex);
+  }
+}
+
+/**
+ * @brief エントリ情報構造体へ指定パスの各情報を格納する
+ * パスはディレクトリのfdからの相対で解決するため、
+ * 深い階層でもカーネルによるパスの探索はエントリ名の分だけで済む。
+ * ワーカースレッドからも呼び出される。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[OUT] info 格納先
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @param[IN/OUT] links リンク先の格納先
+ * @return 成功した場合0、失敗した場合はinfo->errorにerrnoを設定し-1
+ */
+static int fill_info(int dirfd, const char *path, struct info *info, unsigned char d_type, struct arena *links) {
+  struct stat st;
+  info->error = 0;
+  if (!need_stat(d_type)) {
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = DTTOIF(d_type);
+  } else if (stat_entry(dirfd, path, AT_SYMLINK_NOFOLLOW, stat_mask, &st) != 0) {
+    info->error = errno;
+    return -1;
+  }
+  set_info_stat(info, &st);
+  info->link_ok = false;
+  info->link = NULL;
+  info->link_mode = 0;
+  if (S_ISLNK(info->mode)) {
+    struct stat link_stat;
+    if (need_link) {
+      read_link(dirfd, path, info, links);
+    }
+    if (link_stat_mask == 0) {
+      info->link_ok = true;
+    } else if (stat_entry(dirfd, path, 0, link_stat_mask, &link_stat) == 0) {
+      info->link_ok = true;
+      info->link_mode = link_stat.st_mode;
+    }
+  } else {
+    info->link_ok = true;
+  }
+  return 0;
+}
+
+/**
+ * @brief エントリ情報構造体のメモリを確保し名前を格納する
+ * @param[IN/OUT] list 名前の格納先
+ * @param[IN] name エントリの名前
+ * @return エントリ情報構造体
+ */
+static struct info *alloc_info(struct info_list *list, const char *name) {
+  struct info *info = arena_alloc(list->arena, sizeof(struct info), _Alignof(struct info));
+  info->name = arena_strdup(list->arena, name, strlen(name));
+  return info;
+}
+
+/**
+ * @brief エントリ情報構造体のファクトリメソッド
+ * メモリ確保から、指定パスの各情報格納までを行う
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[IN] name エントリの名前
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @param[IN/OUT] list 名前とリンク先の格納先
+ * @return エントリ情報構造体、失敗した場合はerrnoを設定しNULL
+ */
+static struct info *new_info(int dirfd, const char *path, const char *name, unsigned char d_type, struct info_list *list) {
+  struct info *info = alloc_info(list, name);
+  if (fill_info(dirfd, path, info, d_type, list->links) != 0) {
+    errno = info->error;
+    return NULL;
+  }
+  return info;
+}
+
+/**
+ * @brief 情報取得を行うワーカースレッド
+ * キューから依頼を取り出し、結果をinfoへ書き込む。
+ *
+ * @param[IN] arg struct stat_pool
+ * @return 常にNULL
+ */
+static void *stat_worker(void *arg) {
+  struct stat_pool *pool = arg;
+  while (true) {
+    struct stat_job job;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == 0) {
+      pthread_cond_wait(&pool->not_empty, &pool->mutex);
+    }
+    job = pool->jobs[pool->head];
+    pool->head = (pool->head + 1) % STAT_QUEUE_SIZE;
+    pool->count--;
+    pthread_cond_signal(&pool->not_full);
+    pthread_mutex_unlock(&pool->mutex);
+    fill_info(job.dirfd, job.info->name, job.info, job.d_type, job.links);
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending--;
+    if (pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return NULL;
+}
+
+/**
+ * @brief ワーカースレッドを取得する
+ * 初回呼び出し時にスレッドを起動し、以降は使い回す。
+ *
+ * @return struct stat_pool、スレッド数が1以下の場合NULL
+ */
+static struct stat_pool *get_stat_pool(void) {
+  int i;
+  if (stat_threads <= 1 || stat_pool != NULL) {
+    return stat_pool;
+  }
+  stat_pool = xmalloc(sizeof(struct stat_pool));
+  stat_pool->head = 0;
+  stat_pool->count = 0;
+  stat_pool->pending = 0;
+  pthread_mutex_init(&stat_pool->mutex, NULL);
+  pthread_cond_init(&stat_pool->not_empty, NULL);
+  pthread_cond_init(&stat_pool->not_full, NULL);
+  pthread_cond_init(&stat_pool->done, NULL);
+  for (i = 0; i < stat_threads; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, stat_worker, stat_pool);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+  return stat_pool;
+}
+
+/**
+ * @brief ワーカースレッドへ情報取得を依頼する
+ * キューが一杯の場合は空きができるまで待つ。
+ *
+ * @param[IN] pool ワーカースレッド
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] info 格納先、info->nameをdirfdからの相対パスとして使う
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void submit_stat_job(struct stat_pool *pool, int dirfd, struct info *info, unsigned char d_type, struct arena *links) {
+  struct stat_job *job;
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->count == STAT_QUEUE_SIZE) {
+    pthread_cond_wait(&pool->not_full, &pool->mutex);
+  }
+  job = &pool->jobs[(pool->head + pool->count) % STAT_QUEUE_SIZE];
+  job->info = info;
+  job->dirfd = dirfd;
+  job->d_type = d_type;
+  job->links = links;
+  pool->count++;
+  pool->pending++;
+  pthread_cond_signal(&pool->not_empty);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief 依頼したすべての情報取得の完了を待つ
+ * @param[IN] pool ワーカースレッド
+ */
+static void wait_stat_jobs(struct stat_pool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief io_uringのリングを作成する
+ * statxの発行に対応していない場合はNULLを返し、同期的な情報取得を使う。
+ *
+ * @return struct uring、使えない場合NULL
+ */
+static struct uring *new_uring(void) {
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  size_t sq_size;
+  size_t cq_size;
+  char *sq;
+  char *cq;
+  struct uring *ring;
+  int fd;
+  if (statx_unsupported) {
+    return NULL;
+  }
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) {
+    return NULL;
+  }
+  probe = xmalloc(probe_size);
+  memset(probe, 0, probe_size);
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) != 0
+      || probe->last_op < IORING_OP_STATX
+      || !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)) {
+    free(probe);
+    close(fd);
+    return NULL;
+  }
+  free(probe);
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) {
+      sq_size = cq_size;
+    }
+    cq_size = sq_size;
+  }
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq = sq;
+  } else {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sq_size);
+      close(fd);
+      return NULL;
+    }
+  }
+  ring = xmalloc(sizeof(struct uring));
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (cq != sq) {
+      munmap(cq, cq_size);
+    }
+    munmap(sq, sq_size);
+    free(ring);
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->used = 0;
+  return ring;
+}
+
+/**
+ * @brief io_uringのリングを取得する
+ * 初回呼び出し時に作成し、以降は使い回す。
+ *
+ * @return struct uring、指定されていないか使えない場合NULL
+ */
+static struct uring *get_uring(void) {
+  static bool initialized = false;
+  if (use_uring && !initialized) {
+    initialized = true;
+    uring = new_uring();
+  }
+  return uring;
+}
+
+/**
+ * @brief statxの依頼をサブミッションキューへ積む
+ * 実際の発行はwait_uringで行う。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] index 結果を格納するjobsのインデックス
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからの相対パス
+ * @param[IN] flags AT_SYMLINK_NOFOLLOWなどのフラグ
+ * @param[IN] mask 取得する情報のstatxマスク
+ */
+static void submit_uring_statx(struct uring *ring, int index, int dirfd, const char *path, int flags, unsigned int mask) {
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = mask;
+  sqe->off = (uintptr_t)&ring->jobs[index].stx;
+  sqe->statx_flags = flags;
+  sqe->user_data = index;
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 積んだ依頼を1回のシステムコールで発行し、すべての完了を待つ
+ * 結果はjobs[].resへ格納する。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] count 積んだ依頼の数
+ */
+static void wait_uring(struct uring *ring, int count) {
+  int submitted = 0;
+  int completed = 0;
+  while (completed < count) {
+    unsigned head = *ring->cq_head;
+    int ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+                      count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+    submitted += ret;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      ring->jobs[cqe->user_data].res = cqe->res;
+      head++;
+      completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @brief 積まれたエントリの情報取得をio_uringで行う
+ * まずすべてのエントリのstatxを発行し、
+ * シンボリックリンクのリンク先が必要な場合は続けてまとめて発行する。
+ * リンク先文字列の読み出しはio_uringで扱えないため同期的に行う。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void run_uring_jobs(struct uring *ring, int dirfd, struct arena *links) {
+  int i;
+  int link_jobs = 0;
+  struct stat st;
+  if (ring->used == 0) {
+    return;
+  }
+  for (i = 0; i < ring->used; i++) {
+    submit_uring_statx(ring, i, dirfd, ring->jobs[i].info->name, AT_SYMLINK_NOFOLLOW, stat_mask);
+  }
+  wait_uring(ring, ring->used);
+  for (i = 0; i < ring->used; i++) {
+    struct uring_job *job = &ring->jobs[i];
+    struct info *info = job->info;
+    if (job->res < 0) {
+      info->error = -job->res;
+      continue;
+    }
+    info->error = 0;
+    statx_to_stat(&job->stx, &st);
+    set_info_stat(info, &st);
+    info->link_ok = true;
+    info->link = NULL;
+    info->link_mode = 0;
+    if (S_ISLNK(info->mode)) {
+      if (need_link) {
+        read_link(dirfd, info->name, info, links);
+      }
+      if (link_stat_mask != 0) {
+        info->link_ok = false;
+        submit_uring_statx(ring, i, dirfd, info->name, 0, link_stat_mask);
+        link_jobs++;
+      }
+    }
+  }
+  if (link_jobs > 0) {
+    wait_uring(ring, link_jobs);
+    for (i = 0; i < ring->used; i++) {
+      struct uring_job *job = &ring->jobs[i];
+      struct info *info = job->info;
+      if (info->error == 0 && S_ISLNK(info->mode) && job->res == 0) {
+        info->link_ok = true;
+        info->link_mode = job->stx.stx_mode;
+      }
+    }
+  }
+  ring->used = 0;
+}
+
+/**
+ * @brief io_uringで情報取得するエントリを積む
+ * 積める数を超えた場合はその場で発行する。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] info 格納先、info->nameをdirfdからの相対パスとして使う
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void add_uring_job(struct uring *ring, int dirfd, struct info *info, struct arena *links) {
+  if (ring->used == URING_ENTRIES) {
+    run_uring_jobs(ring, dirfd, links);
+  }
+  ring->jobs[ring->used].info = info;
+  ring->used++;
+}
+
+/**
+ * @brief 情報取得に失敗したエントリをリストから取り除く
+ * エラーは読み出し順に表示するため、逐次処理した場合と同じ出力になる。
+ *
+ * @param[IN/OUT] list 対象のリスト
+ * @param[IN] path エラー表示に使うディレクトリのパス、末尾は'/'
+ */
+static void remove_failed_info(struct info_list *list, const char *path) {
+  int i;
+  int used = 0;
+  for (i = 0; i < list->used; i++) {
+    struct info *info = list->array[i];
+    if (info->error != 0) {
+      fprintf(stderr, "%s%s: %s\n", path, info->name, strerror(info->error));
+      continue;
+    }
+    list->array[used] = info;
+    used++;
+  }
+  list->used = used;
+}
+
+/**
+ * @brief 名前の先頭8バイトからソート用のキーを作成する
+ * 8バイトに満たない部分は0で埋める。
+ *
+ * @param[IN] name 名前
+ * @return キー
+ */
+static uint64_t name_prefix(const char *name) {
+  uint64_t prefix = 0;
+  int i;
+  for (i = 0; i < 8 && name[i] != '\0'; i++) {
+    prefix |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+  }
+  return prefix;
+}
+
+/**
+ * @brief ソート用キー比較
+ * キーが一致し、名前が続いている場合のみ残りをstrcmpで比較する。
+ *
+ * @param[IN] a
+ * @param[IN] b
+ * @param[IN] offset キーを作成した名前の位置
+ * @return a>bなら正、a==bなら0、a<bなら負
+ */
+static int compare_key(const struct sort_key *a, const struct sort_key *b, size_t offset) {
+  if (a->prefix != b->prefix) {
+    return a->prefix < b->prefix ? -1 : 1;
+  }
+  if ((a->prefix & 0xff) == 0) {
+    return 0;
+  }
+  return strcmp(a->info->name + offset + 8, b->info->name + offset + 8);
+}
+
+/**
+ * @brief 少数の要素を挿入ソートする
+ * @param[IN/OUT] keys ソート対象
+ * @param[IN] n 要素数
+ * @param[IN] offset キーを作成した名前の位置
+ */
+static void insertion_sort_keys(struct sort_key *keys, size_t n, size_t offset) {
+  size_t i;
+  for (i = 1; i < n; i++) {
+    struct sort_key key = keys[i];
+    size_t j = i;
+    while (j > 0 && compare_key(&keys[j - 1], &key, offset) > 0) {
+      keys[j] = keys[j - 1];
+      j--;
+    }
+    keys[j] = key;
+  }
+}
+
+/**
+ * @brief キーの上位バイトから順に基数ソートする
+ * 要素数が少なくなった場合は挿入ソートへ切り替える。
+ * 8バイトすべてが一致した集合は、名前の続く8バイトでキーを作り直して続ける。
+ * 対象のバイトが0の集合は名前がそこで終わっており、同一のためそれ以上並べない。
+ *
+ * @param[IN/OUT] keys ソート対象
+ * @param[IN] tmp 作業領域、n要素以上
+ * @param[IN] n 要素数
+ * @param[IN] shift 対象とするバイトのシフト量
+ * @param[IN] offset キーを作成した名前の位置
+ */
+static void radix_sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n, int shift, size_t offset) {
+  size_t count[256];
+  size_t pos[256];
+  size_t i;
+  size_t start;
+  if (shift < 0) {
+    offset += 8;
+    for (i = 0; i < n; i++) {
+      keys[i].prefix = name_prefix(keys[i].info->name + offset);
+    }
+    shift = 56;
+  }
+  if (n <= SORT_INSERTION_MAX) {
+    insertion_sort_keys(keys, n, offset);
+    return;
+  }
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {
+    count[(keys[i].prefix >> shift) & 0xff]++;
+  }
+  start = 0;
+  for (i = 0; i < 256; i++) {
+    pos[i] = start;
+    start += count[i];
+  }
+  for (i = 0; i < n; i++) {
+    tmp[pos[(keys[i].prefix >> shift) & 0xff]++] = keys[i];
+  }
+  memcpy(keys, tmp, sizeof(struct sort_key) * n);
+  start = count[0];
+  for (i = 1; i < 256; i++) {
+    if (count[i] > 1) {
+      radix_sort_keys(keys + start, tmp, count[i], shift - 8, offset);
+    }
+    start += count[i];
+  }
+}
+
+/**
+ * @brief リスト内のソートを行う
+ * ディレクトリを先頭に集めた後、それぞれを名前順に並べる。
+ * 比較のたびにinfoを参照しないよう、キーを連続した配列に作成してソートする。
+ *
+ * @param[IN/OUT] ソート対象のリスト
+ */
+static void sort_list(struct info_list *list) {
+  size_t n = list->used;
+  size_t dirs = 0;
+  size_t d = 0;
+  size_t f = 0;
+  size_t i;
+  struct sort_key *keys;
+  if (n < 2) {
+    return;
+  }
+  keys = xmalloc(sizeof(struct sort_key) * n * 2);
+  for (i = 0; i < n; i++) {
+    if (S_ISDIR(list->array[i]->mode)) {
+      dirs++;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    struct info *info = list->array[i];
+    struct sort_key *key = S_ISDIR(info->mode) ? &keys[d++] : &keys[dirs + f++];
+    key->prefix = name_prefix(info->name);
+    key->info = info;
+  }
+  radix_sort_keys(keys, keys + n, dirs, 56, 0);
+  radix_sort_keys(keys + dirs, keys + n, n - dirs, 56, 0);
+  for (i = 0; i < n; i++) {
+    list->array[i] = keys[i].info;
+  }
+  free(keys);
+}
+
+/**
+ * @brief エントリ情報に基づいて情報を表示する
+ * @param[IN] info 表示する情報
+ */
+static void print_info(struct info *info) {
+  if (long_format) {
+    char buf[12];
+    get_mode_string(info->mode, buf);
+    printf("%s ", buf);
+    printf("%3d ", (int)info->nlink);
+    print_user(info->uid);
+    print_group(info->gid);
+    if (S_ISCHR(info->mode) || S_ISBLK(info->mode)) {
+      printf("%4d,%4d ", major(info->rdev),
+             minor(info->rdev));
+    } else {
+      printf("%9ld ", info->size);
+    }
+    get_time_string(buf, info->mtime);
+    printf("%s ", buf);
+  }
+  if (color) {
+    print_name_with_color(info->name, info->mode, info->link_ok);
+  } else {
+    printf("%s", info->name);
+  }
+  if (classify) {
+    print_type_indicator(info->mode);
+  }
+  if (long_format) {
+    if (info->link != NULL) {
+      printf(" -> ");
+      if (color) {
+        print_name_with_color(info->link, info->link_mode, info->link_ok);
+      } else {
+        printf("%s", info->link);
+      }
+    }
+  }
+  putchar('\n');
+}
+
+/**
+ * @brief パス名からファイル名を取り出す
+ * @param[IN] path パス名
+ * @return path名内のファイル名を指すポインタ
+ */
+static const char *find_filename(const char *path) {
+  int i;
+  size_t path_len = strlen(path);
+  for (i = path_len;i >= 0; i--) {
+    if (path[i] == '/') {
+      return &path[i+1];
+    }
+  }
+  return path;
+}
+
+/**
+ * @brief ディレクトリエントリの読み出しを開始する
+ * 読み出しバッファは全ディレクトリで共有し、初回に確保する。
+ *
+ * @param[OUT] reader 初期化する構造体
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのディレクトリの相対パス
+ * @return 成功した場合true、失敗した場合はerrnoを設定しfalse
+ */
+static bool open_dir_reader(struct dir_reader *reader, int dirfd, const char *path) {
+  reader->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (reader->fd < 0) {
+    return false;
+  }
+  if (dirent_buf == NULL) {
+    dirent_buf = xmalloc(dirent_buf_size);
+  }
+  reader->buf = dirent_buf;
+  reader->pos = 0;
+  reader->end = 0;
+  return true;
+}
+
+/**
+ * @brief 次のディレクトリエントリを読み出す
+ * バッファを使い切った場合のみgetdents64を発行する。
+ * 返却するエントリはバッファ内を直接指しており、次の呼び出しまで有効。
+ *
+ * @param[IN/OUT] reader 読み出し中の構造体
+ * @return ディレクトリエントリ、終端もしくはエラーの場合NULL
+ */
+static struct linux_dirent64 *read_dir_entry(struct dir_reader *reader) {
+  struct linux_dirent64 *dent;
+  if (reader->pos >= reader->end) {
+    long n = syscall(SYS_getdents64, reader->fd, reader->buf, dirent_buf_size);
+    if (n <= 0) {
+      if (n < 0) {
+        perror("getdents64");
+      }
+      return NULL;
+    }
+    reader->pos = 0;
+    reader->end = n;
+  }
+  dent = (struct linux_dirent64 *)(reader->buf + reader->pos);
+  reader->pos += dent->d_reclen;
+  return dent;
+}
+
+/**
+ * @brief getdents64で読み出した分をすべて返したかを判定する
+ * @param[IN] reader 読み出し中の構造体
+ * @return 次の読み出しでgetdents64を発行する場合true
+ */
+static bool is_batch_end(const struct dir_reader *reader) {
+  return reader->pos >= reader->end;
+}
+
+/**
+ * @brief ディレクトリエントリの読み出しを終了する
+ * @param[IN] reader 終了する構造体
+ */
+static void close_dir_reader(struct dir_reader *reader) {
+  close(reader->fd);
+}
+
+/**
+ * @brief 指定パスのディレクトリエントリをリストする
+ * @param[IN] base パス
+ */
+static void list_dir(struct dir_path *base) {
+  const char *base_path = base->path;
+  int i;
+  struct dir_reader reader;
+  struct linux_dirent64 *dent;
+  char path[PATH_MAX + 1];
+  size_t path_len;
+  struct info_list list;
+  struct dir_path *subque = base;
+  struct dir_fd *self = NULL;
+  struct uring *ring = get_uring();
+  struct stat_pool *pool = ring == NULL ? get_stat_pool() : NULL;
+  int parent_fd = base->parent != NULL ? base->parent->fd : AT_FDCWD;
+  if (!open_dir_reader(&reader, parent_fd, base->name)) {
+    if (errno == ENOTDIR) {
+      const char *name = find_filename(base_path);
+      struct info *info;
+      init_info_list(&list, 1);
+      info = new_info(parent_fd, base->name, name, DT_UNKNOWN, &list);
+      if (info != NULL) {
+        print_info(info);
+        add_info(&list, info);
+      } else {
+        perror(base_path);
+      }
+      free_info_list(&list);
+    } else {
+      perror(base_path);
+    }
+    release_dir_fd(base->parent);
+    return;
+  }
+  release_dir_fd(base->parent);
+  path_len = strlen(base_path);
+  if (path_len >= PATH_MAX - 1) {
+    fprintf(stderr, "too long path\n");
+    close_dir_reader(&reader);
+    return;
+  }
+  strncpy(path, base_path, PATH_MAX);
+  if (path[path_len - 1] != '/') {
+    path[path_len] = '/';
+    path_len++;
+    path[path_len] = '\0';
+  }
+  init_info_list(&list, 100);
+  while ((dent = read_dir_entry(&reader)) != NULL) {
+    struct info *info;
+    const char *name = dent->d_name;
+    if (filter != FILTER_ALL
+        && name[0] == '.'
+        && (filter == FILTER_DEFAULT
+            || name[1 + (name[1] == '.')] == '\0')) {
+      continue;
+    }
+    if (ring != NULL && need_stat(dent->d_type)) {
+      info = alloc_info(&list, name);
+      add_uring_job(ring, reader.fd, info, list.links);
+    } else if (pool != NULL && need_stat(dent->d_type)) {
+      info = alloc_info(&list, name);
+      submit_stat_job(pool, reader.fd, info, dent->d_type, list.links);
+    } else {
+      info = new_info(reader.fd, name, name, dent->d_type, &list);
+      if (info == NULL) {
+        fprintf(stderr, "%s%s: %s\n", path, name, strerror(errno));
+        continue;
+      }
+    }
+    add_info(&list, info);
+    if (ring != NULL && is_batch_end(&reader)) {
+      run_uring_jobs(ring, reader.fd, list.links);
+    }
+  }
+  if (ring != NULL) {
+    run_uring_jobs(ring, reader.fd, list.links);
+    remove_failed_info(&list, path);
+  } else if (pool != NULL) {
+    wait_stat_jobs(pool);
+    remove_failed_info(&list, path);
+  }
+  sort_list(&list);
+  for (i = 0; i < list.used; i++) {
+    struct info *info = list.array[i];
+    if (recursive && S_ISDIR(info->mode)) {
+      const char *name = info->name;
+      if (!(name[0] == '.'
+          && name[1 + (name[1] == '.')] == '\0')) {
+        if (self == NULL) {
+          self = new_dir_fd(reader.fd);
+        }
+        self->ref++;
+        strncpy(&path[path_len], name, PATH_MAX - path_len);
+        subque->next = new_dir_path(path, self, base->depth + 1, subque->next);
+        subque = subque->next;
+      }
+    }
+    print_info(info);
+  }
+  if (self == NULL) {
+    close_dir_reader(&reader);
+  }
+  free_info_list(&list);
+}
+
+int main(int argc, char**argv) {
+  struct dir_path *head = parse_cmd_args(argc, argv);
+  if (head == NULL) {
+    return EXIT_FAILURE;
+  }
+  while(head != NULL) {
+    if (head->depth != 0) {
+      printf("\n%s:\n", head->path);
+    }
+    list_dir(head);
+    struct dir_path *tmp = head;
+    head = head->next;
+    free(tmp);
+  }
+  if (show_stats) {
+    print_stats();
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,3419 @@
+/**
+ * @file ls33.c
+ *
+ * Copyright (c) 2015 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief lsコマンド風のプログラムを作るNo.33
+ * 並列な再帰表示の出力順の再構成とメモリ上限
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2026/10/17
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#define PATH_MAX 4096
+#define HALF_YEAR_SECOND (365 * 24 * 60 * 60 / 2)
+#define DIRENT_BUF_DEFAULT (256 * 1024)
+#define DIRENT_BUF_MIN (4 * 1024)
+#define DIRENT_BUF_MAX (64 * 1024 * 1024)
+#define STAT_QUEUE_SIZE 1024
+#define URING_ENTRIES 256
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define SORT_INSERTION_MAX 32
+#define ID_CACHE_INITIAL_SIZE 64
+#define OUT_BUF_DEFAULT (256 * 1024)
+#define OUT_BUF_MIN (4 * 1024)
+#define OUT_BUF_MAX (64 * 1024 * 1024)
+#define COLOR_SEQ(seq) { seq, sizeof(seq) - 1 }
+#define EXT_COLOR_INITIAL_SIZE 64
+#define EXT_COLOR_MAX_LEN 64
+#define TASK_DEQUE_INITIAL_SIZE 64
+#define WALK_BUFFER_DEFAULT (64 * 1024 * 1024)
+
+#ifndef S_IXUGO
+#define S_IXUGO (S_IXUSR | S_IXGRP | S_IXOTH)
+#endif
+
+/**
+ * 隠しファイルの表示方針
+ */
+enum {
+  FILTER_DEFAULT, /**< '.'から始まるもの以外を表示する */
+  FILTER_ALMOST,  /**< '.'と'..'以外を表示する */
+  FILTER_ALL,     /**< すべて表示する */
+};
+
+/**
+ * 短縮形を持たないオプション
+ */
+enum {
+  OPT_BUFFER_SIZE = 256, /**< getdents64のバッファサイズ */
+  OPT_THREADS,           /**< 情報取得のスレッド数 */
+  OPT_IO_URING,          /**< io_uringによる情報取得 */
+  OPT_STATS,             /**< 統計情報の表示 */
+  OPT_OUTPUT_BUFFER,     /**< 出力バッファのサイズ */
+  OPT_WALKERS,           /**< 再帰的な表示のスレッド数 */
+  OPT_WALK_BUFFER,       /**< 並列な再帰表示で出力待ちにできるメモリ量 */
+};
+
+/**
+ * 色付き表示の分類
+ */
+enum {
+  COLOR_NONE,                  /**< 不明な種別 */
+  COLOR_FILE,                  /**< 通常ファイル */
+  COLOR_SETUID,                /**< setuidされたファイル */
+  COLOR_SETGID,                /**< setgidされたファイル */
+  COLOR_EXEC,                  /**< 実行可能なファイル */
+  COLOR_DIR,                   /**< ディレクトリ */
+  COLOR_STICKY_OTHER_WRITABLE, /**< スティッキーかつ他者書き込み可能なディレクトリ */
+  COLOR_OTHER_WRITABLE,        /**< 他者書き込み可能なディレクトリ */
+  COLOR_STICKY,                /**< スティッキーなディレクトリ */
+  COLOR_LINK,                  /**< シンボリックリンク */
+  COLOR_FIFO,                  /**< 名前付きパイプ */
+  COLOR_SOCK,                  /**< ソケット */
+  COLOR_BLK,                   /**< ブロックデバイス */
+  COLOR_CHR,                   /**< キャラクタデバイス */
+  COLOR_ORPHAN,                /**< リンク先が存在しない */
+  COLOR_NUM,
+};
+
+/**
+ * getdents64で取得するディレクトリエントリ
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * getdents64によるディレクトリエントリの読み出し
+ */
+struct dir_reader {
+  int fd;
+  char *buf;
+  size_t pos;
+  size_t end;
+};
+
+/**
+ * 子ディレクトリを開くために保持する親ディレクトリのfd
+ * 参照している子ディレクトリがすべて処理されたところでcloseする
+ */
+struct dir_fd {
+  int fd;
+  int ref;
+};
+
+/**
+ * 再帰呼び出しのためのディレクトリ名を保持するリンクリスト
+ */
+struct dir_path {
+  char path[PATH_MAX + 1];
+  const char *name;
+  struct dir_fd *parent;
+  int depth;
+  struct dir_path *next;
+};
+
+/**
+ * アリーナの領域の塊
+ */
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  max_align_t data[];
+};
+
+/**
+ * 先頭から順に切り出していくメモリ領域
+ * 個別の開放はできず、reset_arenaで一括して開放する。
+ * 開放した塊は手放さずに次の確保で再利用する。
+ */
+struct arena {
+  struct arena_chunk *head;
+  struct arena_chunk *current;
+  size_t used;
+};
+
+/**
+ * ファイル情報の格納
+ * 構造体と名前、リンク先はアリーナに格納し、リンク先はシンボリックリンクの場合のみ持つ。
+ * statの結果は表示に使う項目のみを保持する。
+ */
+struct info {
+  const char *name;
+  const char *link;
+  off_t size;
+  dev_t rdev;
+  time_t mtime;
+  mode_t mode;
+  mode_t link_mode;
+  uid_t uid;
+  gid_t gid;
+  unsigned int nlink;
+  int error;
+  bool link_ok;
+};
+
+/**
+ * ファイル情報を格納する可変長リスト
+ */
+struct info_list {
+  struct info **array;
+  int size;
+  int used;
+  struct arena *arena;
+  struct arena *links;
+};
+
+/**
+ * ソート用のキー
+ * 名前の8バイトをビッグエンディアンで詰めた値を持ち、
+ * 大小関係がstrcmpの該当8バイトの比較と一致する。
+ */
+struct sort_key {
+  uint64_t prefix;
+  struct info *info;
+};
+
+/**
+ * 標準出力への出力バッファ
+ * stdioを介さず、一杯になった時点でまとめてwriteする
+ */
+struct out_buf {
+  char *buf;
+  size_t size;
+  size_t used;
+};
+
+/**
+ * uid/gidと名前の対応
+ */
+struct id_entry {
+  unsigned int id;
+  bool used;
+  char *name;
+};
+
+/**
+ * 時刻表示文字列のキャッシュ
+ * UTCからのオフセットが一定であるローカル日付1日分の範囲と、
+ * その日の文字列、直前に作成した分単位の文字列を保持する
+ */
+struct time_cache {
+  time_t day_start;
+  time_t day_end;
+  char date[6];
+  char old[12];
+  time_t minute;
+  char recent[12];
+};
+
+/**
+ * 色付き表示のエスケープシーケンス
+ */
+struct color_seq {
+  const char *seq;
+  size_t len;
+};
+
+/**
+ * 拡張子ごとの色付き表示
+ * 拡張子は小文字で保持する
+ */
+struct ext_color {
+  char *ext;
+  size_t len;
+  struct color_seq seq;
+  int order;
+};
+
+/**
+ * 拡張子以外のパターンによる色付き表示
+ * "*"に続く部分にワイルドカードを含まない場合は末尾の比較だけで照合する
+ */
+struct pattern_color {
+  char *pattern;
+  size_t suffix_len;
+  bool suffix;
+  struct color_seq seq;
+  int order;
+};
+
+/**
+ * LS_COLORSのパターン指定
+ * 最後の'.'以降を拡張子とするハッシュテーブルと、それ以外のパターンのリストからなる。
+ * 複数に一致する場合はLS_COLORSで後に指定されたものを優先する。
+ */
+struct ext_colors {
+  struct ext_color *table;
+  size_t size;
+  size_t used;
+  size_t max_len;
+  struct pattern_color *patterns;
+  size_t pattern_num;
+};
+
+/**
+ * uid/gidから名前を引くオープンアドレス法のハッシュテーブル
+ * 名前が見つからなかったものもNULLとして記録する
+ */
+struct id_cache {
+  struct id_entry *table;
+  size_t size;
+  size_t used;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/**
+ * ワーカースレッドへ依頼する情報取得
+ */
+struct stat_job {
+  struct info *info;
+  struct arena *links;
+  int dirfd;
+  unsigned char d_type;
+};
+
+/**
+ * 情報取得を行うワーカースレッドと依頼のキュー
+ */
+struct stat_pool {
+  struct stat_job jobs[STAT_QUEUE_SIZE];
+  int head;
+  int count;
+  int pending;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t done;
+};
+
+/**
+ * io_uringへ依頼する情報取得
+ */
+struct uring_job {
+  struct info *info;
+  struct statx stx;
+  int res;
+};
+
+/**
+ * io_uringのリングと依頼待ちの情報取得
+ */
+struct uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct uring_job jobs[URING_ENTRIES];
+  int used;
+};
+
+/**
+ * 並列な再帰表示で1つのディレクトリを処理するタスク
+ * 表示順に並べた木を構成し、表示内容は処理したワーカーがtextへ作成する
+ */
+struct dir_task {
+  struct dir_path *dir;
+  struct dir_task *parent;
+  struct dir_task *child;
+  struct dir_task *sibling;
+  char *text;
+  size_t len;
+  size_t size;
+  char *error;
+  size_t error_len;
+  bool running;
+  bool done;
+};
+
+/**
+ * ワーカーごとのタスクの両端キュー
+ * 所有するワーカーは末尾から、他のワーカーは先頭から取り出す
+ */
+struct task_deque {
+  pthread_mutex_t mutex;
+  struct dir_task **array;
+  size_t size;
+  size_t head;
+  size_t tail;
+};
+
+/**
+ * 並列な再帰表示のワーカー
+ */
+struct walker {
+  pthread_t thread;
+  int index;
+  struct task_deque deque;
+  unsigned long tasks;
+  unsigned long steals;
+  struct id_cache user_cache;
+  struct id_cache group_cache;
+};
+
+/**
+ * 並列な再帰表示の全体の状態
+ * 件数とメモリ量はアトミックに操作し、それ以外はmutexで保護する。
+ * walkersの末尾の要素は出力を行うメインスレッドのもの
+ */
+struct walk {
+  struct walker *walkers;
+  int num;
+  long queued;
+  long outstanding;
+  int sleepers;
+  bool finished;
+  size_t buffered;
+  size_t buffered_max;
+  int stalled;
+  long stall_ns;
+  long emit_wait_ns;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_cond_t space;
+};
+
+static void *xmalloc(size_t n);
+static void *xrealloc(void *ptr, size_t size);
+static bool parse_size(const char *str, size_t *size);
+static void write_all(const char *buf, size_t len);
+static void out_flush(void);
+static void flush_before_error(void);
+static void out_grow(size_t len);
+static void out_write(const char *str, size_t len);
+static void out_putc(char c);
+static void out_puts(const char *str);
+static void out_printf(const char *format, ...);
+static void print_error(const char *format, ...);
+static char *out_reserve(size_t len);
+static int count_digits(unsigned long value);
+static void out_int(long value, int width);
+static void out_str_right(const char *str, int width);
+static struct dir_path *parse_cmd_args(int argc, char**argv);
+static void get_mode_string(mode_t mode, char *str);
+static void print_type_indicator(mode_t mode);
+static char *resolve_user(unsigned int uid);
+static char *resolve_group(unsigned int gid);
+static struct id_entry *find_id_entry(struct id_entry *table, size_t size, unsigned int id);
+static const char *lookup_id(struct id_cache *cache, unsigned int id, char *(*resolve)(unsigned int));
+static void print_user(uid_t uid);
+static void print_group(gid_t gid);
+static void print_stats(void);
+static bool update_time_cache(time_t time);
+static void get_time_string(char *str, time_t time);
+static bool make_color_seq(const char *value, size_t len, struct color_seq *seq);
+static int find_color_code(const char *code, size_t len);
+static size_t hash_ext(const char *ext, size_t len);
+static struct ext_color *find_ext_entry(struct ext_color *table, size_t size, const char *ext, size_t len);
+static void add_ext_color(const char *ext, size_t len, const struct color_seq *seq, int order);
+static void add_pattern_color(const char *pattern, size_t len, const struct color_seq *seq, int order);
+static void parse_ls_colors(const char *env);
+static const struct color_seq *find_ext_color(const char *name, size_t len);
+static bool is_colored(int color_class);
+static int get_color_class(mode_t mode, bool link_ok);
+static void print_name_with_color(const char *name, mode_t mode, bool link_ok);
+static struct dir_fd *new_dir_fd(int fd);
+static void release_dir_fd(struct dir_fd *dir_fd);
+static struct dir_path *new_dir_path(const char *path, struct dir_fd *parent, int depth, struct dir_path *next);
+static void *arena_alloc(struct arena *arena, size_t size, size_t align);
+static const char *arena_strdup(struct arena *arena, const char *str, size_t len);
+static void reset_arena(struct arena *arena);
+static void init_info_list(struct info_list *list, int size);
+static void free_info_list(struct info_list *list);
+static void add_info(struct info_list *list, struct info *info);
+static void init_stat_mask(void);
+static void check_statx(void);
+static void statx_to_stat(const struct statx *stx, struct stat *st);
+static int stat_entry(int dirfd, const char *path, int flags, unsigned int mask, struct stat *st);
+static bool need_stat(unsigned char d_type);
+static void set_info_stat(struct info *info, const struct stat *st);
+static void read_link(int dirfd, const char *path, struct info *info, struct arena *links);
+static int fill_info(int dirfd, const char *path, struct info *info, unsigned char d_type, struct arena *links);
+static struct info *alloc_info(struct info_list *list, const char *name);
+static struct info *new_info(int dirfd, const char *path, const char *name, unsigned char d_type, struct info_list *list);
+static void *stat_worker(void *arg);
+static struct stat_pool *new_stat_pool(long threads);
+static struct stat_pool *get_stat_pool(void);
+static void submit_stat_job(struct stat_pool *pool, int dirfd, struct info *info, unsigned char d_type, struct arena *links);
+static void wait_stat_jobs(struct stat_pool *pool);
+static void remove_failed_info(struct info_list *list, const char *path);
+static struct uring *new_uring(void);
+static struct uring *get_uring(void);
+static void submit_uring_statx(struct uring *ring, int index, int dirfd, const char *path, int flags, unsigned int mask);
+static void wait_uring(struct uring *ring, int count);
+static void run_uring_jobs(struct uring *ring, int dirfd, struct arena *links);
+static void add_uring_job(struct uring *ring, int dirfd, struct info *info, struct arena *links);
+static uint64_t name_prefix(const char *name);
+static int compare_key(const struct sort_key *a, const struct sort_key *b, size_t offset);
+static void insertion_sort_keys(struct sort_key *keys, size_t n, size_t offset);
+static void radix_sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n, int shift, size_t offset);
+static void sort_list(struct info_list *list);
+static void print_info(struct info *info);
+static bool is_hidden(const char *name);
+static void print_list(struct info_list *list, struct dir_path *base, int fd, struct dir_fd **self, struct dir_path **subque, char *path, size_t path_len);
+static const char *find_filename(const char *path);
+static bool open_dir_reader(struct dir_reader *reader, int dirfd, const char *path);
+static struct linux_dirent64 *read_dir_entry(struct dir_reader *reader);
+static bool is_batch_end(const struct dir_reader *reader);
+static void close_dir_reader(struct dir_reader *reader);
+static void list_dir(struct dir_path *base);
+static void push_task(struct task_deque *deque, struct dir_task *task);
+static struct dir_task *pop_task(struct task_deque *deque);
+static struct dir_task *steal_task(struct task_deque *deque);
+static struct dir_task *take_task(struct walker *walker);
+static bool remove_task(struct task_deque *deque, struct dir_task *task);
+static long now_ns(void);
+static void add_buffered(long size);
+static void wait_for_space(void);
+static struct dir_task *new_dir_task(struct dir_path *dir, struct dir_task *parent);
+static void run_task(struct walker *walker, struct dir_task *task);
+static void init_walker_stat(void);
+static void *walk_worker(void *arg);
+static void write_task_output(const struct dir_task *task);
+static void emit_tasks(struct dir_task *task);
+static void walk_parallel(struct dir_path *head);
+
+/**
+ * 隠しファイルの表示方針
+ */
+static int filter = FILTER_DEFAULT;
+/**
+ * 色付き表示する
+ */
+static bool color = false;
+/**
+ * 分類ごとの色付き表示のエスケープシーケンス
+ */
+static struct color_seq color_table[COLOR_NUM] = {
+  [COLOR_NONE] = COLOR_SEQ(""),
+  [COLOR_FILE] = COLOR_SEQ("\033[0m"),
+  [COLOR_SETUID] = COLOR_SEQ("\033[37;41m"),
+  [COLOR_SETGID] = COLOR_SEQ("\033[30;43m"),
+  [COLOR_EXEC] = COLOR_SEQ("\033[01;32m"),
+  [COLOR_DIR] = COLOR_SEQ("\033[01;34m"),
+  [COLOR_STICKY_OTHER_WRITABLE] = COLOR_SEQ("\033[30;42m"),
+  [COLOR_OTHER_WRITABLE] = COLOR_SEQ("\033[34;42m"),
+  [COLOR_STICKY] = COLOR_SEQ("\033[37;44m"),
+  [COLOR_LINK] = COLOR_SEQ("\033[01;36m"),
+  [COLOR_FIFO] = COLOR_SEQ("\033[33m"),
+  [COLOR_SOCK] = COLOR_SEQ("\033[01;35m"),
+  [COLOR_BLK] = COLOR_SEQ("\033[01;33m"),
+  [COLOR_CHR] = COLOR_SEQ("\033[01;33m"),
+  [COLOR_ORPHAN] = COLOR_SEQ("\033[31m"),
+};
+/**
+ * シンボリックリンクをリンク先の分類で色付けする、LS_COLORSのln=targetで指定する
+ */
+static bool color_link_target = false;
+/**
+ * 色付き表示の終了シーケンス
+ */
+static struct color_seq color_reset = COLOR_SEQ("\033[0m");
+/**
+ * LS_COLORSで指定された拡張子とパターンの色付き表示
+ */
+static struct ext_colors ext_colors;
+/**
+ * 属性を示す文字を表示する
+ */
+static bool classify = false;
+/**
+ * ロングフォーマットで表示する
+ */
+static bool long_format = false;
+/**
+ * 半年前のUNIX時間
+ */
+static time_t half_year_ago;
+/**
+ * 時刻表示文字列のキャッシュ
+ */
+static _Thread_local struct time_cache time_cache;
+/**
+ * 再帰的な表示
+ */
+static bool recursive = false;
+/**
+ * ソートせず読み出した順に逐次表示する
+ */
+static bool unsorted = false;
+/**
+ * getdents64の読み出しバッファ
+ */
+static _Thread_local char *dirent_buf = NULL;
+/**
+ * getdents64の読み出しバッファのサイズ
+ */
+static size_t dirent_buf_size = DIRENT_BUF_DEFAULT;
+/**
+ * エントリ自身について取得する情報のstatxマスク
+ */
+static unsigned int stat_mask = STATX_TYPE;
+/**
+ * シンボリックリンクのリンク先について取得する情報のstatxマスク
+ * 0の場合はリンク先を調べない
+ */
+static unsigned int link_stat_mask = 0;
+/**
+ * リンク先文字列を読み出す
+ */
+static bool need_link = false;
+/**
+ * statxが使えない環境ではfstatatを使う
+ */
+static bool statx_unsupported = false;
+/**
+ * 情報取得のスレッド数、1以下の場合はメインスレッドで行う
+ */
+static long stat_threads = 0;
+/**
+ * 情報取得を行うワーカースレッド
+ */
+static struct stat_pool *stat_pool = NULL;
+/**
+ * io_uringによる情報取得を行う
+ */
+static bool use_uring = false;
+/**
+ * io_uringのリング、使えない場合はNULL
+ */
+static struct uring *uring = NULL;
+/**
+ * 並列な再帰表示のワーカーごとのio_uringのリング、使わない場合はNULL
+ */
+static _Thread_local struct uring *walker_uring = NULL;
+/**
+ * 並列な再帰表示のワーカーごとの情報取得のスレッド、使わない場合はNULL
+ */
+static _Thread_local struct stat_pool *walker_pool = NULL;
+/**
+ * リンク先の格納はワーカースレッドからも行うため排他する
+ */
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * 1ディレクトリ分のエントリ情報構造体と名前を格納するアリーナ
+ */
+static _Thread_local struct arena entry_arena;
+/**
+ * 1ディレクトリ分のリンク先を格納するアリーナ
+ */
+static _Thread_local struct arena link_arena;
+/**
+ * 統計情報を表示する
+ */
+static bool show_stats = false;
+/**
+ * uidからユーザ名へのキャッシュ
+ */
+static _Thread_local struct id_cache user_cache;
+/**
+ * gidからグループ名へのキャッシュ
+ */
+static _Thread_local struct id_cache group_cache;
+/**
+ * getpwuid/getgrgidの呼び出しを保護する
+ */
+static pthread_mutex_t id_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * 標準出力への出力バッファ
+ */
+static _Thread_local struct out_buf out;
+/**
+ * 出力バッファのサイズ
+ */
+static size_t out_buf_size = OUT_BUF_DEFAULT;
+/**
+ * 標準出力が端末の場合はディレクトリごとに出力する
+ */
+static bool out_interactive = false;
+/**
+ * 出力を書き出さずにバッファへ溜める
+ * 並列な再帰表示のワーカーで使用する
+ */
+static _Thread_local bool out_capture = false;
+/**
+ * 並列な再帰表示のワーカーで、表示順に出力するまで溜めるエラーメッセージ
+ */
+static _Thread_local struct out_buf err_out;
+/**
+ * 再帰的な表示のスレッド数、1以下の場合はメインスレッドで行う
+ */
+static long walk_threads = 0;
+/**
+ * 並列な再帰表示で出力待ちにできるメモリ量
+ */
+static size_t walk_buffer_size = WALK_BUFFER_DEFAULT;
+/**
+ * 並列な再帰表示の状態
+ */
+static struct walk walk;
+
+/**
+ * @brief malloc結果がNULLだった場合にexitする。
+ * @param[IN] size 確保サイズ
+ * @retrun 確保された領域へのポインタ
+ */
+static void *xmalloc(size_t n) {
+  void *p = malloc(n);
+  if (p == NULL) {
+    perror("");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * @brief realloc結果がNULLだった場合にexitする。
+ * @param[IN] ptr 拡張する領域ポインタ
+ * @param[IN] size 確保サイズ
+ * @retrun 確保された領域へのポインタ
+ */
+static void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (p == NULL) {
+    perror("");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * @brief サイズ指定文字列をパースする
+ * 末尾にK/Mを付けた場合はKiB/MiB単位とする
+ *
+ * @param[IN] str 文字列
+ * @param[OUT] size サイズの格納先
+ * @return 成功した場合true
+ */
+static bool parse_size(const char *str, size_t *size) {
+  char *end;
+  unsigned long value = strtoul(str, &end, 10);
+  if (end == str) {
+    return false;
+  }
+  if (*end == 'K' || *end == 'k') {
+    value *= 1024;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    value *= 1024 * 1024;
+    end++;
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  *size = value;
+  return true;
+}
+
+/**
+ * @brief 標準出力へすべて書き出す
+ * 書き出せなかった場合はexitする。
+ *
+ * @param[IN] buf 出力する内容
+ * @param[IN] len 長さ
+ */
+static void write_all(const char *buf, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    ssize_t n = write(STDOUT_FILENO, buf + pos, len - pos);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    pos += n;
+  }
+}
+
+/**
+ * @brief 出力バッファの内容を標準出力へ書き出す
+ */
+static void out_flush(void) {
+  write_all(out.buf, out.used);
+  out.used = 0;
+}
+
+/**
+ * @brief エラーメッセージを出力する前に出力バッファを書き出す
+ * 標準出力が端末の場合、見出しなど先に表示した内容がエラーメッセージより後に表示されないようにする。
+ * 出力を溜めている場合は書き出さない。
+ */
+static void flush_before_error(void) {
+  if (out_interactive && !out_capture) {
+    out_flush();
+  }
+}
+
+/**
+ * @brief 出力を溜めるバッファを拡張する
+ * 確保した量は並列な再帰表示の出力待ちのメモリ量に計上する
+ * @param[IN] len 追加で必要な長さ
+ */
+static void out_grow(size_t len) {
+  size_t size = out.size != 0 ? out.size : OUT_BUF_MIN;
+  while (size - out.used < len) {
+    size *= 2;
+  }
+  out.buf = xrealloc(out.buf, size);
+  add_buffered(size - out.size);
+  out.size = size;
+}
+
+/**
+ * @brief 出力バッファへ追記する
+ * 空きが足りない場合は書き出してから追記する。
+ * バッファより大きい場合は直接書き出す。
+ *
+ * @param[IN] str 出力する内容
+ * @param[IN] len 長さ
+ */
+static void out_write(const char *str, size_t len) {
+  if (out.size - out.used < len) {
+    if (out_capture) {
+      out_grow(len);
+    } else {
+      if (out.buf == NULL) {
+        out.buf = xmalloc(out_buf_size);
+        out.size = out_buf_size;
+      }
+      out_flush();
+    }
+    if (len > out.size - out.used) {
+      write_all(str, len);
+      return;
+    }
+  }
+  memcpy(out.buf + out.used, str, len);
+  out.used += len;
+}
+
+/**
+ * @brief 出力バッファへ1文字追記する
+ * @param[IN] c 出力する文字
+ */
+static void out_putc(char c) {
+  if (out.used == out.size) {
+    out_write(&c, 1);
+    return;
+  }
+  out.buf[out.used] = c;
+  out.used++;
+}
+
+/**
+ * @brief 出力バッファへ文字列を追記する
+ * @param[IN] str 出力する文字列
+ */
+static void out_puts(const char *str) {
+  out_write(str, strlen(str));
+}
+
+/**
+ * @brief 出力バッファへ書式付きで追記する
+ * @param[IN] format 書式
+ */
+static void out_printf(const char *format, ...) {
+  char buf[PATH_MAX + 64];
+  va_list ap;
+  int len;
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len >= sizeof(buf)) {
+    char *large = xmalloc(len + 1);
+    va_start(ap, format);
+    vsnprintf(large, len + 1, format, ap);
+    va_end(ap);
+    out_write(large, len);
+    free(large);
+    return;
+  }
+  out_write(buf, len);
+}
+
+/**
+ * @brief エラーメッセージを標準エラー出力へ出力する
+ * 並列な再帰表示のワーカーでは、逐次処理と同じ順序で出力できるようタスクごとに溜める。
+ *
+ * @param[IN] format 書式
+ */
+static void print_error(const char *format, ...) {
+  char buf[PATH_MAX + 64];
+  va_list ap;
+  size_t need;
+  int len;
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len >= sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+  if (!out_capture) {
+    flush_before_error();
+    fputs(buf, stderr);
+    return;
+  }
+  /* 出力する側で表示内容の間へ挟めるよう、その時点の表示内容の長さを前に付ける */
+  need = sizeof(size_t) + len + 1;
+  if (err_out.size - err_out.used < need) {
+    size_t size = err_out.size != 0 ? err_out.size : 256;
+    while (size - err_out.used < need) {
+      size *= 2;
+    }
+    err_out.buf = xrealloc(err_out.buf, size);
+    err_out.size = size;
+  }
+  memcpy(err_out.buf + err_out.used, &out.used, sizeof(size_t));
+  memcpy(err_out.buf + err_out.used + sizeof(size_t), buf, len + 1);
+  err_out.used += need;
+}
+
+/**
+ * @brief 出力バッファに指定長の空きを確保する
+ * 確保した領域は出力済みとして扱うため、呼び出し側ですべて書き込むこと。
+ *
+ * @param[IN] len 確保する長さ、出力バッファのサイズ以下
+ * @return 書き込み先
+ */
+static char *out_reserve(size_t len) {
+  char *p;
+  if (out_capture) {
+    if (out.size - out.used < len) {
+      out_grow(len);
+    }
+  } else if (out.size - out.used < len) {
+    if (out.buf == NULL) {
+      out.buf = xmalloc(out_buf_size);
+      out.size = out_buf_size;
+    }
+    out_flush();
+  }
+  p = out.buf + out.used;
+  out.used += len;
+  return p;
+}
+
+/**
+ * @brief 10進数の桁数を数える
+ * @param[IN] value 値
+ * @return 桁数
+ */
+static int count_digits(unsigned long value) {
+  int digits = 1;
+  while (value >= 10000) {
+    value /= 10000;
+    digits += 4;
+  }
+  if (value >= 1000) {
+    return digits + 3;
+  }
+  if (value >= 100) {
+    return digits + 2;
+  }
+  if (value >= 10) {
+    return digits + 1;
+  }
+  return digits;
+}
+
+/**
+ * @brief 整数を右詰めで出力バッファへ書き込む
+ * printf("%*ld")と同じ出力を、書式の解釈なしに2桁ずつの表引きで作る。
+ * 桁数が幅を超える場合は幅を無視してすべての桁を書き込む。
+ *
+ * @param[IN] value 値
+ * @param[IN] width 幅
+ */
+static void out_int(long value, int width) {
+  static const char digit_pairs[] =
+      "00010203040506070809"
+      "10111213141516171819"
+      "20212223242526272829"
+      "30313233343536373839"
+      "40414243444546474849"
+      "50515253545556575859"
+      "60616263646566676869"
+      "70717273747576777879"
+      "80818283848586878889"
+      "90919293949596979899";
+  unsigned long abs = value < 0 ? -(unsigned long)value : (unsigned long)value;
+  int len = count_digits(abs) + (value < 0);
+  int total = len > width ? len : width;
+  char *p = out_reserve(total);
+  char *end = p + total;
+  memset(p, ' ', total - len);
+  while (abs >= 100) {
+    const char *pair = &digit_pairs[(abs % 100) * 2];
+    abs /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (abs >= 10) {
+    const char *pair = &digit_pairs[abs * 2];
+    *--end = pair[1];
+    *--end = pair[0];
+  } else {
+    *--end = '0' + abs;
+  }
+  if (value < 0) {
+    *--end = '-';
+  }
+}
+
+/**
+ * @brief 文字列を右詰めで出力バッファへ書き込む
+ * @param[IN] str 文字列
+ * @param[IN] width 幅
+ */
+static void out_str_right(const char *str, int width) {
+  int len = strlen(str);
+  if (len < width) {
+    memset(out_reserve(width - len), ' ', width - len);
+  }
+  out_write(str, len);
+}
+
+/**
+ * @brief コマンドライン引数をパースする
+ * @param[IN] argc 引数の数
+ * @param[IN/OUT] argv 引数配列
+ * @return パス
+ */
+static struct dir_path *parse_cmd_args(int argc, char**argv) {
+  int opt;
+  const struct option longopts[] = {
+      { "all", no_argument, NULL, 'a' },
+      { "almost-all", no_argument, NULL, 'A' },
+      { "color", no_argument, NULL, 'C' },
+      { "classify", no_argument, NULL, 'F' },
+      { "long-format", no_argument, NULL, 'l' },
+      { "recursive", no_argument, NULL, 'R' },
+      { "unsorted", no_argument, NULL, 'U' },
+      { "buffer-size", required_argument, NULL, OPT_BUFFER_SIZE },
+      { "threads", required_argument, NULL, OPT_THREADS },
+      { "io-uring", no_argument, NULL, OPT_IO_URING },
+      { "stats", no_argument, NULL, OPT_STATS },
+      { "output-buffer", required_argument, NULL, OPT_OUTPUT_BUFFER },
+      { "walkers", required_argument, NULL, OPT_WALKERS },
+      { "walk-buffer", required_argument, NULL, OPT_WALK_BUFFER },
+      { 0, 0, 0, 0 },
+  };
+  while ((opt = getopt_long(argc, argv, "aACfFlRU", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        filter = FILTER_ALL;
+        break;
+      case 'A':
+        filter = FILTER_ALMOST;
+        break;
+      case 'C':
+        if (isatty(STDOUT_FILENO)) {
+          color = true;
+        }
+        break;
+      case 'F':
+        classify = true;
+        break;
+      case 'l':
+        long_format = true;
+        half_year_ago = time(NULL) - HALF_YEAR_SECOND;
+        tzset();
+        break;
+      case 'R':
+        recursive = true;
+        break;
+      case 'U':
+        unsorted = true;
+        break;
+      case 'f':
+        filter = FILTER_ALL;
+        unsorted = true;
+        break;
+      case OPT_BUFFER_SIZE:
+        if (!parse_size(optarg, &dirent_buf_size)
+            || dirent_buf_size < DIRENT_BUF_MIN
+            || dirent_buf_size > DIRENT_BUF_MAX) {
+          fprintf(stderr, "invalid buffer size: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      case OPT_THREADS: {
+        char *end;
+        stat_threads = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || stat_threads < 1) {
+          fprintf(stderr, "invalid number of threads: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      }
+      case OPT_IO_URING:
+        use_uring = true;
+        break;
+      case OPT_STATS:
+        show_stats = true;
+        break;
+      case OPT_OUTPUT_BUFFER:
+        if (!parse_size(optarg, &out_buf_size)
+            || out_buf_size < OUT_BUF_MIN
+            || out_buf_size > OUT_BUF_MAX) {
+          fprintf(stderr, "invalid output buffer size: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      case OPT_WALKERS: {
+        char *end;
+        walk_threads = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || walk_threads < 1) {
+          fprintf(stderr, "invalid number of walkers: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      }
+      case OPT_WALK_BUFFER:
+        if (!parse_size(optarg, &walk_buffer_size) || walk_buffer_size == 0) {
+          fprintf(stderr, "invalid walk buffer size: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      default:
+        return NULL;
+    }
+  }
+  if (color) {
+    parse_ls_colors(getenv("LS_COLORS"));
+  }
+  init_stat_mask();
+  check_statx();
+  if (stat_threads == 0) {
+    stat_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (walk_threads == 0) {
+    walk_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (argc <= optind) {
+    return new_dir_path("./", NULL, 0, NULL);
+  } else {
+    struct dir_path *head;
+    struct dir_path **work = &head;
+    int i;
+    for (i = optind; i < argc; i++) {
+      *work = new_dir_path(argv[i], NULL, 0, NULL);
+      work = &(*work)->next;
+    }
+    return head;
+  }
+}
+
+/**
+ * @brief モード文字列を作成する
+ * 種別はS_IFMTのビットをインデックスとする表から、
+ * パーミッションは8進数1桁と特殊ビットをインデックスとする3文字の表から引く。
+ * @param[IN]  mode モードパラメータ
+ * @param[OUT] str  文字列の出力先、11バイト以上のバッファを指定
+ */
+static void get_mode_string(mode_t mode, char *str) {
+  static const char type_chars[16] = {
+      '?', 'p', 'c', '?', 'd', '?', 'b', '?',
+      '-', '?', 'l', '?', 's', '?', '?', '?',
+  };
+  /* [0]はsetuid/setgid、[1]はスティッキービット、インデックスは特殊ビット<<3|rwx */
+  static const char triplets[2][16][4] = {
+      {
+          "---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx",
+          "--S", "--s", "-wS", "-ws", "r-S", "r-s", "rwS", "rws",
+      }, {
+          "---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx",
+          "--T", "--t", "-wT", "-wt", "r-T", "r-t", "rwT", "rwt",
+      },
+  };
+  str[0] = type_chars[(mode & S_IFMT) >> 12];
+  memcpy(str + 1, triplets[0][(mode >> 8 & 010) | (mode >> 6 & 07)], 3);
+  memcpy(str + 4, triplets[0][(mode >> 7 & 010) | (mode >> 3 & 07)], 3);
+  memcpy(str + 7, triplets[1][(mode >> 6 & 010) | (mode & 07)], 3);
+  str[10] = '\0';
+}
+
+/**
+ * @brief ファイルタイプ別のインジケータを出力する
+ * @param[IN] mode モードパラメータ
+ */
+static void print_type_indicator(mode_t mode) {
+  if (S_ISREG(mode)) {
+    if (mode & S_IXUGO) {
+      out_putc('*');
+    }
+  } else {
+    if (S_ISDIR(mode)) {
+      out_putc('/');
+    } else if (S_ISLNK(mode)) {
+      out_putc('@');
+    } else if (S_ISFIFO(mode)) {
+      out_putc('|');
+    } else if (S_ISSOCK(mode)) {
+      out_putc('=');
+    }
+  }
+}
+
+/**
+ * @brief uidからユーザ名を取得する
+ * @param[IN] uid ユーザID
+ * @return ユーザ名の複製、見つからない場合NULL
+ */
+static char *resolve_user(unsigned int uid) {
+  pthread_mutex_lock(&id_mutex);
+  struct passwd *passwd = getpwuid(uid);
+  char *name = passwd != NULL ? strdup(passwd->pw_name) : NULL;
+  pthread_mutex_unlock(&id_mutex);
+  return name;
+}
+
+/**
+ * @brief gidからグループ名を取得する
+ * @param[IN] gid グループID
+ * @return グループ名の複製、見つからない場合NULL
+ */
+static char *resolve_group(unsigned int gid) {
+  pthread_mutex_lock(&id_mutex);
+  struct group *group = getgrgid(gid);
+  char *name = group != NULL ? strdup(group->gr_name) : NULL;
+  pthread_mutex_unlock(&id_mutex);
+  return name;
+}
+
+/**
+ * @brief ハッシュテーブルからidの格納位置を探す
+ * @param[IN] table ハッシュテーブル
+ * @param[IN] size テーブルサイズ、2の累乗
+ * @param[IN] id 探すid
+ * @return idが格納されている位置、なければ格納すべき空き位置
+ */
+static struct id_entry *find_id_entry(struct id_entry *table, size_t size, unsigned int id) {
+  size_t mask = size - 1;
+  size_t i = (id * 2654435761u) & mask;
+  while (table[i].used && table[i].id != id) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+/**
+ * @brief キャッシュを通してidから名前を引く
+ * キャッシュにない場合のみresolveを呼び出し、見つからなかった結果も記録する。
+ * 使用率が半分を超えた場合はテーブルを倍に拡張する。
+ *
+ * @param[IN/OUT] cache キャッシュ
+ * @param[IN] id 引くid
+ * @param[IN] resolve 名前を取得する関数
+ * @return 名前、見つからない場合NULL
+ */
+static const char *lookup_id(struct id_cache *cache, unsigned int id, char *(*resolve)(unsigned int)) {
+  struct id_entry *entry;
+  if (cache->table == NULL) {
+    cache->size = ID_CACHE_INITIAL_SIZE;
+    cache->table = xmalloc(sizeof(struct id_entry) * cache->size);
+    memset(cache->table, 0, sizeof(struct id_entry) * cache->size);
+  }
+  entry = find_id_entry(cache->table, cache->size, id);
+  if (entry->used) {
+    cache->hits++;
+    return entry->name;
+  }
+  cache->misses++;
+  if ((cache->used + 1) * 2 > cache->size) {
+    size_t i;
+    size_t size = cache->size * 2;
+    struct id_entry *table = xmalloc(sizeof(struct id_entry) * size);
+    memset(table, 0, sizeof(struct id_entry) * size);
+    for (i = 0; i < cache->size; i++) {
+      if (cache->table[i].used) {
+        *find_id_entry(table, size, cache->table[i].id) = cache->table[i];
+      }
+    }
+    free(cache->table);
+    cache->table = table;
+    cache->size = size;
+    entry = find_id_entry(table, size, id);
+  }
+  entry->id = id;
+  entry->used = true;
+  entry->name = resolve(id);
+  cache->used++;
+  return entry->name;
+}
+
+/**
+ * @brief ユーザ名を表示する
+ * @param[IN] uid ユーザID
+ */
+static void print_user(uid_t uid) {
+  const char *name = lookup_id(&user_cache, uid, resolve_user);
+  if (name != NULL) {
+    out_str_right(name, 8);
+  } else {
+    out_int((int)uid, 8);
+  }
+  out_putc(' ');
+}
+
+/**
+ * @brief グループ名を表示する
+ * @param[IN] gid グループID
+ */
+static void print_group(gid_t gid) {
+  const char *name = lookup_id(&group_cache, gid, resolve_group);
+  if (name != NULL) {
+    out_str_right(name, 8);
+  } else {
+    out_int((int)gid, 8);
+  }
+  out_putc(' ');
+}
+
+/**
+ * @brief 統計情報を標準エラーへ表示する
+ */
+static void print_stats(void) {
+  unsigned long user_hits = user_cache.hits;
+  unsigned long user_misses = user_cache.misses;
+  unsigned long group_hits = group_cache.hits;
+  unsigned long group_misses = group_cache.misses;
+  unsigned long tasks = 0;
+  unsigned long steals = 0;
+  int i;
+  for (i = 0; i < walk.num + (walk.num != 0); i++) {
+    struct walker *walker = &walk.walkers[i];
+    user_hits += walker->user_cache.hits;
+    user_misses += walker->user_cache.misses;
+    group_hits += walker->group_cache.hits;
+    group_misses += walker->group_cache.misses;
+    tasks += walker->tasks;
+    steals += walker->steals;
+  }
+  fprintf(stderr, "user cache: %lu hits, %lu misses\n", user_hits, user_misses);
+  fprintf(stderr, "group cache: %lu hits, %lu misses\n", group_hits, group_misses);
+  if (walk.num != 0) {
+    fprintf(stderr, "walkers: %d threads, %lu directories, %lu steals\n",
+            walk.num, tasks, steals);
+    fprintf(stderr, "walk buffer: %zu bytes high-water, %zu bytes limit\n",
+            walk.buffered_max, walk_buffer_size);
+    fprintf(stderr, "walk stall: workers %.3f s, output %.3f s\n",
+            walk.stall_ns / 1e9, walk.emit_wait_ns / 1e9);
+  }
+}
+
+/**
+ * @brief 時刻表示文字列のキャッシュを指定時刻を含む日に更新する
+ * 日の始まりと終わりでUTCからのオフセットと日付が変わらないことを確認し、
+ * 夏時間の切り替えを含む日はキャッシュしない。
+ * タイムゾーンはオプション解析時にtzset()で一度だけ読み込み、
+ * 以降はlocaltime_r()で変換する。
+ *
+ * @param[IN] time 対象のUNIX時間
+ * @retval true  キャッシュした
+ * @retval false キャッシュできない
+ */
+static bool update_time_cache(time_t time) {
+  struct time_cache *cache = &time_cache;
+  struct tm tm;
+  struct tm start;
+  struct tm end;
+  cache->day_start = cache->day_end = 0;
+  if (localtime_r(&time, &tm) == NULL) {
+    return false;
+  }
+  time_t day_start = time - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+  time_t day_end = day_start + 24 * 3600;
+  time_t last = day_end - 1;
+  if (localtime_r(&day_start, &start) == NULL
+      || localtime_r(&last, &end) == NULL) {
+    return false;
+  }
+  if (start.tm_gmtoff != tm.tm_gmtoff || end.tm_gmtoff != tm.tm_gmtoff
+      || start.tm_mday != tm.tm_mday || end.tm_mday != tm.tm_mday
+      || start.tm_hour != 0 || start.tm_min != 0 || start.tm_sec != 0) {
+    return false;
+  }
+  if (strftime(cache->date, sizeof(cache->date), "%m/%d", &tm) != 5
+      || strftime(cache->old, sizeof(cache->old), "%m/%d  %Y", &tm) == 0) {
+    return false;
+  }
+  cache->day_start = day_start;
+  cache->day_end = day_end;
+  cache->minute = day_start - 60;
+  return true;
+}
+
+/**
+ * @brief 時刻表示文字列を作成する
+ * 半年以上前の場合は月-日 年
+ * 半年以内の場合は月-日 時:分
+ *
+ * @param[OUT] str  格納先、12byte以上のバッファを指定
+ * @param[IN]  time 文字列を作成するUNIX時間
+ */
+static void get_time_string(char *str, time_t time) {
+  struct time_cache *cache = &time_cache;
+  if (time < cache->day_start || time >= cache->day_end) {
+    if (!update_time_cache(time)) {
+      struct tm tm;
+      if (localtime_r(&time, &tm) == NULL) {
+        str[0] = '\0';
+      } else if (time - half_year_ago > 0) {
+        strftime(str, 12, "%m/%d %H:%M", &tm);
+      } else {
+        strftime(str, 12, "%m/%d  %Y", &tm);
+      }
+      return;
+    }
+  }
+  if (time - half_year_ago > 0) {
+    if (time < cache->minute || time >= cache->minute + 60) {
+      long sec = time - cache->day_start;
+      int hour = sec / 3600;
+      int min = sec / 60 % 60;
+      char *p = cache->recent;
+      memcpy(p, cache->date, 5);
+      p[5] = ' ';
+      p[6] = '0' + hour / 10;
+      p[7] = '0' + hour % 10;
+      p[8] = ':';
+      p[9] = '0' + min / 10;
+      p[10] = '0' + min % 10;
+      p[11] = '\0';
+      cache->minute = time - sec % 60;
+    }
+    memcpy(str, cache->recent, 12);
+  } else {
+    memcpy(str, cache->old, 12);
+  }
+}
+
+/**
+ * @brief LS_COLORSの値からエスケープシーケンスを作成する
+ * 値はSGRのパラメータとして"\033["と"m"で囲む。空の場合は何も出力しない。
+ *
+ * @param[IN]  value 値
+ * @param[IN]  len   値の長さ
+ * @param[OUT] seq   作成したエスケープシーケンス
+ * @return 値が不正な場合false
+ */
+static bool make_color_seq(const char *value, size_t len, struct color_seq *seq) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if ((value[i] < '0' || value[i] > '9') && value[i] != ';') {
+      return false;
+    }
+  }
+  if (len == 0) {
+    seq->seq = "";
+    seq->len = 0;
+    return true;
+  }
+  char *str = xmalloc(len + 4);
+  memcpy(str, "\033[", 2);
+  memcpy(str + 2, value, len);
+  str[len + 2] = 'm';
+  str[len + 3] = '\0';
+  seq->seq = str;
+  seq->len = len + 3;
+  return true;
+}
+
+/**
+ * @brief LS_COLORSの種別コードから色付き表示の分類を求める
+ *
+ * @param[IN] code 種別コード
+ * @param[IN] len  種別コードの長さ
+ * @return 分類、対応しないコードの場合-1
+ */
+static int find_color_code(const char *code, size_t len) {
+  static const struct {
+    char code[3];
+    int color;
+  } codes[] = {
+      { "fi", COLOR_FILE },
+      { "su", COLOR_SETUID },
+      { "sg", COLOR_SETGID },
+      { "ex", COLOR_EXEC },
+      { "di", COLOR_DIR },
+      { "tw", COLOR_STICKY_OTHER_WRITABLE },
+      { "ow", COLOR_OTHER_WRITABLE },
+      { "st", COLOR_STICKY },
+      { "ln", COLOR_LINK },
+      { "pi", COLOR_FIFO },
+      { "so", COLOR_SOCK },
+      { "bd", COLOR_BLK },
+      { "cd", COLOR_CHR },
+      { "or", COLOR_ORPHAN },
+  };
+  size_t i;
+  if (len != 2) {
+    return -1;
+  }
+  for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+    if (code[0] == codes[i].code[0] && code[1] == codes[i].code[1]) {
+      return codes[i].color;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief 拡張子のハッシュ値を求める
+ * 大文字小文字を区別しない
+ *
+ * @param[IN] ext 拡張子
+ * @param[IN] len 拡張子の長さ
+ * @return ハッシュ値
+ */
+static size_t hash_ext(const char *ext, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char c = ext[i];
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    hash = (hash ^ c) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief 拡張子のハッシュテーブルから対応するスロットを探す
+ * 見つからなかった場合は空きスロットを返す
+ *
+ * @param[IN] table テーブル
+ * @param[IN] size  テーブルのサイズ、2のべき乗
+ * @param[IN] ext   小文字の拡張子
+ * @param[IN] len   拡張子の長さ
+ * @return スロット
+ */
+static struct ext_color *find_ext_entry(struct ext_color *table, size_t size, const char *ext, size_t len) {
+  size_t mask = size - 1;
+  size_t i = hash_ext(ext, len) & mask;
+  while (table[i].ext != NULL
+      && (table[i].len != len || memcmp(table[i].ext, ext, len) != 0)) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+/**
+ * @brief 拡張子の色付き表示を登録する
+ * 既に登録されている場合は上書きする
+ *
+ * @param[IN] ext   拡張子
+ * @param[IN] len   拡張子の長さ
+ * @param[IN] seq   エスケープシーケンス
+ * @param[IN] order LS_COLORS内での順序
+ */
+static void add_ext_color(const char *ext, size_t len, const struct color_seq *seq, int order) {
+  struct ext_colors *colors = &ext_colors;
+  char lower[EXT_COLOR_MAX_LEN];
+  size_t i;
+  for (i = 0; i < len; i++) {
+    lower[i] = (ext[i] >= 'A' && ext[i] <= 'Z') ? ext[i] + 'a' - 'A' : ext[i];
+  }
+  if (colors->table == NULL) {
+    colors->size = EXT_COLOR_INITIAL_SIZE;
+    colors->table = xmalloc(sizeof(struct ext_color) * colors->size);
+    memset(colors->table, 0, sizeof(struct ext_color) * colors->size);
+  }
+  struct ext_color *entry = find_ext_entry(colors->table, colors->size, lower, len);
+  if (entry->ext == NULL) {
+    if ((colors->used + 1) * 2 > colors->size) {
+      size_t size = colors->size * 2;
+      struct ext_color *table = xmalloc(sizeof(struct ext_color) * size);
+      memset(table, 0, sizeof(struct ext_color) * size);
+      for (i = 0; i < colors->size; i++) {
+        if (colors->table[i].ext != NULL) {
+          struct ext_color *e = &colors->table[i];
+          *find_ext_entry(table, size, e->ext, e->len) = *e;
+        }
+      }
+      free(colors->table);
+      colors->table = table;
+      colors->size = size;
+      entry = find_ext_entry(table, size, lower, len);
+    }
+    entry->ext = xmalloc(len);
+    memcpy(entry->ext, lower, len);
+    entry->len = len;
+    colors->used++;
+    if (len > colors->max_len) {
+      colors->max_len = len;
+    }
+  }
+  entry->seq = *seq;
+  entry->order = order;
+}
+
+/**
+ * @brief 拡張子以外のパターンの色付き表示を登録する
+ *
+ * @param[IN] pattern パターン
+ * @param[IN] len     パターンの長さ
+ * @param[IN] seq     エスケープシーケンス
+ * @param[IN] order   LS_COLORS内での順序
+ */
+static void add_pattern_color(const char *pattern, size_t len, const struct color_seq *seq, int order) {
+  struct ext_colors *colors = &ext_colors;
+  colors->patterns = xrealloc(colors->patterns, sizeof(struct pattern_color) * (colors->pattern_num + 1));
+  struct pattern_color *p = &colors->patterns[colors->pattern_num++];
+  p->pattern = xmalloc(len + 1);
+  memcpy(p->pattern, pattern, len);
+  p->pattern[len] = '\0';
+  p->suffix = strcspn(p->pattern + 1, "*?[\\") == len - 1;
+  p->suffix_len = len - 1;
+  p->seq = *seq;
+  p->order = order;
+}
+
+/**
+ * @brief LS_COLORSを解析する
+ * 種別コードは分類ごとのテーブルを上書きし、
+ * "*.拡張子"の形式は拡張子のハッシュテーブルへ、それ以外の"*"から始まるものはパターンのリストへ登録する。
+ * 対応しない種別コードは無視する。"ln=target"はリンクをリンク先の分類で色付けする指定とする。
+ *
+ * @param[IN] env LS_COLORSの値、NULLの場合は何もしない
+ */
+static void parse_ls_colors(const char *env) {
+  int order = 0;
+  if (env == NULL) {
+    return;
+  }
+  while (*env != '\0') {
+    const char *end = strchrnul(env, ':');
+    const char *eq = memchr(env, '=', end - env);
+    struct color_seq seq;
+    if (end == env) {
+      env++;
+      continue;
+    }
+    if (eq != NULL && eq - env == 2 && env[0] == 'l' && env[1] == 'n'
+        && end - eq - 1 == 6 && memcmp(eq + 1, "target", 6) == 0) {
+      color_link_target = true;
+    } else if (eq == NULL || !make_color_seq(eq + 1, end - eq - 1, &seq)) {
+      fprintf(stderr, "invalid LS_COLORS entry: %.*s\n", (int)(end - env), env);
+    } else if (env[0] == '*') {
+      const char *key = env + 1;
+      size_t len = eq - key;
+      if (len > 1 && len <= EXT_COLOR_MAX_LEN && key[0] == '.'
+          && strcspn(key + 1, ".*?[\\=") == len - 1) {
+        add_ext_color(key + 1, len - 1, &seq, order);
+      } else {
+        add_pattern_color(env, eq - env, &seq, order);
+      }
+    } else if (eq - env == 2 && env[0] == 'r' && env[1] == 's') {
+      if (seq.len != 0) {
+        color_reset = seq;
+      }
+    } else {
+      int color_class = find_color_code(env, eq - env);
+      if (color_class >= 0) {
+        color_table[color_class] = seq;
+      }
+    }
+    order++;
+    env = *end == ':' ? end + 1 : end;
+  }
+}
+
+/**
+ * @brief ファイル名に対応するLS_COLORSのパターン指定を探す
+ * 最後の'.'以降でハッシュテーブルを引き、パターンのリストはそれより後に指定されたものだけを照合する。
+ *
+ * @param[IN] name ファイル名
+ * @param[IN] len  ファイル名の長さ
+ * @return エスケープシーケンス、該当しない場合NULL
+ */
+static const struct color_seq *find_ext_color(const char *name, size_t len) {
+  struct ext_colors *colors = &ext_colors;
+  const struct color_seq *seq = NULL;
+  int order = -1;
+  if (colors->used != 0) {
+    const char *dot = memrchr(name, '.', len);
+    if (dot != NULL) {
+      const char *ext = dot + 1;
+      size_t ext_len = name + len - ext;
+      if (ext_len != 0 && ext_len <= colors->max_len) {
+        char lower[EXT_COLOR_MAX_LEN];
+        size_t i;
+        for (i = 0; i < ext_len; i++) {
+          lower[i] = (ext[i] >= 'A' && ext[i] <= 'Z') ? ext[i] + 'a' - 'A' : ext[i];
+        }
+        struct ext_color *entry = find_ext_entry(colors->table, colors->size, lower, ext_len);
+        if (entry->ext != NULL) {
+          seq = &entry->seq;
+          order = entry->order;
+        }
+      }
+    }
+  }
+  size_t i = colors->pattern_num;
+  while (i > 0) {
+    struct pattern_color *p = &colors->patterns[--i];
+    if (p->order < order) {
+      break;
+    }
+    if (p->suffix) {
+      if (len >= p->suffix_len
+          && strncasecmp(name + len - p->suffix_len, p->pattern + 1, p->suffix_len) == 0) {
+        return &p->seq;
+      }
+    } else if (fnmatch(p->pattern, name, FNM_CASEFOLD) == 0) {
+      return &p->seq;
+    }
+  }
+  return seq;
+}
+
+/**
+ * @brief 分類に色が指定されているかを判定する
+ * GNU lsと同じく、空と"0"、"00"は指定されていないものとして扱う。
+ *
+ * @param[IN] color_class 分類
+ * @return 指定されている場合true
+ */
+static bool is_colored(int color_class) {
+  const struct color_seq *seq = &color_table[color_class];
+  return seq->len != 0
+      && !(seq->len == 4 && memcmp(seq->seq, "\033[0m", 4) == 0)
+      && !(seq->len == 5 && memcmp(seq->seq, "\033[00m", 5) == 0);
+}
+
+/**
+ * @brief 色付き表示の分類を求める
+ * 特殊なビットによる分類に色が指定されていない場合は、基本の分類とする。
+ *
+ * @param[IN] mode mode値
+ * @param[IN] link_ok リンク先が存在しない場合にfalse
+ * @return 分類
+ */
+static int get_color_class(mode_t mode, bool link_ok) {
+  if (!link_ok) {
+    return COLOR_ORPHAN;
+  }
+  switch (mode & S_IFMT) {
+    case S_IFREG:
+      if ((mode & S_ISUID) && is_colored(COLOR_SETUID)) {
+        return COLOR_SETUID;
+      } else if ((mode & S_ISGID) && is_colored(COLOR_SETGID)) {
+        return COLOR_SETGID;
+      } else if ((mode & S_IXUGO) && is_colored(COLOR_EXEC)) {
+        return COLOR_EXEC;
+      }
+      return COLOR_FILE;
+    case S_IFDIR:
+      if ((mode & S_ISVTX) && (mode & S_IWOTH) && is_colored(COLOR_STICKY_OTHER_WRITABLE)) {
+        return COLOR_STICKY_OTHER_WRITABLE;
+      } else if ((mode & S_IWOTH) && is_colored(COLOR_OTHER_WRITABLE)) {
+        return COLOR_OTHER_WRITABLE;
+      } else if ((mode & S_ISVTX) && is_colored(COLOR_STICKY)) {
+        return COLOR_STICKY;
+      }
+      return COLOR_DIR;
+    case S_IFLNK:
+      return COLOR_LINK;
+    case S_IFIFO:
+      return COLOR_FIFO;
+    case S_IFSOCK:
+      return COLOR_SOCK;
+    case S_IFBLK:
+      return COLOR_BLK;
+    case S_IFCHR:
+      return COLOR_CHR;
+    default:
+      return COLOR_NONE;
+  }
+}
+
+/**
+ * @brief ファイル名を色付き表示する
+ * 開始シーケンス、ファイル名、終了シーケンスをまとめて出力バッファへ書き込む。
+ * 拡張子やパターンによる色は特殊なビットを持たない通常ファイルにだけ適用する。
+ *
+ * @param[IN] name ファイル名
+ * @param[IN] mode mode値
+ * @param[IN] link_ok リンク先が存在しない場合にfalse
+ */
+static void print_name_with_color(const char *name, mode_t mode, bool link_ok) {
+  int color_class = get_color_class(mode, link_ok);
+  const struct color_seq *seq = &color_table[color_class];
+  size_t len = strlen(name);
+  if (color_class == COLOR_FILE) {
+    const struct color_seq *ext = find_ext_color(name, len);
+    if (ext != NULL) {
+      seq = ext;
+    }
+  }
+  size_t total = seq->len + len + color_reset.len;
+  if (total > out_buf_size) {
+    out_write(seq->seq, seq->len);
+    out_write(name, len);
+    out_write(color_reset.seq, color_reset.len);
+    return;
+  }
+  char *p = out_reserve(total);
+  memcpy(p, seq->seq, seq->len);
+  p += seq->len;
+  memcpy(p, name, len);
+  p += len;
+  memcpy(p, color_reset.seq, color_reset.len);
+}
+
+/**
+ * @brief struct dir_fdのファクトリーメソッド
+ * @param[IN] fd ディレクトリのfd
+ * @return struct dir_fdへのポインタ
+ */
+static struct dir_fd *new_dir_fd(int fd) {
+  struct dir_fd *d = xmalloc(sizeof(struct dir_fd));
+  d->fd = fd;
+  d->ref = 0;
+  return d;
+}
+
+/**
+ * @brief struct dir_fdの参照を解放する
+ * 参照がなくなった場合はfdをcloseする
+ *
+ * @param[IN] dir_fd 解放する構造体、NULLの場合は何もしない
+ */
+static void release_dir_fd(struct dir_fd *dir_fd) {
+  if (dir_fd == NULL) {
+    return;
+  }
+  /* 並列な再帰表示では子ディレクトリが別のスレッドから解放する */
+  if (__atomic_sub_fetch(&dir_fd->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(dir_fd->fd);
+    free(dir_fd);
+  }
+}
+
+/**
+ * @brief struct subdirのファクトリーメソッド
+ * 親ディレクトリのfdが指定された場合は、親からの相対でオープンできるよう
+ * パス末尾の名前部分を保持する。
+ *
+ * @param[IN] path パス
+ * @param[IN] parent 親ディレクトリのfd、NULLの場合はpathをそのまま使う
+ * @param[IN] depth 深さ
+ * @param[IN] next 次の要素へのポインタ
+ * @return struct subdirへのポインタ
+ */
+static struct dir_path *new_dir_path(const char *path, struct dir_fd *parent, int depth, struct dir_path *next) {
+  struct dir_path *s = xmalloc(sizeof(struct dir_path));
+  if (path != NULL) {
+    strncpy(s->path, path, sizeof(s->path));
+  }
+  s->name = parent != NULL ? find_filename(s->path) : s->path;
+  s->parent = parent;
+  s->depth = depth;
+  s->next = next;
+  return s;
+}
+
+/**
+ * @brief アリーナから領域を切り出す
+ * 現在の塊に空きがない場合は次の塊へ進み、塊がなければ新たに確保する。
+ *
+ * @param[IN/OUT] arena 確保元
+ * @param[IN] size 確保サイズ
+ * @param[IN] align アライメント、2の累乗でmax_align_t以下
+ * @return 確保された領域へのポインタ
+ */
+static void *arena_alloc(struct arena *arena, size_t size, size_t align) {
+  struct arena_chunk *chunk = arena->current;
+  size_t used = (arena->used + align - 1) & ~(align - 1);
+  if (chunk == NULL || chunk->size - used < size) {
+    struct arena_chunk *next = chunk != NULL ? chunk->next : arena->head;
+    if (next == NULL || next->size < size) {
+      size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+      struct arena_chunk *new_chunk = xmalloc(sizeof(struct arena_chunk) + chunk_size);
+      new_chunk->size = chunk_size;
+      new_chunk->next = next;
+      if (chunk != NULL) {
+        chunk->next = new_chunk;
+      } else {
+        arena->head = new_chunk;
+      }
+      next = new_chunk;
+    }
+    chunk = next;
+    arena->current = chunk;
+    used = 0;
+  }
+  arena->used = used + size;
+  return (char *)chunk->data + used;
+}
+
+/**
+ * @brief アリーナへ文字列を格納する
+ * @param[IN/OUT] arena 格納先
+ * @param[IN] str 文字列、終端文字は不要
+ * @param[IN] len 文字列の長さ
+ * @return 格納された'\0'終端の文字列
+ */
+static const char *arena_strdup(struct arena *arena, const char *str, size_t len) {
+  char *p = arena_alloc(arena, len + 1, 1);
+  memcpy(p, str, len);
+  p[len] = '\0';
+  return p;
+}
+
+/**
+ * @brief アリーナから切り出したすべての領域を開放する
+ * 塊はそのまま残し、先頭から再利用する。
+ *
+ * @param[IN/OUT] arena 対象のアリーナ
+ */
+static void reset_arena(struct arena *arena) {
+  arena->current = arena->head;
+  arena->used = 0;
+}
+
+/**
+ * @brief 可変長リストを初期化する
+ * エントリ情報構造体と文字列はディレクトリ単位のアリーナへ格納する。
+ *
+ * @param[OUT] list 初期化する構造体
+ * @param[IN] size 初期サイズ
+ */
+static void init_info_list(struct info_list *list, int size) {
+  list->array = xmalloc(sizeof(struct info*) * size);
+  list->size = size;
+  list->used = 0;
+  list->arena = &entry_arena;
+  list->links = &link_arena;
+}
+
+/**
+ * @brief 可変長リスト内のメモリを開放する
+ * リスト内に登録されたinfoと文字列もアリーナごと合わせて開放する。
+ *
+ * @param[IN] list 開放する構造体
+ */
+static void free_info_list(struct info_list *list) {
+  free(list->array);
+  reset_arena(list->arena);
+  reset_arena(list->links);
+}
+
+/**
+ * @brief 可変長リストへ情報を格納する
+ * 格納場所がない場合は拡張を行う
+ *
+ * @param[IN/OUT] list 格納先構造体
+ * @param[IN] info 格納するデータ
+ */
+static void add_info(struct info_list *list, struct info *info) {
+  if (list->size == list->used) {
+    list->size = list->size * 2;
+    list->array = xrealloc(list->array, sizeof(struct info*) * list->size);
+  }
+  list->array[list->used] = info;
+  list->used++;
+}
+
+/**
+ * @brief 表示オプションから取得が必要な情報を決定する
+ * ソートと再帰のためファイルタイプは常に必要とする。
+ * 属性を示す文字と色付けには許可属性が、
+ * ロングフォーマットには表示するすべての項目が必要になる。
+ * リンク先の情報は色付けでのみ、リンク先文字列はロングフォーマットでのみ使う。
+ */
+static void init_stat_mask(void) {
+  stat_mask = STATX_TYPE;
+  if (classify || color) {
+    stat_mask |= STATX_MODE;
+  }
+  if (long_format) {
+    stat_mask |= STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID
+        | STATX_SIZE | STATX_MTIME;
+  }
+  link_stat_mask = color ? (STATX_TYPE | STATX_MODE) : 0;
+  need_link = long_format;
+}
+
+/**
+ * @brief statxが使えるかを調べる
+ * ワーカースレッドから参照するため、スレッド起動前に確定させておく。
+ */
+static void check_statx(void) {
+  struct statx stx;
+  if (statx(AT_FDCWD, "/", 0, STATX_TYPE, &stx) != 0 && errno == ENOSYS) {
+    statx_unsupported = true;
+  }
+}
+
+/**
+ * @brief 指定された情報のみを取得しstruct statへ格納する
+ * statxが使えない場合はfstatatで全情報を取得する。
+ * 取得しなかった項目は0となる。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからの相対パス
+ * @param[IN] flags AT_SYMLINK_NOFOLLOWなどのフラグ
+ * @param[IN] mask 取得する情報のstatxマスク
+ * @param[OUT] st 格納先
+ * @return 成功した場合0、失敗した場合はerrnoを設定し-1
+ */
+static int stat_entry(int dirfd, const char *path, int flags, unsigned int mask, struct stat *st) {
+  struct statx stx;
+  if (statx_unsupported) {
+    return fstatat(dirfd, path, st, flags);
+  }
+  if (statx(dirfd, path, flags, mask, &stx) != 0) {
+    return -1;
+  }
+  statx_to_stat(&stx, st);
+  return 0;
+}
+
+/**
+ * @brief statxの結果をstruct statへ変換する
+ * @param[IN] stx statxの結果
+ * @param[OUT] st 格納先
+ */
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+/**
+ * @brief エントリの情報取得にstatが必要かを判定する
+ * ファイルタイプ以外の情報が不要な場合は、d_typeが分かっていればstatしない。
+ *
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @return statが必要な場合true
+ */
+static bool need_stat(unsigned char d_type) {
+  return stat_mask != STATX_TYPE || d_type == DT_UNKNOWN;
+}
+
+/**
+ * @brief statの結果から表示に使う項目をエントリ情報構造体へ格納する
+ * @param[OUT] info 格納先
+ * @param[IN] st statの結果
+ */
+static void set_info_stat(struct info *info, const struct stat *st) {
+  info->mode = st->st_mode;
+  info->nlink = st->st_nlink;
+  info->uid = st->st_uid;
+  info->gid = st->st_gid;
+  info->size = st->st_size;
+  info->rdev = st->st_rdev;
+  info->mtime = st->st_mtim.tv_sec;
+}
+
+/**
+ * @brief シンボリックリンクのリンク先を読み出して格納する
+ * 読み出せなかった場合は何もしない。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[OUT] info 格納先
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void read_link(int dirfd, const char *path, struct info *info, struct arena *links) {
+  char buf[PATH_MAX + 1];
+  int link_len = readlinkat(dirfd, path, buf, PATH_MAX);
+  if (link_len > 0) {
+    pthread_mutex_lock(&link_mutex);
+    info->link = arena_strdup(links, buf, link_len);
+    pthread_mutex_unlock(&link_mutex);
+  }
+}
+
+/**
+ * @brief エントリ情報構造体へ指定パスの各情報を格納する
+ * パスはディレクトリのfdからの相対で解決するため、
+ * 深い階層でもカーネルによるパスの探索はエントリ名の分だけで済む。
+ * ワーカースレッドからも呼び出される。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[OUT] info 格納先
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @param[IN/OUT] links リンク先の格納先
+ * @return 成功した場合0、失敗した場合はinfo->errorにerrnoを設定し-1
+ */
+static int fill_info(int dirfd, const char *path, struct info *info, unsigned char d_type, struct arena *links) {
+  struct stat st;
+  info->error = 0;
+  if (!need_stat(d_type)) {
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = DTTOIF(d_type);
+  } else if (stat_entry(dirfd, path, AT_SYMLINK_NOFOLLOW, stat_mask, &st) != 0) {
+    info->error = errno;
+    return -1;
+  }
+  set_info_stat(info, &st);
+  info->link_ok = false;
+  info->link = NULL;
+  info->link_mode = 0;
+  if (S_ISLNK(info->mode)) {
+    struct stat link_stat;
+    if (need_link) {
+      read_link(dirfd, path, info, links);
+    }
+    if (link_stat_mask == 0) {
+      info->link_ok = true;
+    } else if (stat_entry(dirfd, path, 0, link_stat_mask, &link_stat) == 0) {
+      info->link_ok = true;
+      info->link_mode = link_stat.st_mode;
+    }
+  } else {
+    info->link_ok = true;
+  }
+  return 0;
+}
+
+/**
+ * @brief エントリ情報構造体のメモリを確保し名前を格納する
+ * @param[IN/OUT] list 名前の格納先
+ * @param[IN] name エントリの名前
+ * @return エントリ情報構造体
+ */
+static struct info *alloc_info(struct info_list *list, const char *name) {
+  struct info *info = arena_alloc(list->arena, sizeof(struct info), _Alignof(struct info));
+  info->name = arena_strdup(list->arena, name, strlen(name));
+  return info;
+}
+
+/**
+ * @brief エントリ情報構造体のファクトリメソッド
+ * メモリ確保から、指定パスの各情報格納までを行う
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[IN] name エントリの名前
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @param[IN/OUT] list 名前とリンク先の格納先
+ * @return エントリ情報構造体、失敗した場合はerrnoを設定しNULL
+ */
+static struct info *new_info(int dirfd, const char *path, const char *name, unsigned char d_type, struct info_list *list) {
+  struct info *info = alloc_info(list, name);
+  if (fill_info(dirfd, path, info, d_type, list->links) != 0) {
+    errno = info->error;
+    return NULL;
+  }
+  return info;
+}
+
+/**
+ * @brief 情報取得を行うワーカースレッド
+ * キューから依頼を取り出し、結果をinfoへ書き込む。
+ *
+ * @param[IN] arg struct stat_pool
+ * @return 常にNULL
+ */
+static void *stat_worker(void *arg) {
+  struct stat_pool *pool = arg;
+  while (true) {
+    struct stat_job job;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == 0) {
+      pthread_cond_wait(&pool->not_empty, &pool->mutex);
+    }
+    job = pool->jobs[pool->head];
+    pool->head = (pool->head + 1) % STAT_QUEUE_SIZE;
+    pool->count--;
+    pthread_cond_signal(&pool->not_full);
+    pthread_mutex_unlock(&pool->mutex);
+    fill_info(job.dirfd, job.info->name, job.info, job.d_type, job.links);
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending--;
+    if (pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return NULL;
+}
+
+/**
+ * @brief ワーカースレッドを起動する
+ *
+ * @param[IN] threads スレッド数
+ * @return struct stat_pool
+ */
+static struct stat_pool *new_stat_pool(long threads) {
+  struct stat_pool *pool = xmalloc(sizeof(struct stat_pool));
+  long i;
+  pool->head = 0;
+  pool->count = 0;
+  pool->pending = 0;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->not_empty, NULL);
+  pthread_cond_init(&pool->not_full, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (i = 0; i < threads; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, stat_worker, pool);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+  return pool;
+}
+
+/**
+ * @brief ワーカースレッドを取得する
+ * 初回呼び出し時にスレッドを起動し、以降は使い回す。
+ *
+ * @return struct stat_pool、スレッド数が1以下の場合NULL
+ */
+static struct stat_pool *get_stat_pool(void) {
+  if (stat_threads > 1 && stat_pool == NULL) {
+    stat_pool = new_stat_pool(stat_threads);
+  }
+  return stat_pool;
+}
+
+/**
+ * @brief ワーカースレッドへ情報取得を依頼する
+ * キューが一杯の場合は空きができるまで待つ。
+ *
+ * @param[IN] pool ワーカースレッド
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] info 格納先、info->nameをdirfdからの相対パスとして使う
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void submit_stat_job(struct stat_pool *pool, int dirfd, struct info *info, unsigned char d_type, struct arena *links) {
+  struct stat_job *job;
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->count == STAT_QUEUE_SIZE) {
+    pthread_cond_wait(&pool->not_full, &pool->mutex);
+  }
+  job = &pool->jobs[(pool->head + pool->count) % STAT_QUEUE_SIZE];
+  job->info = info;
+  job->dirfd = dirfd;
+  job->d_type = d_type;
+  job->links = links;
+  pool->count++;
+  pool->pending++;
+  pthread_cond_signal(&pool->not_empty);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief 依頼したすべての情報取得の完了を待つ
+ * @param[IN] pool ワーカースレッド
+ */
+static void wait_stat_jobs(struct stat_pool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief io_uringのリングを作成する
+ * statxの発行に対応していない場合はNULLを返し、同期的な情報取得を使う。
+ *
+ * @return struct uring、使えない場合NULL
+ */
+static struct uring *new_uring(void) {
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  size_t sq_size;
+  size_t cq_size;
+  char *sq;
+  char *cq;
+  struct uring *ring;
+  int fd;
+  if (statx_unsupported) {
+    return NULL;
+  }
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) {
+    return NULL;
+  }
+  probe = xmalloc(probe_size);
+  memset(probe, 0, probe_size);
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) != 0
+      || probe->last_op < IORING_OP_STATX
+      || !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)) {
+    free(probe);
+    close(fd);
+    return NULL;
+  }
+  free(probe);
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) {
+      sq_size = cq_size;
+    }
+    cq_size = sq_size;
+  }
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq = sq;
+  } else {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sq_size);
+      close(fd);
+      return NULL;
+    }
+  }
+  ring = xmalloc(sizeof(struct uring));
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (cq != sq) {
+      munmap(cq, cq_size);
+    }
+    munmap(sq, sq_size);
+    free(ring);
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->used = 0;
+  return ring;
+}
+
+/**
+ * @brief io_uringのリングを取得する
+ * 初回呼び出し時に作成し、以降は使い回す。
+ *
+ * @return struct uring、指定されていないか使えない場合NULL
+ */
+static struct uring *get_uring(void) {
+  static bool initialized = false;
+  if (use_uring && !initialized) {
+    initialized = true;
+    uring = new_uring();
+  }
+  return uring;
+}
+
+/**
+ * @brief statxの依頼をサブミッションキューへ積む
+ * 実際の発行はwait_uringで行う。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] index 結果を格納するjobsのインデックス
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからの相対パス
+ * @param[IN] flags AT_SYMLINK_NOFOLLOWなどのフラグ
+ * @param[IN] mask 取得する情報のstatxマスク
+ */
+static void submit_uring_statx(struct uring *ring, int index, int dirfd, const char *path, int flags, unsigned int mask) {
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = mask;
+  sqe->off = (uintptr_t)&ring->jobs[index].stx;
+  sqe->statx_flags = flags;
+  sqe->user_data = index;
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 積んだ依頼を1回のシステムコールで発行し、すべての完了を待つ
+ * 結果はjobs[].resへ格納する。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] count 積んだ依頼の数
+ */
+static void wait_uring(struct uring *ring, int count) {
+  int submitted = 0;
+  int completed = 0;
+  while (completed < count) {
+    unsigned head = *ring->cq_head;
+    int ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+                      count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      flush_before_error();
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+    submitted += ret;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      ring->jobs[cqe->user_data].res = cqe->res;
+      head++;
+      completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @brief 積まれたエントリの情報取得をio_uringで行う
+ * まずすべてのエントリのstatxを発行し、
+ * シンボリックリンクのリンク先が必要な場合は続けてまとめて発行する。
+ * リンク先文字列の読み出しはio_uringで扱えないため同期的に行う。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void run_uring_jobs(struct uring *ring, int dirfd, struct arena *links) {
+  int i;
+  int link_jobs = 0;
+  struct stat st;
+  if (ring->used == 0) {
+    return;
+  }
+  for (i = 0; i < ring->used; i++) {
+    submit_uring_statx(ring, i, dirfd, ring->jobs[i].info->name, AT_SYMLINK_NOFOLLOW, stat_mask);
+  }
+  wait_uring(ring, ring->used);
+  for (i = 0; i < ring->used; i++) {
+    struct uring_job *job = &ring->jobs[i];
+    struct info *info = job->info;
+    if (job->res < 0) {
+      info->error = -job->res;
+      continue;
+    }
+    info->error = 0;
+    statx_to_stat(&job->stx, &st);
+    set_info_stat(info, &st);
+    info->link_ok = true;
+    info->link = NULL;
+    info->link_mode = 0;
+    if (S_ISLNK(info->mode)) {
+      if (need_link) {
+        read_link(dirfd, info->name, info, links);
+      }
+      if (link_stat_mask != 0) {
+        info->link_ok = false;
+        submit_uring_statx(ring, i, dirfd, info->name, 0, link_stat_mask);
+        link_jobs++;
+      }
+    }
+  }
+  if (link_jobs > 0) {
+    wait_uring(ring, link_jobs);
+    for (i = 0; i < ring->used; i++) {
+      struct uring_job *job = &ring->jobs[i];
+      struct info *info = job->info;
+      if (info->error == 0 && S_ISLNK(info->mode) && job->res == 0) {
+        info->link_ok = true;
+        info->link_mode = job->stx.stx_mode;
+      }
+    }
+  }
+  ring->used = 0;
+}
+
+/**
+ * @brief io_uringで情報取得するエントリを積む
+ * 積める数を超えた場合はその場で発行する。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] info 格納先、info->nameをdirfdからの相対パスとして使う
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void add_uring_job(struct uring *ring, int dirfd, struct info *info, struct arena *links) {
+  if (ring->used == URING_ENTRIES) {
+    run_uring_jobs(ring, dirfd, links);
+  }
+  ring->jobs[ring->used].info = info;
+  ring->used++;
+}
+
+/**
+ * @brief 情報取得に失敗したエントリをリストから取り除く
+ * エラーは読み出し順に表示するため、逐次処理した場合と同じ出力になる。
+ *
+ * @param[IN/OUT] list 対象のリスト
+ * @param[IN] path エラー表示に使うディレクトリのパス、末尾は'/'
+ */
+static void remove_failed_info(struct info_list *list, const char *path) {
+  int i;
+  int used = 0;
+  for (i = 0; i < list->used; i++) {
+    struct info *info = list->array[i];
+    if (info->error != 0) {
+      print_error("%s%s: %s\n", path, info->name, strerror(info->error));
+      continue;
+    }
+    list->array[used] = info;
+    used++;
+  }
+  list->used = used;
+}
+
+/**
+ * @brief 名前の先頭8バイトからソート用のキーを作成する
+ * 8バイトに満たない部分は0で埋める。
+ *
+ * @param[IN] name 名前
+ * @return キー
+ */
+static uint64_t name_prefix(const char *name) {
+  uint64_t prefix = 0;
+  int i;
+  for (i = 0; i < 8 && name[i] != '\0'; i++) {
+    prefix |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+  }
+  return prefix;
+}
+
+/**
+ * @brief ソート用キー比較
+ * キーが一致し、名前が続いている場合のみ残りをstrcmpで比較する。
+ *
+ * @param[IN] a
+ * @param[IN] b
+ * @param[IN] offset キーを作成した名前の位置
+ * @return a>bなら正、a==bなら0、a<bなら負
+ */
+static int compare_key(const struct sort_key *a, const struct sort_key *b, size_t offset) {
+  if (a->prefix != b->prefix) {
+    return a->prefix < b->prefix ? -1 : 1;
+  }
+  if ((a->prefix & 0xff) == 0) {
+    return 0;
+  }
+  return strcmp(a->info->name + offset + 8, b->info->name + offset + 8);
+}
+
+/**
+ * @brief 少数の要素を挿入ソートする
+ * @param[IN/OUT] keys ソート対象
+ * @param[IN] n 要素数
+ * @param[IN] offset キーを作成した名前の位置
+ */
+static void insertion_sort_keys(struct sort_key *keys, size_t n, size_t offset) {
+  size_t i;
+  for (i = 1; i < n; i++) {
+    struct sort_key key = keys[i];
+    size_t j = i;
+    while (j > 0 && compare_key(&keys[j - 1], &key, offset) > 0) {
+      keys[j] = keys[j - 1];
+      j--;
+    }
+    keys[j] = key;
+  }
+}
+
+/**
+ * @brief キーの上位バイトから順に基数ソートする
+ * 要素数が少なくなった場合は挿入ソートへ切り替える。
+ * 8バイトすべてが一致した集合は、名前の続く8バイトでキーを作り直して続ける。
+ * 対象のバイトが0の集合は名前がそこで終わっており、同一のためそれ以上並べない。
+ *
+ * @param[IN/OUT] keys ソート対象
+ * @param[IN] tmp 作業領域、n要素以上
+ * @param[IN] n 要素数
+ * @param[IN] shift 対象とするバイトのシフト量
+ * @param[IN] offset キーを作成した名前の位置
+ */
+static void radix_sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n, int shift, size_t offset) {
+  size_t count[256];
+  size_t pos[256];
+  size_t i;
+  size_t start;
+  if (shift < 0) {
+    offset += 8;
+    for (i = 0; i < n; i++) {
+      keys[i].prefix = name_prefix(keys[i].info->name + offset);
+    }
+    shift = 56;
+  }
+  if (n <= SORT_INSERTION_MAX) {
+    insertion_sort_keys(keys, n, offset);
+    return;
+  }
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {
+    count[(keys[i].prefix >> shift) & 0xff]++;
+  }
+  start = 0;
+  for (i = 0; i < 256; i++) {
+    pos[i] = start;
+    start += count[i];
+  }
+  for (i = 0; i < n; i++) {
+    tmp[pos[(keys[i].prefix >> shift) & 0xff]++] = keys[i];
+  }
+  memcpy(keys, tmp, sizeof(struct sort_key) * n);
+  start = count[0];
+  for (i = 1; i < 256; i++) {
+    if (count[i] > 1) {
+      radix_sort_keys(keys + start, tmp, count[i], shift - 8, offset);
+    }
+    start += count[i];
+  }
+}
+
+/**
+ * @brief リスト内のソートを行う
+ * ディレクトリを先頭に集めた後、それぞれを名前順に並べる。
+ * 比較のたびにinfoを参照しないよう、キーを連続した配列に作成してソートする。
+ *
+ * @param[IN/OUT] ソート対象のリスト
+ */
+static void sort_list(struct info_list *list) {
+  size_t n = list->used;
+  size_t dirs = 0;
+  size_t d = 0;
+  size_t f = 0;
+  size_t i;
+  struct sort_key *keys;
+  if (n < 2) {
+    return;
+  }
+  keys = xmalloc(sizeof(struct sort_key) * n * 2);
+  for (i = 0; i < n; i++) {
+    if (S_ISDIR(list->array[i]->mode)) {
+      dirs++;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    struct info *info = list->array[i];
+    struct sort_key *key = S_ISDIR(info->mode) ? &keys[d++] : &keys[dirs + f++];
+    key->prefix = name_prefix(info->name);
+    key->info = info;
+  }
+  radix_sort_keys(keys, keys + n, dirs, 56, 0);
+  radix_sort_keys(keys + dirs, keys + n, n - dirs, 56, 0);
+  for (i = 0; i < n; i++) {
+    list->array[i] = keys[i].info;
+  }
+  free(keys);
+}
+
+/**
+ * @brief エントリ情報に基づいて情報を表示する
+ * @param[IN] info 表示する情報
+ */
+static void print_info(struct info *info) {
+  if (long_format) {
+    char buf[12];
+    get_mode_string(info->mode, buf);
+    out_puts(buf);
+    out_putc(' ');
+    out_int((int)info->nlink, 3);
+    out_putc(' ');
+    print_user(info->uid);
+    print_group(info->gid);
+    if (S_ISCHR(info->mode) || S_ISBLK(info->mode)) {
+      out_int((int)major(info->rdev), 4);
+      out_putc(',');
+      out_int((int)minor(info->rdev), 4);
+    } else {
+      out_int(info->size, 9);
+    }
+    out_putc(' ');
+    get_time_string(buf, info->mtime);
+    out_puts(buf);
+    out_putc(' ');
+  }
+  if (color) {
+    /* ln=targetの場合、リンク先が存在すればその分類と拡張子で色付けする */
+    bool as_target = color_link_target && S_ISLNK(info->mode) && info->link_ok;
+    print_name_with_color(info->name, as_target ? info->link_mode : info->mode, info->link_ok);
+  } else {
+    out_puts(info->name);
+  }
+  if (classify) {
+    print_type_indicator(info->mode);
+  }
+  if (long_format) {
+    if (info->link != NULL) {
+      out_puts(" -> ");
+      if (color) {
+        print_name_with_color(info->link, info->link_mode, info->link_ok);
+      } else {
+        out_puts(info->link);
+      }
+    }
+  }
+  out_putc('\n');
+}
+
+/**
+ * @brief 表示対象外の隠しファイルか判定する
+ * @param[IN] name ファイル名
+ * @retval true  表示しない
+ * @retval false 表示する
+ */
+static bool is_hidden(const char *name) {
+  return filter != FILTER_ALL
+      && name[0] == '.'
+      && (filter == FILTER_DEFAULT
+          || name[1 + (name[1] == '.')] == '\0');
+}
+
+/**
+ * @brief ディレクトリのエントリを表示する
+ * 再帰的な表示の場合はサブディレクトリを処理中のディレクトリの直後にキューイングする。
+ *
+ * @param[IN]     list     表示するエントリ
+ * @param[IN]     base     処理中のディレクトリ
+ * @param[IN]     fd       処理中のディレクトリのfd
+ * @param[IN/OUT] self     処理中のディレクトリのstruct dir_fd、未作成の場合NULL
+ * @param[IN/OUT] subque   最後にキューイングしたディレクトリ
+ * @param[IN/OUT] path     処理中のディレクトリのパス、末尾にサブディレクトリ名を書き込む
+ * @param[IN]     path_len パスの長さ
+ */
+static void print_list(struct info_list *list, struct dir_path *base, int fd, struct dir_fd **self, struct dir_path **subque, char *path, size_t path_len) {
+  int i;
+  for (i = 0; i < list->used; i++) {
+    struct info *info = list->array[i];
+    if (recursive && S_ISDIR(info->mode)) {
+      const char *name = info->name;
+      if (!(name[0] == '.'
+          && name[1 + (name[1] == '.')] == '\0')) {
+        if (*self == NULL) {
+          *self = new_dir_fd(fd);
+        }
+        (*self)->ref++;
+        strncpy(&path[path_len], name, PATH_MAX - path_len);
+        (*subque)->next = new_dir_path(path, *self, base->depth + 1, (*subque)->next);
+        *subque = (*subque)->next;
+      }
+    }
+    print_info(info);
+  }
+}
+
+/**
+ * @brief パス名からファイル名を取り出す
+ * @param[IN] path パス名
+ * @return path名内のファイル名を指すポインタ
+ */
+static const char *find_filename(const char *path) {
+  int i;
+  size_t path_len = strlen(path);
+  for (i = path_len;i >= 0; i--) {
+    if (path[i] == '/') {
+      return &path[i+1];
+    }
+  }
+  return path;
+}
+
+/**
+ * @brief ディレクトリエントリの読み出しを開始する
+ * 読み出しバッファは全ディレクトリで共有し、初回に確保する。
+ *
+ * @param[OUT] reader 初期化する構造体
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのディレクトリの相対パス
+ * @return 成功した場合true、失敗した場合はerrnoを設定しfalse
+ */
+static bool open_dir_reader(struct dir_reader *reader, int dirfd, const char *path) {
+  reader->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (reader->fd < 0) {
+    return false;
+  }
+  if (dirent_buf == NULL) {
+    dirent_buf = xmalloc(dirent_buf_size);
+  }
+  reader->buf = dirent_buf;
+  reader->pos = 0;
+  reader->end = 0;
+  return true;
+}
+
+/**
+ * @brief 次のディレクトリエントリを読み出す
+ * バッファを使い切った場合のみgetdents64を発行する。
+ * 返却するエントリはバッファ内を直接指しており、次の呼び出しまで有効。
+ *
+ * @param[IN/OUT] reader 読み出し中の構造体
+ * @return ディレクトリエントリ、終端もしくはエラーの場合NULL
+ */
+static struct linux_dirent64 *read_dir_entry(struct dir_reader *reader) {
+  struct linux_dirent64 *dent;
+  if (reader->pos >= reader->end) {
+    long n = syscall(SYS_getdents64, reader->fd, reader->buf, dirent_buf_size);
+    if (n <= 0) {
+      if (n < 0) {
+        print_error("getdents64: %s\n", strerror(errno));
+      }
+      return NULL;
+    }
+    reader->pos = 0;
+    reader->end = n;
+  }
+  dent = (struct linux_dirent64 *)(reader->buf + reader->pos);
+  reader->pos += dent->d_reclen;
+  return dent;
+}
+
+/**
+ * @brief getdents64で読み出した分をすべて返したかを判定する
+ * @param[IN] reader 読み出し中の構造体
+ * @return 次の読み出しでgetdents64を発行する場合true
+ */
+static bool is_batch_end(const struct dir_reader *reader) {
+  return reader->pos >= reader->end;
+}
+
+/**
+ * @brief ディレクトリエントリの読み出しを終了する
+ * @param[IN] reader 終了する構造体
+ */
+static void close_dir_reader(struct dir_reader *reader) {
+  close(reader->fd);
+}
+
+/**
+ * @brief 指定パスのディレクトリエントリをリストする
+ * @param[IN] base パス
+ */
+static void list_dir(struct dir_path *base) {
+  const char *base_path = base->path;
+  struct dir_reader reader;
+  struct linux_dirent64 *dent;
+  char path[PATH_MAX + 1];
+  size_t path_len;
+  struct info_list list;
+  struct dir_path *subque = base;
+  struct dir_fd *self = NULL;
+  struct uring *ring = walk.num != 0 ? walker_uring : get_uring();
+  struct stat_pool *pool = ring != NULL ? NULL : walk.num != 0 ? walker_pool : get_stat_pool();
+  int parent_fd = base->parent != NULL ? base->parent->fd : AT_FDCWD;
+  if (!open_dir_reader(&reader, parent_fd, base->name)) {
+    if (errno == ENOTDIR) {
+      const char *name = find_filename(base_path);
+      struct info *info;
+      init_info_list(&list, 1);
+      info = new_info(parent_fd, base->name, name, DT_UNKNOWN, &list);
+      if (info != NULL) {
+        print_info(info);
+        add_info(&list, info);
+      } else {
+        print_error("%s: %s\n", base_path, strerror(errno));
+      }
+      free_info_list(&list);
+    } else {
+      print_error("%s: %s\n", base_path, strerror(errno));
+    }
+    release_dir_fd(base->parent);
+    return;
+  }
+  release_dir_fd(base->parent);
+  path_len = strlen(base_path);
+  if (path_len >= PATH_MAX - 1) {
+    print_error("too long path\n");
+    close_dir_reader(&reader);
+    return;
+  }
+  strncpy(path, base_path, PATH_MAX);
+  if (path[path_len - 1] != '/') {
+    path[path_len] = '/';
+    path_len++;
+    path[path_len] = '\0';
+  }
+  init_info_list(&list, 100);
+  while ((dent = read_dir_entry(&reader)) != NULL) {
+    struct info *info;
+    const char *name = dent->d_name;
+    if (!is_hidden(name)) {
+      if (ring != NULL && need_stat(dent->d_type)) {
+        info = alloc_info(&list, name);
+        add_uring_job(ring, reader.fd, info, list.links);
+      } else if (pool != NULL && need_stat(dent->d_type)) {
+        info = alloc_info(&list, name);
+        submit_stat_job(pool, reader.fd, info, dent->d_type, list.links);
+      } else {
+        info = new_info(reader.fd, name, name, dent->d_type, &list);
+      }
+      if (info != NULL) {
+        add_info(&list, info);
+      } else {
+        print_error("%s%s: %s\n", path, name, strerror(errno));
+      }
+    }
+    if (!is_batch_end(&reader)) {
+      continue;
+    }
+    if (ring != NULL) {
+      run_uring_jobs(ring, reader.fd, list.links);
+    }
+    if (unsorted) {
+      /* 読み出したバッファ分を表示し、エントリの領域を使い回す */
+      if (ring != NULL) {
+        remove_failed_info(&list, path);
+      } else if (pool != NULL) {
+        wait_stat_jobs(pool);
+        remove_failed_info(&list, path);
+      }
+      print_list(&list, base, reader.fd, &self, &subque, path, path_len);
+      list.used = 0;
+      reset_arena(list.arena);
+      reset_arena(list.links);
+      if (out_interactive) {
+        out_flush();
+      }
+    }
+  }
+  if (ring != NULL) {
+    run_uring_jobs(ring, reader.fd, list.links);
+    remove_failed_info(&list, path);
+  } else if (pool != NULL) {
+    wait_stat_jobs(pool);
+    remove_failed_info(&list, path);
+  }
+  if (!unsorted) {
+    sort_list(&list);
+  }
+  print_list(&list, base, reader.fd, &self, &subque, path, path_len);
+  if (self == NULL) {
+    close_dir_reader(&reader);
+  }
+  free_info_list(&list);
+}
+
+/**
+ * @brief タスクを両端キューの末尾へ追加する
+ * @param[IN] deque 両端キュー
+ * @param[IN] task  タスク
+ */
+static void push_task(struct task_deque *deque, struct dir_task *task) {
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->tail == deque->size) {
+    if (deque->head != 0) {
+      memmove(deque->array, deque->array + deque->head,
+              sizeof(struct dir_task *) * (deque->tail - deque->head));
+      deque->tail -= deque->head;
+      deque->head = 0;
+    } else {
+      deque->size = deque->size != 0 ? deque->size * 2 : TASK_DEQUE_INITIAL_SIZE;
+      deque->array = xrealloc(deque->array, sizeof(struct dir_task *) * deque->size);
+    }
+  }
+  deque->array[deque->tail++] = task;
+  pthread_mutex_unlock(&deque->mutex);
+}
+
+/**
+ * @brief 両端キューの末尾からタスクを取り出す
+ * @param[IN] deque 両端キュー
+ * @return タスク、空の場合NULL
+ */
+static struct dir_task *pop_task(struct task_deque *deque) {
+  struct dir_task *task = NULL;
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->tail != deque->head) {
+    task = deque->array[--deque->tail];
+    __atomic_store_n(&task->running, true, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+/**
+ * @brief 両端キューの先頭からタスクを盗む
+ * 先頭には浅い階層のタスクが残っているため、盗んだ側もまとまった仕事を得られる
+ * @param[IN] deque 両端キュー
+ * @return タスク、空の場合NULL
+ */
+static struct dir_task *steal_task(struct task_deque *deque) {
+  struct dir_task *task = NULL;
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->tail != deque->head) {
+    task = deque->array[deque->head++];
+    __atomic_store_n(&task->running, true, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+/**
+ * @brief 処理するタスクを取得する
+ * 自分の両端キューが空の場合は他のワーカーから盗む
+ * @param[IN] walker ワーカー
+ * @return タスク、見つからなかった場合NULL
+ */
+static struct dir_task *take_task(struct walker *walker) {
+  struct dir_task *task = pop_task(&walker->deque);
+  int i;
+  for (i = 1; task == NULL && i <= walk.num; i++) {
+    task = steal_task(&walk.walkers[(walker->index + i) % (walk.num + 1)].deque);
+    if (task != NULL) {
+      walker->steals++;
+    }
+  }
+  if (task != NULL) {
+    __atomic_sub_fetch(&walk.queued, 1, __ATOMIC_SEQ_CST);
+  }
+  return task;
+}
+
+/**
+ * @brief 両端キューから指定したタスクを取り除く
+ * @param[IN] deque 両端キュー
+ * @param[IN] task  タスク
+ * @return 取り除いた場合true、含まれていなかった場合false
+ */
+static bool remove_task(struct task_deque *deque, struct dir_task *task) {
+  bool found = false;
+  size_t i;
+  pthread_mutex_lock(&deque->mutex);
+  for (i = deque->head; i < deque->tail; i++) {
+    if (deque->array[i] == task) {
+      memmove(deque->array + i, deque->array + i + 1,
+              sizeof(struct dir_task *) * (deque->tail - i - 1));
+      deque->tail--;
+      __atomic_store_n(&task->running, true, __ATOMIC_SEQ_CST);
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return found;
+}
+
+/**
+ * @brief 単調増加する時刻を取得する
+ * @return ナノ秒単位の時刻
+ */
+static long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * @brief 出力待ちのメモリ量を増減する
+ * @param[IN] size 増減する量
+ */
+static void add_buffered(long size) {
+  size_t buffered = __atomic_add_fetch(&walk.buffered, size, __ATOMIC_SEQ_CST);
+  size_t max = __atomic_load_n(&walk.buffered_max, __ATOMIC_RELAXED);
+  while (buffered > max
+      && !__atomic_compare_exchange_n(&walk.buffered_max, &max, buffered, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/**
+ * @brief 出力待ちのメモリ量が上限を下回るまで待つ
+ * ワーカーは新しいディレクトリに取り掛かる前にこれを呼び出す。
+ * 出力が待っているタスクはメインスレッドが自ら処理するため、全員が待っても停止しない。
+ */
+static void wait_for_space(void) {
+  if (__atomic_load_n(&walk.buffered, __ATOMIC_SEQ_CST) < walk_buffer_size) {
+    return;
+  }
+  long start = now_ns();
+  pthread_mutex_lock(&walk.mutex);
+  __atomic_add_fetch(&walk.stalled, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&walk.buffered, __ATOMIC_SEQ_CST) >= walk_buffer_size
+      && !walk.finished) {
+    pthread_cond_wait(&walk.space, &walk.mutex);
+  }
+  __atomic_sub_fetch(&walk.stalled, 1, __ATOMIC_SEQ_CST);
+  walk.stall_ns += now_ns() - start;
+  pthread_mutex_unlock(&walk.mutex);
+}
+
+/**
+ * @brief struct dir_taskのファクトリーメソッド
+ * @param[IN] dir    処理するディレクトリ
+ * @param[IN] parent 親ディレクトリのタスク
+ * @return struct dir_taskへのポインタ
+ */
+static struct dir_task *new_dir_task(struct dir_path *dir, struct dir_task *parent) {
+  struct dir_task *task = xmalloc(sizeof(struct dir_task));
+  task->dir = dir;
+  task->parent = parent;
+  task->child = NULL;
+  task->sibling = NULL;
+  task->text = NULL;
+  task->len = 0;
+  task->size = 0;
+  task->error = NULL;
+  task->error_len = 0;
+  task->running = false;
+  task->done = false;
+  return task;
+}
+
+/**
+ * @brief 1つのディレクトリを表示内容へ変換し、サブディレクトリをタスクとして追加する
+ * サブディレクトリは表示順の先頭から処理されるよう逆順に両端キューへ積む。
+ * メインスレッドが処理する場合は出力待ちのものがないため、直接出力バッファへ書き込む。
+ *
+ * @param[IN] walker ワーカー
+ * @param[IN] task   タスク
+ */
+static void run_task(struct walker *walker, struct dir_task *task) {
+  struct dir_path *dir = task->dir;
+  struct dir_path *sub;
+  struct dir_task **children = NULL;
+  struct dir_task **link = &task->child;
+  long count = 0;
+  long i;
+  dir->next = NULL;
+  if (dir->depth != 0) {
+    out_printf("\n%s:\n", dir->path);
+  }
+  list_dir(dir);
+  if (out_capture) {
+    task->text = out.buf;
+    task->len = out.used;
+    task->size = out.size;
+    out.buf = NULL;
+    out.size = 0;
+    out.used = 0;
+    task->error = err_out.buf;
+    task->error_len = err_out.used;
+    err_out.buf = NULL;
+    err_out.size = 0;
+    err_out.used = 0;
+  }
+  for (sub = dir->next; sub != NULL; sub = sub->next) {
+    *link = new_dir_task(sub, task);
+    link = &(*link)->sibling;
+    count++;
+  }
+  free(dir);
+  task->dir = NULL;
+  walker->tasks++;
+  if (count != 0) {
+    struct dir_task *child;
+    children = xmalloc(sizeof(struct dir_task *) * count);
+    for (i = 0, child = task->child; child != NULL; child = child->sibling) {
+      children[i++] = child;
+    }
+    __atomic_add_fetch(&walk.outstanding, count, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&walk.queued, count, __ATOMIC_SEQ_CST);
+    for (i = count - 1; i >= 0; i--) {
+      push_task(&walker->deque, children[i]);
+    }
+    free(children);
+    if (__atomic_load_n(&walk.sleepers, __ATOMIC_SEQ_CST) != 0) {
+      pthread_mutex_lock(&walk.mutex);
+      pthread_cond_broadcast(&walk.work);
+      pthread_mutex_unlock(&walk.mutex);
+    }
+  }
+  pthread_mutex_lock(&walk.mutex);
+  __atomic_store_n(&task->done, true, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&walk.done);
+  if (__atomic_sub_fetch(&walk.outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+    walk.finished = true;
+    pthread_cond_broadcast(&walk.work);
+  }
+  pthread_mutex_unlock(&walk.mutex);
+}
+
+/**
+ * @brief 並列な再帰表示でタスクを処理するスレッドの情報取得の手段を用意する
+ * io_uringはスレッドごとにリングを作り、情報取得のスレッドは指定された数をワーカーで分け合う。
+ */
+static void init_walker_stat(void) {
+  if (use_uring) {
+    walker_uring = new_uring();
+  }
+  if (walker_uring == NULL && stat_threads / walk.num > 1) {
+    walker_pool = new_stat_pool(stat_threads / walk.num);
+  }
+}
+
+/**
+ * @brief 並列な再帰表示のワーカースレッド
+ * 出力、キャッシュ、アリーナはスレッドごとに持つ
+ *
+ * @param[IN] arg struct walker
+ * @return NULL
+ */
+static void *walk_worker(void *arg) {
+  struct walker *walker = arg;
+  out_capture = true;
+  init_walker_stat();
+  for (;;) {
+    wait_for_space();
+    struct dir_task *task = take_task(walker);
+    if (task != NULL) {
+      run_task(walker, task);
+      continue;
+    }
+    pthread_mutex_lock(&walk.mutex);
+    __atomic_add_fetch(&walk.sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&walk.queued, __ATOMIC_SEQ_CST) == 0 && !walk.finished) {
+      pthread_cond_wait(&walk.work, &walk.mutex);
+    }
+    __atomic_sub_fetch(&walk.sleepers, 1, __ATOMIC_SEQ_CST);
+    bool finished = walk.finished;
+    pthread_mutex_unlock(&walk.mutex);
+    if (finished) {
+      break;
+    }
+  }
+  walker->user_cache = user_cache;
+  walker->group_cache = group_cache;
+  return NULL;
+}
+
+/**
+ * @brief タスクの表示内容を出力し、溜めたエラーメッセージを出力した位置へ挟む
+ * 端末の場合は逐次処理と同様に、エラーメッセージより前の表示内容を先に書き出す。
+ *
+ * @param[IN] task 処理が完了したタスク
+ */
+static void write_task_output(const struct dir_task *task) {
+  size_t pos = 0;
+  size_t i = 0;
+  while (i < task->error_len) {
+    const char *message = task->error + i + sizeof(size_t);
+    size_t at;
+    memcpy(&at, task->error + i, sizeof(size_t));
+    if (at > pos) {
+      out_write(task->text + pos, at - pos);
+      pos = at;
+    }
+    if (out_interactive) {
+      out_flush();
+    }
+    fputs(message, stderr);
+    i += sizeof(size_t) + strlen(message) + 1;
+  }
+  if (task->len > pos) {
+    out_write(task->text + pos, task->len - pos);
+  }
+}
+
+/**
+ * @brief タスクの木を前順に辿り、逐次処理と同じ順序で表示内容を出力する
+ * 処理が終わっていないタスクに到達した場合、まだ誰も取り掛かっていなければ自ら処理し、
+ * 処理中であれば完了を待つ。出力したタスクの分だけ出力待ちのメモリ量を減らす。
+ *
+ * @param[IN] task 先頭のタスク
+ */
+static void emit_tasks(struct dir_task *task) {
+  struct walker *self = &walk.walkers[walk.num];
+  while (task != NULL) {
+    if (!__atomic_load_n(&task->done, __ATOMIC_SEQ_CST)
+        && !__atomic_load_n(&task->running, __ATOMIC_SEQ_CST)) {
+      int i;
+      for (i = 0; i <= walk.num; i++) {
+        if (remove_task(&walk.walkers[i].deque, task)) {
+          __atomic_sub_fetch(&walk.queued, 1, __ATOMIC_SEQ_CST);
+          run_task(self, task);
+          break;
+        }
+      }
+    }
+    pthread_mutex_lock(&walk.mutex);
+    if (!task->done) {
+      long start = now_ns();
+      while (!task->done) {
+        pthread_cond_wait(&walk.done, &walk.mutex);
+      }
+      walk.emit_wait_ns += now_ns() - start;
+    }
+    pthread_mutex_unlock(&walk.mutex);
+    write_task_output(task);
+    free(task->error);
+    task->error = NULL;
+    if (task->text != NULL) {
+      free(task->text);
+      task->text = NULL;
+      add_buffered(-(long)task->size);
+      if (__atomic_load_n(&walk.stalled, __ATOMIC_SEQ_CST) != 0) {
+        pthread_mutex_lock(&walk.mutex);
+        pthread_cond_broadcast(&walk.space);
+        pthread_mutex_unlock(&walk.mutex);
+      }
+    }
+    if (out_interactive) {
+      out_flush();
+    }
+    if (task->child != NULL) {
+      task = task->child;
+      continue;
+    }
+    /* 子孫を出力し終えたタスクを解放しながら次の兄弟まで戻る */
+    while (task != NULL && task->sibling == NULL) {
+      struct dir_task *parent = task->parent;
+      free(task);
+      task = parent;
+    }
+    if (task != NULL) {
+      struct dir_task *sibling = task->sibling;
+      free(task);
+      task = sibling;
+    }
+  }
+}
+
+/**
+ * @brief 再帰的な表示を複数のワーカースレッドで行う
+ * 各ワーカーは両端キューからディレクトリを取り出して処理し、
+ * 空になった場合は他のワーカーから盗む。
+ * メインスレッドは処理結果を逐次処理と同じ順序で出力する。
+ *
+ * @param[IN] head 引数で指定されたディレクトリのリスト
+ */
+static void walk_parallel(struct dir_path *head) {
+  struct dir_task *first = NULL;
+  struct dir_task **link = &first;
+  struct dir_task **roots;
+  struct dir_task *task;
+  long count = 0;
+  long i;
+  walk.num = walk_threads;
+  walk.walkers = xmalloc(sizeof(struct walker) * (walk.num + 1));
+  memset(walk.walkers, 0, sizeof(struct walker) * (walk.num + 1));
+  pthread_mutex_init(&walk.mutex, NULL);
+  pthread_cond_init(&walk.work, NULL);
+  pthread_cond_init(&walk.done, NULL);
+  pthread_cond_init(&walk.space, NULL);
+  while (head != NULL) {
+    struct dir_path *next = head->next;
+    *link = new_dir_task(head, NULL);
+    link = &(*link)->sibling;
+    head = next;
+    count++;
+  }
+  roots = xmalloc(sizeof(struct dir_task *) * count);
+  for (i = 0, task = first; task != NULL; task = task->sibling) {
+    roots[i++] = task;
+  }
+  walk.outstanding = count;
+  walk.queued = count;
+  for (i = 0; i <= walk.num; i++) {
+    struct walker *walker = &walk.walkers[i];
+    walker->index = i;
+    pthread_mutex_init(&walker->deque.mutex, NULL);
+  }
+  for (i = count - 1; i >= 0; i--) {
+    push_task(&walk.walkers[0].deque, roots[i]);
+  }
+  free(roots);
+  for (i = 0; i < walk.num; i++) {
+    int err = pthread_create(&walk.walkers[i].thread, NULL, walk_worker, &walk.walkers[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+  init_walker_stat();
+  emit_tasks(first);
+  pthread_mutex_lock(&walk.mutex);
+  pthread_cond_broadcast(&walk.space);
+  pthread_mutex_unlock(&walk.mutex);
+  for (i = 0; i < walk.num; i++) {
+    pthread_join(walk.walkers[i].thread, NULL);
+  }
+}
+
+int main(int argc, char**argv) {
+  struct dir_path *head = parse_cmd_args(argc, argv);
+  if (head == NULL) {
+    return EXIT_FAILURE;
+  }
+  out_interactive = isatty(STDOUT_FILENO);
+  if (recursive && !unsorted && walk_threads > 1) {
+    walk_parallel(head);
+    head = NULL;
+  }
+  while(head != NULL) {
+    if (head->depth != 0) {
+      out_printf("\n%s:\n", head->path);
+    }
+    list_dir(head);
+    if (out_interactive) {
+      out_flush();
+    }
+    struct dir_path *tmp = head;
+    head = head->next;
+    free(tmp);
+  }
+  out_flush();
+  if (show_stats) {
+    print_stats();
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,5926 @@
+/**
+ * @file ls39.c
+ *
+ * Copyright (c) 2015 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief lsコマンド風のプログラムを作るNo.39
+ * 情報取得前の名前のパターンによる絞り込み
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2026/10/17
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+
+#define PATH_MAX 4096
+#define HALF_YEAR_SECOND (365 * 24 * 60 * 60 / 2)
+#define DIRENT_BUF_DEFAULT (256 * 1024)
+#define DIRENT_BUF_MIN (4 * 1024)
+#define DIRENT_BUF_MAX (64 * 1024 * 1024)
+#define STAT_QUEUE_SIZE 1024
+#define URING_ENTRIES 256
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define SORT_INSERTION_MAX 32
+#define ID_CACHE_INITIAL_SIZE 64
+#define OUT_BUF_DEFAULT (256 * 1024)
+#define OUT_BUF_MIN (4 * 1024)
+#define OUT_BUF_MAX (64 * 1024 * 1024)
+#define COLOR_SEQ(seq) { seq, sizeof(seq) - 1 }
+#define EXT_COLOR_INITIAL_SIZE 64
+#define EXT_COLOR_MAX_LEN 64
+#define TASK_DEQUE_INITIAL_SIZE 64
+#define VISITED_INITIAL_SIZE 1024
+#define WALK_BUFFER_DEFAULT (64 * 1024 * 1024)
+#define SNAPSHOT_MAGIC "LSSNAP\0\0"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BUF_SIZE (1024 * 1024)
+#define WATCH_HASH_INITIAL_SIZE 1024
+#define WATCH_EVENT_BUF_SIZE (64 * 1024)
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB \
+    | IN_MODIFY | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_CHANGE_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+#ifndef S_IXUGO
+#define S_IXUGO (S_IXUSR | S_IXGRP | S_IXOTH)
+#endif
+
+/**
+ * 隠しファイルの表示方針
+ */
+enum {
+  FILTER_DEFAULT, /**< '.'から始まるもの以外を表示する */
+  FILTER_ALMOST,  /**< '.'と'..'以外を表示する */
+  FILTER_ALL,     /**< すべて表示する */
+};
+
+/**
+ * 短縮形を持たないオプション
+ */
+enum {
+  OPT_BUFFER_SIZE = 256, /**< getdents64のバッファサイズ */
+  OPT_THREADS,           /**< 情報取得のスレッド数 */
+  OPT_IO_URING,          /**< io_uringによる情報取得 */
+  OPT_STATS,             /**< 統計情報の表示 */
+  OPT_OUTPUT_BUFFER,     /**< 出力バッファのサイズ */
+  OPT_WALKERS,           /**< 再帰的な表示のスレッド数 */
+  OPT_WALK_BUFFER,       /**< 並列な再帰表示で出力待ちにできるメモリ量 */
+  OPT_SAVE_SNAPSHOT,     /**< スナップショットファイルへの保存 */
+  OPT_LOAD_SNAPSHOT,     /**< スナップショットファイルからの表示 */
+  OPT_INCREMENTAL,       /**< スナップショットファイルの内容の再利用 */
+  OPT_TRUST_SNAPSHOT,    /**< 再利用するエントリの情報を取得し直さない */
+  OPT_SERVE,             /**< 一覧を保持してUNIXソケットで提供する */
+  OPT_QUERY,             /**< UNIXソケットで一覧を問い合わせる */
+  OPT_QUERY_COUNT,       /**< 問い合わせの繰り返し回数 */
+  OPT_INCLUDE,           /**< 表示する名前のワイルドカード */
+  OPT_EXCLUDE,           /**< 表示しない名前のワイルドカード */
+  OPT_INCLUDE_REGEX,     /**< 表示する名前の正規表現 */
+  OPT_EXCLUDE_REGEX,     /**< 表示しない名前の正規表現 */
+};
+
+/**
+ * 名前のパターンの照合方法
+ */
+enum {
+  MATCH_EXACT,    /**< 全体が一致する */
+  MATCH_PREFIX,   /**< 先頭が一致する */
+  MATCH_SUFFIX,   /**< 末尾が一致する */
+  MATCH_CONTAINS, /**< 途中に含む */
+  MATCH_ANY,      /**< すべてに一致する */
+  MATCH_GLOB,     /**< fnmatchで照合する */
+  MATCH_REGEX,    /**< 正規表現で照合する */
+};
+
+/**
+ * 色付き表示の分類
+ */
+enum {
+  COLOR_NONE,                  /**< 不明な種別 */
+  COLOR_FILE,                  /**< 通常ファイル */
+  COLOR_SETUID,                /**< setuidされたファイル */
+  COLOR_SETGID,                /**< setgidされたファイル */
+  COLOR_EXEC,                  /**< 実行可能なファイル */
+  COLOR_DIR,                   /**< ディレクトリ */
+  COLOR_STICKY_OTHER_WRITABLE, /**< スティッキーかつ他者書き込み可能なディレクトリ */
+  COLOR_OTHER_WRITABLE,        /**< 他者書き込み可能なディレクトリ */
+  COLOR_STICKY,                /**< スティッキーなディレクトリ */
+  COLOR_LINK,                  /**< シンボリックリンク */
+  COLOR_FIFO,                  /**< 名前付きパイプ */
+  COLOR_SOCK,                  /**< ソケット */
+  COLOR_BLK,                   /**< ブロックデバイス */
+  COLOR_CHR,                   /**< キャラクタデバイス */
+  COLOR_ORPHAN,                /**< リンク先が存在しない */
+  COLOR_NUM,
+};
+
+/**
+ * getdents64で取得するディレクトリエントリ
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * getdents64によるディレクトリエントリの読み出し
+ */
+struct dir_reader {
+  int fd;
+  char *buf;
+  size_t pos;
+  size_t end;
+};
+
+/**
+ * 子ディレクトリを開くために保持する親ディレクトリのfd
+ * 参照している子ディレクトリがすべて処理されたところでcloseする
+ */
+struct dir_fd {
+  int fd;
+  int ref;
+};
+
+/**
+ * 再帰呼び出しのためのディレクトリ名を保持するリンクリスト
+ * パスは親ディレクトリの要素への参照と名前で保持し、必要な時に組み立てる。
+ * 子の要素から参照されている間は解放しない。
+ */
+struct dir_path {
+  struct dir_path *up;
+  struct dir_fd *parent;
+  struct dir_path *next;
+  int depth;
+  int ref;
+  bool has_ino;
+  bool checked;
+  dev_t dev;
+  ino_t ino;
+  char name[];
+};
+
+/**
+ * アリーナの領域の塊
+ */
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  max_align_t data[];
+};
+
+/**
+ * 先頭から順に切り出していくメモリ領域
+ * 個別の開放はできず、reset_arenaで一括して開放する。
+ * 開放した塊は手放さずに次の確保で再利用する。
+ */
+struct arena {
+  struct arena_chunk *head;
+  struct arena_chunk *current;
+  size_t used;
+};
+
+/**
+ * ファイル情報の格納
+ * 構造体と名前、リンク先はアリーナに格納し、リンク先はシンボリックリンクの場合のみ持つ。
+ * statの結果は表示に使う項目のみを保持する。
+ */
+struct info {
+  const char *name;
+  const char *link;
+  off_t size;
+  dev_t rdev;
+  time_t mtime;
+  mode_t mode;
+  mode_t link_mode;
+  uid_t uid;
+  gid_t gid;
+  unsigned int nlink;
+  int error;
+  bool link_ok;
+  dev_t dev;
+  ino_t ino;
+};
+
+/**
+ * ファイル情報を格納する可変長リスト
+ */
+struct info_list {
+  struct info **array;
+  int size;
+  int used;
+  struct arena *arena;
+  struct arena *links;
+};
+
+/**
+ * ソート用のキー
+ * 名前の8バイトをビッグエンディアンで詰めた値を持ち、
+ * 大小関係がstrcmpの該当8バイトの比較と一致する。
+ */
+struct sort_key {
+  uint64_t prefix;
+  struct info *info;
+};
+
+/**
+ * 標準出力への出力バッファ
+ * stdioを介さず、一杯になった時点でまとめてwriteする
+ */
+struct out_buf {
+  char *buf;
+  size_t size;
+  size_t used;
+};
+
+/**
+ * uid/gidと名前の対応
+ */
+struct id_entry {
+  unsigned int id;
+  bool used;
+  char *name;
+};
+
+/**
+ * 時刻表示文字列のキャッシュ
+ * UTCからのオフセットが一定であるローカル日付1日分の範囲と、
+ * その日の文字列、直前に作成した分単位の文字列を保持する
+ */
+struct time_cache {
+  time_t day_start;
+  time_t day_end;
+  char date[6];
+  char old[12];
+  time_t minute;
+  char recent[12];
+};
+
+/**
+ * 色付き表示のエスケープシーケンス
+ */
+struct color_seq {
+  const char *seq;
+  size_t len;
+};
+
+/**
+ * 拡張子ごとの色付き表示
+ * 拡張子は小文字で保持する
+ */
+struct ext_color {
+  char *ext;
+  size_t len;
+  struct color_seq seq;
+  int order;
+};
+
+/**
+ * 拡張子以外のパターンによる色付き表示
+ * "*"に続く部分にワイルドカードを含まない場合は末尾の比較だけで照合する
+ */
+struct pattern_color {
+  char *pattern;
+  size_t suffix_len;
+  bool suffix;
+  struct color_seq seq;
+  int order;
+};
+
+/**
+ * LS_COLORSのパターン指定
+ * 最後の'.'以降を拡張子とするハッシュテーブルと、それ以外のパターンのリストからなる。
+ * 複数に一致する場合はLS_COLORSで後に指定されたものを優先する。
+ */
+struct ext_colors {
+  struct ext_color *table;
+  size_t size;
+  size_t used;
+  size_t max_len;
+  struct pattern_color *patterns;
+  size_t pattern_num;
+};
+
+/**
+ * --include/--excludeで指定された名前のパターン
+ * ワイルドカードや正規表現の特殊文字を除いた部分が固定の文字列になる場合は、
+ * その文字列との比較だけで照合する。
+ */
+struct name_pattern {
+  int type;
+  char *literal;
+  size_t len;
+  char *glob;
+  regex_t regex;
+};
+
+/**
+ * 名前のパターンの一覧、いずれかに一致すれば一致とする
+ */
+struct name_filter {
+  struct name_pattern *patterns;
+  int num;
+};
+
+/**
+ * uid/gidから名前を引くオープンアドレス法のハッシュテーブル
+ * 名前が見つからなかったものもNULLとして記録する
+ */
+struct id_cache {
+  struct id_entry *table;
+  size_t size;
+  size_t used;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/**
+ * ワーカースレッドへ依頼する情報取得
+ */
+struct stat_job {
+  struct info *info;
+  struct arena *links;
+  int dirfd;
+  unsigned char d_type;
+};
+
+/**
+ * 情報取得を行うワーカースレッドと依頼のキュー
+ */
+struct stat_pool {
+  struct stat_job jobs[STAT_QUEUE_SIZE];
+  int head;
+  int count;
+  int pending;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t done;
+};
+
+/**
+ * io_uringへ依頼する情報取得
+ */
+struct uring_job {
+  struct info *info;
+  struct statx stx;
+  int res;
+};
+
+/**
+ * io_uringのリングと依頼待ちの情報取得
+ */
+struct uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct uring_job jobs[URING_ENTRIES];
+  int used;
+};
+
+/**
+ * 表示済みのディレクトリの識別子
+ */
+struct visited_entry {
+  uint64_t dev;
+  uint64_t ino;
+};
+
+/**
+ * 表示済みのディレクトリを記録するオープンアドレス法のハッシュテーブル
+ * inoが0のスロットを空きとする
+ */
+struct visited_set {
+  struct visited_entry *table;
+  size_t size;
+  size_t used;
+};
+
+/**
+ * スナップショットファイルのヘッダ
+ * ファイルは先頭からヘッダ、エントリ、文字列表、ディレクトリの順に並び、
+ * 各オフセットはファイル先頭からのバイト数とする。
+ * 作成した環境のバイトオーダー、構造体の配置のまま書き出し、
+ * 読み込み時はmmapした領域をそのまま参照する。
+ */
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint32_t dir_size;
+  uint32_t filter;
+  int64_t time;
+  uint64_t entry_num;
+  uint64_t entry_offset;
+  uint64_t string_size;
+  uint64_t string_offset;
+  uint64_t dir_num;
+  uint64_t dir_offset;
+};
+
+/**
+ * スナップショットファイルのエントリ
+ * 文字列は文字列表の先頭からのオフセットで持ち、0はリンク先がないことを示す。
+ */
+struct snapshot_entry {
+  uint64_t name;
+  uint64_t link;
+  int64_t size;
+  uint64_t rdev;
+  int64_t mtime;
+  uint32_t mode;
+  uint32_t link_mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint32_t link_ok;
+};
+
+/**
+ * スナップショットファイルのディレクトリ
+ * 表示順に並び、エントリの範囲と開けなかった場合のerrnoを持つ。
+ * 再利用できるかの判定のため、読み出した時点のディレクトリ自身の情報を持つ。
+ */
+struct snapshot_dir {
+  uint64_t path;
+  uint64_t first;
+  uint64_t count;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t ctime_sec;
+  int32_t mtime_nsec;
+  int32_t ctime_nsec;
+  int32_t depth;
+  int32_t error;
+};
+
+/**
+ * スナップショットファイルの作成
+ * エントリは保存先へ直接書き込み、文字列表は一時ファイルへ溜めて最後に連結する。
+ * ディレクトリはメモリ上に保持する。
+ */
+struct snapshot_writer {
+  FILE *file;
+  FILE *strings;
+  char *path;
+  char *tmp_path;
+  struct snapshot_header header;
+  struct snapshot_dir *dirs;
+  size_t dir_size;
+};
+
+/**
+ * mmapしたスナップショットファイル
+ */
+struct snapshot {
+  const char *path;
+  const char *base;
+  size_t size;
+  const struct snapshot_header *header;
+  const struct snapshot_entry *entries;
+  const char *strings;
+  const struct snapshot_dir *dirs;
+  uint64_t *index;
+  size_t index_size;
+};
+
+/**
+ * 常駐して監視するディレクトリ
+ * エントリは表示順に並べて保持する。読み込み時に1つの領域へまとめて格納し、
+ * 以降の更新で追加したものは個別に確保する。
+ * パスでの検索用にハッシュテーブルのチェインを、部分木の削除用に子の一覧を持つ。
+ * 再帰的でない場合のサブディレクトリは、親での自身のエントリを更新するためだけに監視し、
+ * エントリは持たない。
+ * 引数で指定されたディレクトリは、".."を更新するために親ディレクトリも監視する。
+ * 祖先と同じディレクトリを指すものは、逐次処理と同じく監視も読み込みも行わず表示しない。
+ */
+struct watch_dir {
+  struct watch_dir *parent;
+  struct watch_dir *child;
+  struct watch_dir *sibling;
+  struct watch_dir *hash_next;
+  char *path;
+  const char *name;
+  int wd;
+  int parent_wd;
+  dev_t dev;
+  ino_t ino;
+  struct info **entries;
+  int used;
+  int size;
+  char *block;
+  size_t block_size;
+  int garbage;
+  bool shallow;
+  bool looping;
+};
+
+/**
+ * 常駐して監視しているディレクトリの索引
+ * inotifyの監視記述子からの配列と、パスからのハッシュテーブルからなる。
+ */
+struct watch_table {
+  struct watch_dir **by_wd;
+  int wd_size;
+  struct watch_dir **buckets;
+  size_t bucket_size;
+  size_t count;
+  struct watch_dir **roots;
+  int root_num;
+  int fd;
+  unsigned long events;
+  unsigned long queries;
+};
+
+/**
+ * 問い合わせの応答のヘッダ
+ * statusは0で成功、それ以外はerrnoを示し、lengthバイトの本文が続く。
+ */
+struct watch_reply {
+  uint32_t status;
+  uint32_t length;
+};
+
+/**
+ * 問い合わせを行うクライアントの接続
+ * 要求は改行で終わるパスで、1つの接続で繰り返し送ることができる。
+ */
+struct watch_client {
+  int fd;
+  size_t len;
+  char buf[PATH_MAX + 2];
+};
+
+/**
+ * 並列な再帰表示で1つのディレクトリを処理するタスク
+ * 表示順に並べた木を構成し、表示内容は処理したワーカーがtextへ作成する
+ */
+struct dir_task {
+  struct dir_path *dir;
+  struct task_deque *deque;
+  struct dir_task *parent;
+  struct dir_task *child;
+  struct dir_task *sibling;
+  char *text;
+  size_t len;
+  size_t size;
+  char *error;
+  size_t error_len;
+  bool running;
+  bool done;
+  bool skip;
+};
+
+/**
+ * ワーカーごとのタスクの両端キュー
+ * 所有するワーカーは末尾から、他のワーカーは先頭から取り出す
+ */
+struct task_deque {
+  pthread_mutex_t mutex;
+  struct dir_task **array;
+  size_t size;
+  size_t head;
+  size_t tail;
+};
+
+/**
+ * 並列な再帰表示のワーカー
+ */
+struct walker {
+  pthread_t thread;
+  int index;
+  struct task_deque deque;
+  unsigned long tasks;
+  unsigned long steals;
+  struct id_cache user_cache;
+  struct id_cache group_cache;
+};
+
+/**
+ * 並列な再帰表示の全体の状態
+ * 件数とメモリ量はアトミックに操作し、それ以外はmutexで保護する。
+ * walkersの末尾の要素は出力を行うメインスレッドのもの
+ */
+struct walk {
+  struct walker *walkers;
+  int num;
+  long queued;
+  long outstanding;
+  int sleepers;
+  bool finished;
+  size_t buffered;
+  size_t buffered_max;
+  int stalled;
+  long stall_ns;
+  long emit_wait_ns;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_cond_t space;
+};
+
+static void *xmalloc(size_t n);
+static void *xrealloc(void *ptr, size_t size);
+static bool parse_size(const char *str, size_t *size);
+static void write_all(const char *buf, size_t len);
+static void out_flush(void);
+static void flush_before_error(void);
+static void out_grow(size_t len);
+static void out_write(const char *str, size_t len);
+static void out_putc(char c);
+static void out_puts(const char *str);
+static void out_printf(const char *format, ...);
+static void print_error(const char *format, ...);
+static char *out_reserve(size_t len);
+static int count_digits(unsigned long value);
+static void out_int(long value, int width);
+static void out_str_right(const char *str, int width);
+static struct dir_path *parse_cmd_args(int argc, char**argv);
+static void get_mode_string(mode_t mode, char *str);
+static void print_type_indicator(mode_t mode);
+static char *resolve_user(unsigned int uid);
+static char *resolve_group(unsigned int gid);
+static struct id_entry *find_id_entry(struct id_entry *table, size_t size, unsigned int id);
+static const char *lookup_id(struct id_cache *cache, unsigned int id, char *(*resolve)(unsigned int));
+static void print_user(uid_t uid);
+static void print_group(gid_t gid);
+static void print_stats(void);
+static bool update_time_cache(time_t time);
+static void get_time_string(char *str, time_t time);
+static bool make_color_seq(const char *value, size_t len, struct color_seq *seq);
+static int find_color_code(const char *code, size_t len);
+static size_t hash_ext(const char *ext, size_t len);
+static struct ext_color *find_ext_entry(struct ext_color *table, size_t size, const char *ext, size_t len);
+static void add_ext_color(const char *ext, size_t len, const struct color_seq *seq, int order);
+static void add_pattern_color(const char *pattern, size_t len, const struct color_seq *seq, int order);
+static void parse_ls_colors(const char *env);
+static const struct color_seq *find_ext_color(const char *name, size_t len);
+static bool is_colored(int color_class);
+static int get_color_class(mode_t mode, bool link_ok);
+static void print_name_with_color(const char *name, mode_t mode, bool link_ok);
+static struct dir_fd *new_dir_fd(int fd);
+static void release_dir_fd(struct dir_fd *dir_fd);
+static struct dir_path *new_dir_path(const char *name, struct dir_path *up, struct dir_fd *parent, int depth, struct dir_path *next);
+static void release_dir_path(struct dir_path *dir);
+static size_t build_dir_path(const struct dir_path *dir, char *buf);
+static void print_dir_header(const char *path);
+static size_t hash_dev_ino(uint64_t dev, uint64_t ino);
+static struct visited_entry *find_visited(struct visited_entry *table, size_t size, uint64_t dev, uint64_t ino);
+static bool visit_dir(dev_t dev, ino_t ino);
+static bool is_cycle(const struct dir_path *dir);
+static void *arena_alloc(struct arena *arena, size_t size, size_t align);
+static const char *arena_strdup(struct arena *arena, const char *str, size_t len);
+static void reset_arena(struct arena *arena);
+static void init_info_list(struct info_list *list, int size);
+static void free_info_list(struct info_list *list);
+static void add_info(struct info_list *list, struct info *info);
+static void init_stat_mask(void);
+static void check_statx(void);
+static void statx_to_stat(const struct statx *stx, struct stat *st);
+static int stat_entry(int dirfd, const char *path, int flags, unsigned int mask, struct stat *st);
+static bool need_stat(unsigned char d_type);
+static void set_info_stat(struct info *info, const struct stat *st);
+static void read_link(int dirfd, const char *path, struct info *info, struct arena *links);
+static int fill_info(int dirfd, const char *path, struct info *info, unsigned char d_type, struct arena *links);
+static struct info *alloc_info(struct info_list *list, const char *name);
+static struct info *new_info(int dirfd, const char *path, const char *name, unsigned char d_type, struct info_list *list);
+static void *stat_worker(void *arg);
+static struct stat_pool *new_stat_pool(long threads);
+static struct stat_pool *get_stat_pool(void);
+static void submit_stat_job(struct stat_pool *pool, int dirfd, struct info *info, unsigned char d_type, struct arena *links);
+static void wait_stat_jobs(struct stat_pool *pool);
+static void remove_failed_info(struct info_list *list, const char *path);
+static struct uring *new_uring(void);
+static struct uring *get_uring(void);
+static void submit_uring_statx(struct uring *ring, int index, int dirfd, const char *path, int flags, unsigned int mask);
+static void wait_uring(struct uring *ring, int count);
+static void run_uring_jobs(struct uring *ring, int dirfd, struct arena *links);
+static void add_uring_job(struct uring *ring, int dirfd, struct info *info, struct arena *links);
+static uint64_t name_prefix(const char *name);
+static int compare_key(const struct sort_key *a, const struct sort_key *b, size_t offset);
+static void insertion_sort_keys(struct sort_key *keys, size_t n, size_t offset);
+static void radix_sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n, int shift, size_t offset);
+static void sort_list(struct info_list *list);
+static void print_info(struct info *info);
+static bool parse_regex_literal(const char *pattern, struct name_pattern *p);
+static bool add_name_pattern(struct name_filter *filter, const char *pattern, bool regex);
+static bool match_name(const struct name_pattern *p, const char *name, size_t len);
+static bool match_name_filter(const struct name_filter *filter, const char *name, size_t len);
+static bool is_hidden(const char *name);
+static bool is_excluded(const char *name);
+static void print_list(struct info_list *list, struct dir_path *base, int fd, struct dir_fd **self, struct dir_path **subque, const char *path);
+static void add_entry(struct info_list *list, struct uring *ring, struct stat_pool *pool, int fd, const char *name, unsigned char d_type, const char *path);
+static const char *find_filename(const char *path);
+static bool open_dir_reader(struct dir_reader *reader, int dirfd, const char *path);
+static struct linux_dirent64 *read_dir_entry(struct dir_reader *reader);
+static bool is_batch_end(const struct dir_reader *reader);
+static void close_dir_reader(struct dir_reader *reader);
+static void list_dir(struct dir_path *base);
+static void push_task(struct task_deque *deque, struct dir_task *task);
+static struct dir_task *pop_task(struct task_deque *deque);
+static struct dir_task *steal_task(struct task_deque *deque);
+static struct dir_task *take_task(struct walker *walker);
+static bool remove_task(struct task_deque *deque, struct dir_task *task);
+static long now_ns(void);
+static void add_buffered(long size);
+static void wait_for_space(void);
+static struct dir_task *new_dir_task(struct dir_path *dir, struct dir_task *parent);
+static void run_task(struct walker *walker, struct dir_task *task);
+static void init_walker_stat(void);
+static void *walk_worker(void *arg);
+static bool check_task(struct dir_task *task);
+static void write_task_output(const struct dir_task *task);
+static void emit_tasks(struct dir_task *task);
+static void walk_parallel(struct dir_path *head);
+static bool begin_snapshot(const char *path);
+static uint64_t add_snapshot_string(const char *str);
+static void add_snapshot_dir(const char *path, int depth, int error, const struct stat *st);
+static void add_snapshot_info(const struct info *info);
+static bool finish_snapshot(void);
+static bool open_snapshot(const char *path, struct snapshot *snap);
+static bool check_snapshot_dir(const struct snapshot *snap, const struct snapshot_dir *dir);
+static void view_snapshot_entry(const struct snapshot *snap, const struct snapshot_entry *entry, struct info *info);
+static bool render_snapshot(const struct snapshot *snap);
+static size_t hash_path(const char *path);
+static void index_snapshot(struct snapshot *snap);
+static const struct snapshot_dir *find_cached_dir(const char *path, const struct stat *st);
+static void add_cached_entries(struct info_list *list, const struct snapshot_dir *dir, struct uring *ring, struct stat_pool *pool, int fd, const char *path);
+static size_t join_path(char *buf, const char *dir, const char *name);
+static void normalize_path(char *path);
+static struct watch_dir *find_watch_dir(const char *path);
+static void add_watch_hash(struct watch_dir *dir);
+static void remove_watch_hash(struct watch_dir *dir);
+static bool is_packed(const struct watch_dir *dir, const struct info *info);
+static void pack_watch_entries(struct watch_dir *dir, bool owned);
+static void free_watch_entries(struct watch_dir *dir);
+static struct info *copy_info(const struct info *info);
+static bool load_watch_dir(struct watch_dir *dir);
+static struct watch_dir *new_watch_dir(const char *path, struct watch_dir *parent);
+static bool is_watch_cycle(struct watch_dir *dir);
+static struct watch_dir *add_watch_tree(const char *path, struct watch_dir *parent);
+static void remove_watch_tree(struct watch_dir *dir);
+static void watch_root_parent(struct watch_dir *root);
+static int compare_entry(const struct info *info, bool is_dir, const char *name);
+static int find_entry(const struct watch_dir *dir, bool is_dir, const char *name);
+static const struct info *find_watch_entry(const struct watch_dir *dir, const char *name);
+static void update_entry(struct watch_dir *dir, const char *name);
+static void update_dot_entries(struct watch_dir *dir);
+static void update_links(struct watch_dir *dir);
+static void update_hard_links(const struct watch_dir *dir, const char *name, dev_t dev, ino_t ino);
+static void rebuild_watch(void);
+static void update_notified_entry(struct watch_dir *dir, const char *name);
+static void apply_event(const struct inotify_event *event);
+static void read_events(void);
+static void render_watch_dir(const struct watch_dir *dir, char *path, size_t len, bool top);
+static bool send_all(int fd, const char *buf, size_t len);
+static bool answer_query(int fd, char *path);
+static bool read_queries(struct watch_client *client);
+static void stop_serving(int sig);
+static int serve(struct dir_path *head, const char *path);
+static bool read_full(int fd, void *buf, size_t len);
+static int compare_latency(const void *a, const void *b);
+static int query(struct dir_path *head, const char *path);
+
+/**
+ * 隠しファイルの表示方針
+ */
+static int filter = FILTER_DEFAULT;
+/**
+ * 色付き表示する
+ */
+static bool color = false;
+/**
+ * 分類ごとの色付き表示のエスケープシーケンス
+ */
+static struct color_seq color_table[COLOR_NUM] = {
+  [COLOR_NONE] = COLOR_SEQ(""),
+  [COLOR_FILE] = COLOR_SEQ("\033[0m"),
+  [COLOR_SETUID] = COLOR_SEQ("\033[37;41m"),
+  [COLOR_SETGID] = COLOR_SEQ("\033[30;43m"),
+  [COLOR_EXEC] = COLOR_SEQ("\033[01;32m"),
+  [COLOR_DIR] = COLOR_SEQ("\033[01;34m"),
+  [COLOR_STICKY_OTHER_WRITABLE] = COLOR_SEQ("\033[30;42m"),
+  [COLOR_OTHER_WRITABLE] = COLOR_SEQ("\033[34;42m"),
+  [COLOR_STICKY] = COLOR_SEQ("\033[37;44m"),
+  [COLOR_LINK] = COLOR_SEQ("\033[01;36m"),
+  [COLOR_FIFO] = COLOR_SEQ("\033[33m"),
+  [COLOR_SOCK] = COLOR_SEQ("\033[01;35m"),
+  [COLOR_BLK] = COLOR_SEQ("\033[01;33m"),
+  [COLOR_CHR] = COLOR_SEQ("\033[01;33m"),
+  [COLOR_ORPHAN] = COLOR_SEQ("\033[31m"),
+};
+/**
+ * シンボリックリンクをリンク先の分類で色付けする、LS_COLORSのln=targetで指定する
+ */
+static bool color_link_target = false;
+/**
+ * 色付き表示の終了シーケンス
+ */
+static struct color_seq color_reset = COLOR_SEQ("\033[0m");
+/**
+ * LS_COLORSで指定された拡張子とパターンの色付き表示
+ */
+static struct ext_colors ext_colors;
+/**
+ * 属性を示す文字を表示する
+ */
+static bool classify = false;
+/**
+ * ロングフォーマットで表示する
+ */
+static bool long_format = false;
+/**
+ * 半年前のUNIX時間
+ */
+static time_t half_year_ago;
+/**
+ * 時刻表示文字列のキャッシュ
+ */
+static _Thread_local struct time_cache time_cache;
+/**
+ * 再帰的な表示
+ */
+static bool recursive = false;
+/**
+ * ソートせず読み出した順に逐次表示する
+ */
+static bool unsorted = false;
+/**
+ * getdents64の読み出しバッファ
+ */
+static _Thread_local char *dirent_buf = NULL;
+/**
+ * getdents64の読み出しバッファのサイズ
+ */
+static size_t dirent_buf_size = DIRENT_BUF_DEFAULT;
+/**
+ * エントリ自身について取得する情報のstatxマスク
+ */
+static unsigned int stat_mask = STATX_TYPE;
+/**
+ * シンボリックリンクのリンク先について取得する情報のstatxマスク
+ * 0の場合はリンク先を調べない
+ */
+static unsigned int link_stat_mask = 0;
+/**
+ * リンク先文字列を読み出す
+ */
+static bool need_link = false;
+/**
+ * statxが使えない環境ではfstatatを使う
+ */
+static bool statx_unsupported = false;
+/**
+ * 情報取得のスレッド数、1以下の場合はメインスレッドで行う
+ */
+static long stat_threads = 0;
+/**
+ * 情報取得を行うワーカースレッド
+ */
+static struct stat_pool *stat_pool = NULL;
+/**
+ * io_uringによる情報取得を行う
+ */
+static bool use_uring = false;
+/**
+ * io_uringのリング、使えない場合はNULL
+ */
+static struct uring *uring = NULL;
+/**
+ * 並列な再帰表示のワーカーごとのio_uringのリング、使わない場合はNULL
+ */
+static _Thread_local struct uring *walker_uring = NULL;
+/**
+ * 並列な再帰表示のワーカーごとの情報取得のスレッド、使わない場合はNULL
+ */
+static _Thread_local struct stat_pool *walker_pool = NULL;
+/**
+ * リンク先の格納はワーカースレッドからも行うため排他する
+ */
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * 1ディレクトリ分のエントリ情報構造体と名前を格納するアリーナ
+ */
+static _Thread_local struct arena entry_arena;
+/**
+ * 1ディレクトリ分のリンク先を格納するアリーナ
+ */
+static _Thread_local struct arena link_arena;
+/**
+ * 統計情報を表示する
+ */
+static bool show_stats = false;
+/**
+ * uidからユーザ名へのキャッシュ
+ */
+static _Thread_local struct id_cache user_cache;
+/**
+ * gidからグループ名へのキャッシュ
+ */
+static _Thread_local struct id_cache group_cache;
+/**
+ * getpwuid/getgrgidの呼び出しを保護する
+ */
+static pthread_mutex_t id_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * 標準出力への出力バッファ
+ */
+static _Thread_local struct out_buf out;
+/**
+ * 出力バッファのサイズ
+ */
+static size_t out_buf_size = OUT_BUF_DEFAULT;
+/**
+ * 標準出力が端末の場合はディレクトリごとに出力する
+ */
+static bool out_interactive = false;
+/**
+ * 出力を書き出さずにバッファへ溜める
+ * 並列な再帰表示のワーカーで使用する
+ */
+static _Thread_local bool out_capture = false;
+/**
+ * 並列な再帰表示のワーカーで、表示順に出力するまで溜めるエラーメッセージ
+ */
+static _Thread_local struct out_buf err_out;
+/**
+ * 再帰的な表示のスレッド数、1以下の場合はメインスレッドで行う
+ */
+static long walk_threads = 0;
+/**
+ * 並列な再帰表示で出力待ちにできるメモリ量
+ */
+static size_t walk_buffer_size = WALK_BUFFER_DEFAULT;
+/**
+ * 並列な再帰表示の状態
+ */
+static struct walk walk;
+/**
+ * 再帰的な表示で表示済みのディレクトリ
+ */
+static struct visited_set visited;
+/**
+ * スナップショットファイルの保存先
+ */
+static const char *save_snapshot_path = NULL;
+/**
+ * 表示するスナップショットファイル
+ */
+static const char *load_snapshot_path = NULL;
+/**
+ * 作成中のスナップショットファイル、保存しない場合はNULL
+ */
+static struct snapshot_writer *snapshot_out = NULL;
+/**
+ * 再利用するスナップショットファイル
+ */
+static const char *incremental_path = NULL;
+/**
+ * 再利用するスナップショットファイル、再利用しない場合はNULL
+ */
+static struct snapshot *snapshot_in = NULL;
+/**
+ * 再利用するエントリの情報を取得し直さない
+ */
+static bool trust_snapshot = false;
+/**
+ * スナップショットファイルの内容を再利用したディレクトリ数
+ */
+static unsigned long snapshot_hits = 0;
+/**
+ * スナップショットファイルの内容を再利用できなかったディレクトリ数
+ */
+static unsigned long snapshot_misses = 0;
+/**
+ * 常駐して一覧を提供するUNIXソケットのパス
+ */
+static const char *serve_path = NULL;
+/**
+ * 一覧を問い合わせるUNIXソケットのパス
+ */
+static const char *query_path = NULL;
+/**
+ * 問い合わせの繰り返し回数、2以上の場合は応答を表示せず性能を測定する
+ */
+static long query_count = 1;
+/**
+ * 常駐して監視しているディレクトリ
+ */
+static struct watch_table watch;
+/**
+ * シグナルを受けて常駐を終了する
+ */
+static volatile sig_atomic_t serve_stopped = 0;
+/**
+ * 表示する名前のパターン、指定がない場合はすべて表示する
+ */
+static struct name_filter include_filter;
+/**
+ * 表示しない名前のパターン
+ */
+static struct name_filter exclude_filter;
+/**
+ * パターンで除外して情報を取得しなかったエントリ数
+ */
+static unsigned long name_filter_skips = 0;
+
+/**
+ * @brief malloc結果がNULLだった場合にexitする。
+ * @param[IN] size 確保サイズ
+ * @retrun 確保された領域へのポインタ
+ */
+static void *xmalloc(size_t n) {
+  void *p = malloc(n);
+  if (p == NULL) {
+    perror("");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * @brief realloc結果がNULLだった場合にexitする。
+ * @param[IN] ptr 拡張する領域ポインタ
+ * @param[IN] size 確保サイズ
+ * @retrun 確保された領域へのポインタ
+ */
+static void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (p == NULL) {
+    perror("");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * @brief サイズ指定文字列をパースする
+ * 末尾にK/Mを付けた場合はKiB/MiB単位とする
+ *
+ * @param[IN] str 文字列
+ * @param[OUT] size サイズの格納先
+ * @return 成功した場合true
+ */
+static bool parse_size(const char *str, size_t *size) {
+  char *end;
+  unsigned long value = strtoul(str, &end, 10);
+  if (end == str) {
+    return false;
+  }
+  if (*end == 'K' || *end == 'k') {
+    value *= 1024;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    value *= 1024 * 1024;
+    end++;
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  *size = value;
+  return true;
+}
+
+/**
+ * @brief 標準出力へすべて書き出す
+ * 書き出せなかった場合はexitする。
+ *
+ * @param[IN] buf 出力する内容
+ * @param[IN] len 長さ
+ */
+static void write_all(const char *buf, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    ssize_t n = write(STDOUT_FILENO, buf + pos, len - pos);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    pos += n;
+  }
+}
+
+/**
+ * @brief 出力バッファの内容を標準出力へ書き出す
+ */
+static void out_flush(void) {
+  write_all(out.buf, out.used);
+  out.used = 0;
+}
+
+/**
+ * @brief エラーメッセージを出力する前に出力バッファを書き出す
+ * 標準出力が端末の場合、見出しなど先に表示した内容がエラーメッセージより後に表示されないようにする。
+ * 出力を溜めている場合は書き出さない。
+ */
+static void flush_before_error(void) {
+  if (out_interactive && !out_capture) {
+    out_flush();
+  }
+}
+
+/**
+ * @brief 出力を溜めるバッファを拡張する
+ * 確保した量は並列な再帰表示の出力待ちのメモリ量に計上する
+ * @param[IN] len 追加で必要な長さ
+ */
+static void out_grow(size_t len) {
+  size_t size = out.size != 0 ? out.size : OUT_BUF_MIN;
+  while (size - out.used < len) {
+    size *= 2;
+  }
+  out.buf = xrealloc(out.buf, size);
+  add_buffered(size - out.size);
+  out.size = size;
+}
+
+/**
+ * @brief 出力バッファへ追記する
+ * 空きが足りない場合は書き出してから追記する。
+ * バッファより大きい場合は直接書き出す。
+ *
+ * @param[IN] str 出力する内容
+ * @param[IN] len 長さ
+ */
+static void out_write(const char *str, size_t len) {
+  if (out.size - out.used < len) {
+    if (out_capture) {
+      out_grow(len);
+    } else {
+      if (out.buf == NULL) {
+        out.buf = xmalloc(out_buf_size);
+        out.size = out_buf_size;
+      }
+      out_flush();
+    }
+    if (len > out.size - out.used) {
+      write_all(str, len);
+      return;
+    }
+  }
+  memcpy(out.buf + out.used, str, len);
+  out.used += len;
+}
+
+/**
+ * @brief 出力バッファへ1文字追記する
+ * @param[IN] c 出力する文字
+ */
+static void out_putc(char c) {
+  if (out.used == out.size) {
+    out_write(&c, 1);
+    return;
+  }
+  out.buf[out.used] = c;
+  out.used++;
+}
+
+/**
+ * @brief 出力バッファへ文字列を追記する
+ * @param[IN] str 出力する文字列
+ */
+static void out_puts(const char *str) {
+  out_write(str, strlen(str));
+}
+
+/**
+ * @brief 出力バッファへ書式付きで追記する
+ * @param[IN] format 書式
+ */
+static void out_printf(const char *format, ...) {
+  char buf[PATH_MAX + 64];
+  va_list ap;
+  int len;
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len >= sizeof(buf)) {
+    char *large = xmalloc(len + 1);
+    va_start(ap, format);
+    vsnprintf(large, len + 1, format, ap);
+    va_end(ap);
+    out_write(large, len);
+    free(large);
+    return;
+  }
+  out_write(buf, len);
+}
+
+/**
+ * @brief エラーメッセージを標準エラー出力へ出力する
+ * 並列な再帰表示のワーカーでは、逐次処理と同じ順序で出力できるようタスクごとに溜める。
+ * 常駐時も出力を溜めるが、エラーメッセージはそのまま出力する。
+ *
+ * @param[IN] format 書式
+ */
+static void print_error(const char *format, ...) {
+  char buf[PATH_MAX + 64];
+  va_list ap;
+  size_t need;
+  int len;
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len >= sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+  if (!out_capture || walk.num == 0) {
+    flush_before_error();
+    fputs(buf, stderr);
+    return;
+  }
+  /* 出力する側で表示内容の間へ挟めるよう、その時点の表示内容の長さを前に付ける */
+  need = sizeof(size_t) + len + 1;
+  if (err_out.size - err_out.used < need) {
+    size_t size = err_out.size != 0 ? err_out.size : 256;
+    while (size - err_out.used < need) {
+      size *= 2;
+    }
+    err_out.buf = xrealloc(err_out.buf, size);
+    err_out.size = size;
+  }
+  memcpy(err_out.buf + err_out.used, &out.used, sizeof(size_t));
+  memcpy(err_out.buf + err_out.used + sizeof(size_t), buf, len + 1);
+  err_out.used += need;
+}
+
+/**
+ * @brief 出力バッファに指定長の空きを確保する
+ * 確保した領域は出力済みとして扱うため、呼び出し側ですべて書き込むこと。
+ *
+ * @param[IN] len 確保する長さ、出力バッファのサイズ以下
+ * @return 書き込み先
+ */
+static char *out_reserve(size_t len) {
+  char *p;
+  if (out_capture) {
+    if (out.size - out.used < len) {
+      out_grow(len);
+    }
+  } else if (out.size - out.used < len) {
+    if (out.buf == NULL) {
+      out.buf = xmalloc(out_buf_size);
+      out.size = out_buf_size;
+    }
+    out_flush();
+  }
+  p = out.buf + out.used;
+  out.used += len;
+  return p;
+}
+
+/**
+ * @brief 10進数の桁数を数える
+ * @param[IN] value 値
+ * @return 桁数
+ */
+static int count_digits(unsigned long value) {
+  int digits = 1;
+  while (value >= 10000) {
+    value /= 10000;
+    digits += 4;
+  }
+  if (value >= 1000) {
+    return digits + 3;
+  }
+  if (value >= 100) {
+    return digits + 2;
+  }
+  if (value >= 10) {
+    return digits + 1;
+  }
+  return digits;
+}
+
+/**
+ * @brief 整数を右詰めで出力バッファへ書き込む
+ * printf("%*ld")と同じ出力を、書式の解釈なしに2桁ずつの表引きで作る。
+ * 桁数が幅を超える場合は幅を無視してすべての桁を書き込む。
+ *
+ * @param[IN] value 値
+ * @param[IN] width 幅
+ */
+static void out_int(long value, int width) {
+  static const char digit_pairs[] =
+      "00010203040506070809"
+      "10111213141516171819"
+      "20212223242526272829"
+      "30313233343536373839"
+      "40414243444546474849"
+      "50515253545556575859"
+      "60616263646566676869"
+      "70717273747576777879"
+      "80818283848586878889"
+      "90919293949596979899";
+  unsigned long abs = value < 0 ? -(unsigned long)value : (unsigned long)value;
+  int len = count_digits(abs) + (value < 0);
+  int total = len > width ? len : width;
+  char *p = out_reserve(total);
+  char *end = p + total;
+  memset(p, ' ', total - len);
+  while (abs >= 100) {
+    const char *pair = &digit_pairs[(abs % 100) * 2];
+    abs /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (abs >= 10) {
+    const char *pair = &digit_pairs[abs * 2];
+    *--end = pair[1];
+    *--end = pair[0];
+  } else {
+    *--end = '0' + abs;
+  }
+  if (value < 0) {
+    *--end = '-';
+  }
+}
+
+/**
+ * @brief 文字列を右詰めで出力バッファへ書き込む
+ * @param[IN] str 文字列
+ * @param[IN] width 幅
+ */
+static void out_str_right(const char *str, int width) {
+  int len = strlen(str);
+  if (len < width) {
+    memset(out_reserve(width - len), ' ', width - len);
+  }
+  out_write(str, len);
+}
+
+/**
+ * @brief コマンドライン引数をパースする
+ * @param[IN] argc 引数の数
+ * @param[IN/OUT] argv 引数配列
+ * @return パス
+ */
+static struct dir_path *parse_cmd_args(int argc, char**argv) {
+  int opt;
+  const struct option longopts[] = {
+      { "all", no_argument, NULL, 'a' },
+      { "almost-all", no_argument, NULL, 'A' },
+      { "color", no_argument, NULL, 'C' },
+      { "classify", no_argument, NULL, 'F' },
+      { "long-format", no_argument, NULL, 'l' },
+      { "recursive", no_argument, NULL, 'R' },
+      { "unsorted", no_argument, NULL, 'U' },
+      { "buffer-size", required_argument, NULL, OPT_BUFFER_SIZE },
+      { "threads", required_argument, NULL, OPT_THREADS },
+      { "io-uring", no_argument, NULL, OPT_IO_URING },
+      { "stats", no_argument, NULL, OPT_STATS },
+      { "output-buffer", required_argument, NULL, OPT_OUTPUT_BUFFER },
+      { "walkers", required_argument, NULL, OPT_WALKERS },
+      { "walk-buffer", required_argument, NULL, OPT_WALK_BUFFER },
+      { "save-snapshot", required_argument, NULL, OPT_SAVE_SNAPSHOT },
+      { "load-snapshot", required_argument, NULL, OPT_LOAD_SNAPSHOT },
+      { "incremental", required_argument, NULL, OPT_INCREMENTAL },
+      { "trust-snapshot", no_argument, NULL, OPT_TRUST_SNAPSHOT },
+      { "serve", required_argument, NULL, OPT_SERVE },
+      { "query", required_argument, NULL, OPT_QUERY },
+      { "query-count", required_argument, NULL, OPT_QUERY_COUNT },
+      { "include", required_argument, NULL, OPT_INCLUDE },
+      { "exclude", required_argument, NULL, OPT_EXCLUDE },
+      { "include-regex", required_argument, NULL, OPT_INCLUDE_REGEX },
+      { "exclude-regex", required_argument, NULL, OPT_EXCLUDE_REGEX },
+      { 0, 0, 0, 0 },
+  };
+  while ((opt = getopt_long(argc, argv, "aACfFlRU", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        filter = FILTER_ALL;
+        break;
+      case 'A':
+        filter = FILTER_ALMOST;
+        break;
+      case 'C':
+        if (isatty(STDOUT_FILENO)) {
+          color = true;
+        }
+        break;
+      case 'F':
+        classify = true;
+        break;
+      case 'l':
+        long_format = true;
+        half_year_ago = time(NULL) - HALF_YEAR_SECOND;
+        tzset();
+        break;
+      case 'R':
+        recursive = true;
+        break;
+      case 'U':
+        unsorted = true;
+        break;
+      case 'f':
+        filter = FILTER_ALL;
+        unsorted = true;
+        break;
+      case OPT_BUFFER_SIZE:
+        if (!parse_size(optarg, &dirent_buf_size)
+            || dirent_buf_size < DIRENT_BUF_MIN
+            || dirent_buf_size > DIRENT_BUF_MAX) {
+          fprintf(stderr, "invalid buffer size: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      case OPT_THREADS: {
+        char *end;
+        stat_threads = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || stat_threads < 1) {
+          fprintf(stderr, "invalid number of threads: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      }
+      case OPT_IO_URING:
+        use_uring = true;
+        break;
+      case OPT_STATS:
+        show_stats = true;
+        break;
+      case OPT_OUTPUT_BUFFER:
+        if (!parse_size(optarg, &out_buf_size)
+            || out_buf_size < OUT_BUF_MIN
+            || out_buf_size > OUT_BUF_MAX) {
+          fprintf(stderr, "invalid output buffer size: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      case OPT_WALKERS: {
+        char *end;
+        walk_threads = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || walk_threads < 1) {
+          fprintf(stderr, "invalid number of walkers: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      }
+      case OPT_WALK_BUFFER:
+        if (!parse_size(optarg, &walk_buffer_size) || walk_buffer_size == 0) {
+          fprintf(stderr, "invalid walk buffer size: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      case OPT_SAVE_SNAPSHOT:
+        save_snapshot_path = optarg;
+        break;
+      case OPT_LOAD_SNAPSHOT:
+        load_snapshot_path = optarg;
+        break;
+      case OPT_INCREMENTAL:
+        incremental_path = optarg;
+        break;
+      case OPT_TRUST_SNAPSHOT:
+        trust_snapshot = true;
+        break;
+      case OPT_SERVE:
+        serve_path = optarg;
+        break;
+      case OPT_QUERY:
+        query_path = optarg;
+        break;
+      case OPT_QUERY_COUNT: {
+        char *end;
+        query_count = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || query_count < 1) {
+          fprintf(stderr, "invalid query count: %s\n", optarg);
+          return NULL;
+        }
+        break;
+      }
+      case OPT_INCLUDE:
+      case OPT_EXCLUDE:
+      case OPT_INCLUDE_REGEX:
+      case OPT_EXCLUDE_REGEX:
+        if (!add_name_pattern((opt == OPT_INCLUDE || opt == OPT_INCLUDE_REGEX) ? &include_filter : &exclude_filter,
+                              optarg, opt == OPT_INCLUDE_REGEX || opt == OPT_EXCLUDE_REGEX)) {
+          return NULL;
+        }
+        break;
+      default:
+        return NULL;
+    }
+  }
+  if (load_snapshot_path != NULL
+      && (save_snapshot_path != NULL || incremental_path != NULL || argc > optind)) {
+    fprintf(stderr, "--load-snapshot cannot be used with paths, --save-snapshot or --incremental\n");
+    return NULL;
+  }
+  if ((serve_path != NULL || query_path != NULL)
+      && (serve_path != NULL) + (query_path != NULL) + (load_snapshot_path != NULL)
+         + (save_snapshot_path != NULL) + (incremental_path != NULL) != 1) {
+    fprintf(stderr, "--serve and --query cannot be used with each other or with snapshots\n");
+    return NULL;
+  }
+  if ((include_filter.num != 0 || exclude_filter.num != 0)
+      && (save_snapshot_path != NULL || load_snapshot_path != NULL || query_path != NULL)) {
+    /* 再利用時に絞り込めるよう、スナップショットファイルにはすべてのエントリを記録する */
+    fprintf(stderr, "--include and --exclude cannot be used with --save-snapshot, --load-snapshot or --query\n");
+    return NULL;
+  }
+  if (color) {
+    parse_ls_colors(getenv("LS_COLORS"));
+  }
+  init_stat_mask();
+  check_statx();
+  if (stat_threads == 0) {
+    stat_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (walk_threads == 0) {
+    walk_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (argc <= optind) {
+    return new_dir_path("./", NULL, NULL, 0, NULL);
+  } else {
+    struct dir_path *head;
+    struct dir_path **work = &head;
+    int i;
+    for (i = optind; i < argc; i++) {
+      *work = new_dir_path(argv[i], NULL, NULL, 0, NULL);
+      work = &(*work)->next;
+    }
+    return head;
+  }
+}
+
+/**
+ * @brief モード文字列を作成する
+ * 種別はS_IFMTのビットをインデックスとする表から、
+ * パーミッションは8進数1桁と特殊ビットをインデックスとする3文字の表から引く。
+ * @param[IN]  mode モードパラメータ
+ * @param[OUT] str  文字列の出力先、11バイト以上のバッファを指定
+ */
+static void get_mode_string(mode_t mode, char *str) {
+  static const char type_chars[16] = {
+      '?', 'p', 'c', '?', 'd', '?', 'b', '?',
+      '-', '?', 'l', '?', 's', '?', '?', '?',
+  };
+  /* [0]はsetuid/setgid、[1]はスティッキービット、インデックスは特殊ビット<<3|rwx */
+  static const char triplets[2][16][4] = {
+      {
+          "---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx",
+          "--S", "--s", "-wS", "-ws", "r-S", "r-s", "rwS", "rws",
+      }, {
+          "---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx",
+          "--T", "--t", "-wT", "-wt", "r-T", "r-t", "rwT", "rwt",
+      },
+  };
+  str[0] = type_chars[(mode & S_IFMT) >> 12];
+  memcpy(str + 1, triplets[0][(mode >> 8 & 010) | (mode >> 6 & 07)], 3);
+  memcpy(str + 4, triplets[0][(mode >> 7 & 010) | (mode >> 3 & 07)], 3);
+  memcpy(str + 7, triplets[1][(mode >> 6 & 010) | (mode & 07)], 3);
+  str[10] = '\0';
+}
+
+/**
+ * @brief ファイルタイプ別のインジケータを出力する
+ * @param[IN] mode モードパラメータ
+ */
+static void print_type_indicator(mode_t mode) {
+  if (S_ISREG(mode)) {
+    if (mode & S_IXUGO) {
+      out_putc('*');
+    }
+  } else {
+    if (S_ISDIR(mode)) {
+      out_putc('/');
+    } else if (S_ISLNK(mode)) {
+      out_putc('@');
+    } else if (S_ISFIFO(mode)) {
+      out_putc('|');
+    } else if (S_ISSOCK(mode)) {
+      out_putc('=');
+    }
+  }
+}
+
+/**
+ * @brief uidからユーザ名を取得する
+ * @param[IN] uid ユーザID
+ * @return ユーザ名の複製、見つからない場合NULL
+ */
+static char *resolve_user(unsigned int uid) {
+  pthread_mutex_lock(&id_mutex);
+  struct passwd *passwd = getpwuid(uid);
+  char *name = passwd != NULL ? strdup(passwd->pw_name) : NULL;
+  pthread_mutex_unlock(&id_mutex);
+  return name;
+}
+
+/**
+ * @brief gidからグループ名を取得する
+ * @param[IN] gid グループID
+ * @return グループ名の複製、見つからない場合NULL
+ */
+static char *resolve_group(unsigned int gid) {
+  pthread_mutex_lock(&id_mutex);
+  struct group *group = getgrgid(gid);
+  char *name = group != NULL ? strdup(group->gr_name) : NULL;
+  pthread_mutex_unlock(&id_mutex);
+  return name;
+}
+
+/**
+ * @brief ハッシュテーブルからidの格納位置を探す
+ * @param[IN] table ハッシュテーブル
+ * @param[IN] size テーブルサイズ、2の累乗
+ * @param[IN] id 探すid
+ * @return idが格納されている位置、なければ格納すべき空き位置
+ */
+static struct id_entry *find_id_entry(struct id_entry *table, size_t size, unsigned int id) {
+  size_t mask = size - 1;
+  size_t i = (id * 2654435761u) & mask;
+  while (table[i].used && table[i].id != id) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+/**
+ * @brief キャッシュを通してidから名前を引く
+ * キャッシュにない場合のみresolveを呼び出し、見つからなかった結果も記録する。
+ * 使用率が半分を超えた場合はテーブルを倍に拡張する。
+ *
+ * @param[IN/OUT] cache キャッシュ
+ * @param[IN] id 引くid
+ * @param[IN] resolve 名前を取得する関数
+ * @return 名前、見つからない場合NULL
+ */
+static const char *lookup_id(struct id_cache *cache, unsigned int id, char *(*resolve)(unsigned int)) {
+  struct id_entry *entry;
+  if (cache->table == NULL) {
+    cache->size = ID_CACHE_INITIAL_SIZE;
+    cache->table = xmalloc(sizeof(struct id_entry) * cache->size);
+    memset(cache->table, 0, sizeof(struct id_entry) * cache->size);
+  }
+  entry = find_id_entry(cache->table, cache->size, id);
+  if (entry->used) {
+    cache->hits++;
+    return entry->name;
+  }
+  cache->misses++;
+  if ((cache->used + 1) * 2 > cache->size) {
+    size_t i;
+    size_t size = cache->size * 2;
+    struct id_entry *table = xmalloc(sizeof(struct id_entry) * size);
+    memset(table, 0, sizeof(struct id_entry) * size);
+    for (i = 0; i < cache->size; i++) {
+      if (cache->table[i].used) {
+        *find_id_entry(table, size, cache->table[i].id) = cache->table[i];
+      }
+    }
+    free(cache->table);
+    cache->table = table;
+    cache->size = size;
+    entry = find_id_entry(table, size, id);
+  }
+  entry->id = id;
+  entry->used = true;
+  entry->name = resolve(id);
+  cache->used++;
+  return entry->name;
+}
+
+/**
+ * @brief ユーザ名を表示する
+ * @param[IN] uid ユーザID
+ */
+static void print_user(uid_t uid) {
+  const char *name = lookup_id(&user_cache, uid, resolve_user);
+  if (name != NULL) {
+    out_str_right(name, 8);
+  } else {
+    out_int((int)uid, 8);
+  }
+  out_putc(' ');
+}
+
+/**
+ * @brief グループ名を表示する
+ * @param[IN] gid グループID
+ */
+static void print_group(gid_t gid) {
+  const char *name = lookup_id(&group_cache, gid, resolve_group);
+  if (name != NULL) {
+    out_str_right(name, 8);
+  } else {
+    out_int((int)gid, 8);
+  }
+  out_putc(' ');
+}
+
+/**
+ * @brief 統計情報を標準エラーへ表示する
+ */
+static void print_stats(void) {
+  unsigned long user_hits = user_cache.hits;
+  unsigned long user_misses = user_cache.misses;
+  unsigned long group_hits = group_cache.hits;
+  unsigned long group_misses = group_cache.misses;
+  unsigned long tasks = 0;
+  unsigned long steals = 0;
+  int i;
+  for (i = 0; i < walk.num + (walk.num != 0); i++) {
+    struct walker *walker = &walk.walkers[i];
+    user_hits += walker->user_cache.hits;
+    user_misses += walker->user_cache.misses;
+    group_hits += walker->group_cache.hits;
+    group_misses += walker->group_cache.misses;
+    tasks += walker->tasks;
+    steals += walker->steals;
+  }
+  fprintf(stderr, "user cache: %lu hits, %lu misses\n", user_hits, user_misses);
+  fprintf(stderr, "group cache: %lu hits, %lu misses\n", group_hits, group_misses);
+  if (snapshot_in != NULL) {
+    fprintf(stderr, "snapshot: %lu directories reused, %lu read\n",
+            snapshot_hits, snapshot_misses);
+  }
+  if (serve_path != NULL) {
+    fprintf(stderr, "watch: %zu directories, %lu events, %lu queries\n",
+            watch.count, watch.events, watch.queries);
+  }
+  if (include_filter.num != 0 || exclude_filter.num != 0) {
+    fprintf(stderr, "name filter: %lu entries skipped\n", name_filter_skips);
+  }
+  if (walk.num != 0) {
+    fprintf(stderr, "walkers: %d threads, %lu directories, %lu steals\n",
+            walk.num, tasks, steals);
+    fprintf(stderr, "walk buffer: %zu bytes high-water, %zu bytes limit\n",
+            walk.buffered_max, walk_buffer_size);
+    fprintf(stderr, "walk stall: workers %.3f s, output %.3f s\n",
+            walk.stall_ns / 1e9, walk.emit_wait_ns / 1e9);
+  }
+}
+
+/**
+ * @brief 時刻表示文字列のキャッシュを指定時刻を含む日に更新する
+ * 日の始まりと終わりでUTCからのオフセットと日付が変わらないことを確認し、
+ * 夏時間の切り替えを含む日はキャッシュしない。
+ * タイムゾーンはオプション解析時にtzset()で一度だけ読み込み、
+ * 以降はlocaltime_r()で変換する。
+ *
+ * @param[IN] time 対象のUNIX時間
+ * @retval true  キャッシュした
+ * @retval false キャッシュできない
+ */
+static bool update_time_cache(time_t time) {
+  struct time_cache *cache = &time_cache;
+  struct tm tm;
+  struct tm start;
+  struct tm end;
+  cache->day_start = cache->day_end = 0;
+  if (localtime_r(&time, &tm) == NULL) {
+    return false;
+  }
+  time_t day_start = time - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+  time_t day_end = day_start + 24 * 3600;
+  time_t last = day_end - 1;
+  if (localtime_r(&day_start, &start) == NULL
+      || localtime_r(&last, &end) == NULL) {
+    return false;
+  }
+  if (start.tm_gmtoff != tm.tm_gmtoff || end.tm_gmtoff != tm.tm_gmtoff
+      || start.tm_mday != tm.tm_mday || end.tm_mday != tm.tm_mday
+      || start.tm_hour != 0 || start.tm_min != 0 || start.tm_sec != 0) {
+    return false;
+  }
+  if (strftime(cache->date, sizeof(cache->date), "%m/%d", &tm) != 5
+      || strftime(cache->old, sizeof(cache->old), "%m/%d  %Y", &tm) == 0) {
+    return false;
+  }
+  cache->day_start = day_start;
+  cache->day_end = day_end;
+  cache->minute = day_start - 60;
+  return true;
+}
+
+/**
+ * @brief 時刻表示文字列を作成する
+ * 半年以上前の場合は月-日 年
+ * 半年以内の場合は月-日 時:分
+ *
+ * @param[OUT] str  格納先、12byte以上のバッファを指定
+ * @param[IN]  time 文字列を作成するUNIX時間
+ */
+static void get_time_string(char *str, time_t time) {
+  struct time_cache *cache = &time_cache;
+  if (time < cache->day_start || time >= cache->day_end) {
+    if (!update_time_cache(time)) {
+      struct tm tm;
+      if (localtime_r(&time, &tm) == NULL) {
+        str[0] = '\0';
+      } else if (time - half_year_ago > 0) {
+        strftime(str, 12, "%m/%d %H:%M", &tm);
+      } else {
+        strftime(str, 12, "%m/%d  %Y", &tm);
+      }
+      return;
+    }
+  }
+  if (time - half_year_ago > 0) {
+    if (time < cache->minute || time >= cache->minute + 60) {
+      long sec = time - cache->day_start;
+      int hour = sec / 3600;
+      int min = sec / 60 % 60;
+      char *p = cache->recent;
+      memcpy(p, cache->date, 5);
+      p[5] = ' ';
+      p[6] = '0' + hour / 10;
+      p[7] = '0' + hour % 10;
+      p[8] = ':';
+      p[9] = '0' + min / 10;
+      p[10] = '0' + min % 10;
+      p[11] = '\0';
+      cache->minute = time - sec % 60;
+    }
+    memcpy(str, cache->recent, 12);
+  } else {
+    memcpy(str, cache->old, 12);
+  }
+}
+
+/**
+ * @brief LS_COLORSの値からエスケープシーケンスを作成する
+ * 値はSGRのパラメータとして"\033["と"m"で囲む。空の場合は何も出力しない。
+ *
+ * @param[IN]  value 値
+ * @param[IN]  len   値の長さ
+ * @param[OUT] seq   作成したエスケープシーケンス
+ * @return 値が不正な場合false
+ */
+static bool make_color_seq(const char *value, size_t len, struct color_seq *seq) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if ((value[i] < '0' || value[i] > '9') && value[i] != ';') {
+      return false;
+    }
+  }
+  if (len == 0) {
+    seq->seq = "";
+    seq->len = 0;
+    return true;
+  }
+  char *str = xmalloc(len + 4);
+  memcpy(str, "\033[", 2);
+  memcpy(str + 2, value, len);
+  str[len + 2] = 'm';
+  str[len + 3] = '\0';
+  seq->seq = str;
+  seq->len = len + 3;
+  return true;
+}
+
+/**
+ * @brief LS_COLORSの種別コードから色付き表示の分類を求める
+ *
+ * @param[IN] code 種別コード
+ * @param[IN] len  種別コードの長さ
+ * @return 分類、対応しないコードの場合-1
+ */
+static int find_color_code(const char *code, size_t len) {
+  static const struct {
+    char code[3];
+    int color;
+  } codes[] = {
+      { "fi", COLOR_FILE },
+      { "su", COLOR_SETUID },
+      { "sg", COLOR_SETGID },
+      { "ex", COLOR_EXEC },
+      { "di", COLOR_DIR },
+      { "tw", COLOR_STICKY_OTHER_WRITABLE },
+      { "ow", COLOR_OTHER_WRITABLE },
+      { "st", COLOR_STICKY },
+      { "ln", COLOR_LINK },
+      { "pi", COLOR_FIFO },
+      { "so", COLOR_SOCK },
+      { "bd", COLOR_BLK },
+      { "cd", COLOR_CHR },
+      { "or", COLOR_ORPHAN },
+  };
+  size_t i;
+  if (len != 2) {
+    return -1;
+  }
+  for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+    if (code[0] == codes[i].code[0] && code[1] == codes[i].code[1]) {
+      return codes[i].color;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief 拡張子のハッシュ値を求める
+ * 大文字小文字を区別しない
+ *
+ * @param[IN] ext 拡張子
+ * @param[IN] len 拡張子の長さ
+ * @return ハッシュ値
+ */
+static size_t hash_ext(const char *ext, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char c = ext[i];
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    hash = (hash ^ c) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief 拡張子のハッシュテーブルから対応するスロットを探す
+ * 見つからなかった場合は空きスロットを返す
+ *
+ * @param[IN] table テーブル
+ * @param[IN] size  テーブルのサイズ、2のべき乗
+ * @param[IN] ext   小文字の拡張子
+ * @param[IN] len   拡張子の長さ
+ * @return スロット
+ */
+static struct ext_color *find_ext_entry(struct ext_color *table, size_t size, const char *ext, size_t len) {
+  size_t mask = size - 1;
+  size_t i = hash_ext(ext, len) & mask;
+  while (table[i].ext != NULL
+      && (table[i].len != len || memcmp(table[i].ext, ext, len) != 0)) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+/**
+ * @brief 拡張子の色付き表示を登録する
+ * 既に登録されている場合は上書きする
+ *
+ * @param[IN] ext   拡張子
+ * @param[IN] len   拡張子の長さ
+ * @param[IN] seq   エスケープシーケンス
+ * @param[IN] order LS_COLORS内での順序
+ */
+static void add_ext_color(const char *ext, size_t len, const struct color_seq *seq, int order) {
+  struct ext_colors *colors = &ext_colors;
+  char lower[EXT_COLOR_MAX_LEN];
+  size_t i;
+  for (i = 0; i < len; i++) {
+    lower[i] = (ext[i] >= 'A' && ext[i] <= 'Z') ? ext[i] + 'a' - 'A' : ext[i];
+  }
+  if (colors->table == NULL) {
+    colors->size = EXT_COLOR_INITIAL_SIZE;
+    colors->table = xmalloc(sizeof(struct ext_color) * colors->size);
+    memset(colors->table, 0, sizeof(struct ext_color) * colors->size);
+  }
+  struct ext_color *entry = find_ext_entry(colors->table, colors->size, lower, len);
+  if (entry->ext == NULL) {
+    if ((colors->used + 1) * 2 > colors->size) {
+      size_t size = colors->size * 2;
+      struct ext_color *table = xmalloc(sizeof(struct ext_color) * size);
+      memset(table, 0, sizeof(struct ext_color) * size);
+      for (i = 0; i < colors->size; i++) {
+        if (colors->table[i].ext != NULL) {
+          struct ext_color *e = &colors->table[i];
+          *find_ext_entry(table, size, e->ext, e->len) = *e;
+        }
+      }
+      free(colors->table);
+      colors->table = table;
+      colors->size = size;
+      entry = find_ext_entry(table, size, lower, len);
+    }
+    entry->ext = xmalloc(len);
+    memcpy(entry->ext, lower, len);
+    entry->len = len;
+    colors->used++;
+    if (len > colors->max_len) {
+      colors->max_len = len;
+    }
+  }
+  entry->seq = *seq;
+  entry->order = order;
+}
+
+/**
+ * @brief 拡張子以外のパターンの色付き表示を登録する
+ *
+ * @param[IN] pattern パターン
+ * @param[IN] len     パターンの長さ
+ * @param[IN] seq     エスケープシーケンス
+ * @param[IN] order   LS_COLORS内での順序
+ */
+static void add_pattern_color(const char *pattern, size_t len, const struct color_seq *seq, int order) {
+  struct ext_colors *colors = &ext_colors;
+  colors->patterns = xrealloc(colors->patterns, sizeof(struct pattern_color) * (colors->pattern_num + 1));
+  struct pattern_color *p = &colors->patterns[colors->pattern_num++];
+  p->pattern = xmalloc(len + 1);
+  memcpy(p->pattern, pattern, len);
+  p->pattern[len] = '\0';
+  p->suffix = strcspn(p->pattern + 1, "*?[\\") == len - 1;
+  p->suffix_len = len - 1;
+  p->seq = *seq;
+  p->order = order;
+}
+
+/**
+ * @brief LS_COLORSを解析する
+ * 種別コードは分類ごとのテーブルを上書きし、
+ * "*.拡張子"の形式は拡張子のハッシュテーブルへ、それ以外の"*"から始まるものはパターンのリストへ登録する。
+ * 対応しない種別コードは無視する。"ln=target"はリンクをリンク先の分類で色付けする指定とする。
+ *
+ * @param[IN] env LS_COLORSの値、NULLの場合は何もしない
+ */
+static void parse_ls_colors(const char *env) {
+  int order = 0;
+  if (env == NULL) {
+    return;
+  }
+  while (*env != '\0') {
+    const char *end = strchrnul(env, ':');
+    const char *eq = memchr(env, '=', end - env);
+    struct color_seq seq;
+    if (end == env) {
+      env++;
+      continue;
+    }
+    if (eq != NULL && eq - env == 2 && env[0] == 'l' && env[1] == 'n'
+        && end - eq - 1 == 6 && memcmp(eq + 1, "target", 6) == 0) {
+      color_link_target = true;
+    } else if (eq == NULL || !make_color_seq(eq + 1, end - eq - 1, &seq)) {
+      fprintf(stderr, "invalid LS_COLORS entry: %.*s\n", (int)(end - env), env);
+    } else if (env[0] == '*') {
+      const char *key = env + 1;
+      size_t len = eq - key;
+      if (len > 1 && len <= EXT_COLOR_MAX_LEN && key[0] == '.'
+          && strcspn(key + 1, ".*?[\\=") == len - 1) {
+        add_ext_color(key + 1, len - 1, &seq, order);
+      } else {
+        add_pattern_color(env, eq - env, &seq, order);
+      }
+    } else if (eq - env == 2 && env[0] == 'r' && env[1] == 's') {
+      if (seq.len != 0) {
+        color_reset = seq;
+      }
+    } else {
+      int color_class = find_color_code(env, eq - env);
+      if (color_class >= 0) {
+        color_table[color_class] = seq;
+      }
+    }
+    order++;
+    env = *end == ':' ? end + 1 : end;
+  }
+}
+
+/**
+ * @brief ファイル名に対応するLS_COLORSのパターン指定を探す
+ * 最後の'.'以降でハッシュテーブルを引き、パターンのリストはそれより後に指定されたものだけを照合する。
+ *
+ * @param[IN] name ファイル名
+ * @param[IN] len  ファイル名の長さ
+ * @return エスケープシーケンス、該当しない場合NULL
+ */
+static const struct color_seq *find_ext_color(const char *name, size_t len) {
+  struct ext_colors *colors = &ext_colors;
+  const struct color_seq *seq = NULL;
+  int order = -1;
+  if (colors->used != 0) {
+    const char *dot = memrchr(name, '.', len);
+    if (dot != NULL) {
+      const char *ext = dot + 1;
+      size_t ext_len = name + len - ext;
+      if (ext_len != 0 && ext_len <= colors->max_len) {
+        char lower[EXT_COLOR_MAX_LEN];
+        size_t i;
+        for (i = 0; i < ext_len; i++) {
+          lower[i] = (ext[i] >= 'A' && ext[i] <= 'Z') ? ext[i] + 'a' - 'A' : ext[i];
+        }
+        struct ext_color *entry = find_ext_entry(colors->table, colors->size, lower, ext_len);
+        if (entry->ext != NULL) {
+          seq = &entry->seq;
+          order = entry->order;
+        }
+      }
+    }
+  }
+  size_t i = colors->pattern_num;
+  while (i > 0) {
+    struct pattern_color *p = &colors->patterns[--i];
+    if (p->order < order) {
+      break;
+    }
+    if (p->suffix) {
+      if (len >= p->suffix_len
+          && strncasecmp(name + len - p->suffix_len, p->pattern + 1, p->suffix_len) == 0) {
+        return &p->seq;
+      }
+    } else if (fnmatch(p->pattern, name, FNM_CASEFOLD) == 0) {
+      return &p->seq;
+    }
+  }
+  return seq;
+}
+
+/**
+ * @brief 分類に色が指定されているかを判定する
+ * GNU lsと同じく、空と"0"、"00"は指定されていないものとして扱う。
+ *
+ * @param[IN] color_class 分類
+ * @return 指定されている場合true
+ */
+static bool is_colored(int color_class) {
+  const struct color_seq *seq = &color_table[color_class];
+  return seq->len != 0
+      && !(seq->len == 4 && memcmp(seq->seq, "\033[0m", 4) == 0)
+      && !(seq->len == 5 && memcmp(seq->seq, "\033[00m", 5) == 0);
+}
+
+/**
+ * @brief 色付き表示の分類を求める
+ * 特殊なビットによる分類に色が指定されていない場合は、基本の分類とする。
+ *
+ * @param[IN] mode mode値
+ * @param[IN] link_ok リンク先が存在しない場合にfalse
+ * @return 分類
+ */
+static int get_color_class(mode_t mode, bool link_ok) {
+  if (!link_ok) {
+    return COLOR_ORPHAN;
+  }
+  switch (mode & S_IFMT) {
+    case S_IFREG:
+      if ((mode & S_ISUID) && is_colored(COLOR_SETUID)) {
+        return COLOR_SETUID;
+      } else if ((mode & S_ISGID) && is_colored(COLOR_SETGID)) {
+        return COLOR_SETGID;
+      } else if ((mode & S_IXUGO) && is_colored(COLOR_EXEC)) {
+        return COLOR_EXEC;
+      }
+      return COLOR_FILE;
+    case S_IFDIR:
+      if ((mode & S_ISVTX) && (mode & S_IWOTH) && is_colored(COLOR_STICKY_OTHER_WRITABLE)) {
+        return COLOR_STICKY_OTHER_WRITABLE;
+      } else if ((mode & S_IWOTH) && is_colored(COLOR_OTHER_WRITABLE)) {
+        return COLOR_OTHER_WRITABLE;
+      } else if ((mode & S_ISVTX) && is_colored(COLOR_STICKY)) {
+        return COLOR_STICKY;
+      }
+      return COLOR_DIR;
+    case S_IFLNK:
+      return COLOR_LINK;
+    case S_IFIFO:
+      return COLOR_FIFO;
+    case S_IFSOCK:
+      return COLOR_SOCK;
+    case S_IFBLK:
+      return COLOR_BLK;
+    case S_IFCHR:
+      return COLOR_CHR;
+    default:
+      return COLOR_NONE;
+  }
+}
+
+/**
+ * @brief ファイル名を色付き表示する
+ * 開始シーケンス、ファイル名、終了シーケンスをまとめて出力バッファへ書き込む。
+ * 拡張子やパターンによる色は特殊なビットを持たない通常ファイルにだけ適用する。
+ *
+ * @param[IN] name ファイル名
+ * @param[IN] mode mode値
+ * @param[IN] link_ok リンク先が存在しない場合にfalse
+ */
+static void print_name_with_color(const char *name, mode_t mode, bool link_ok) {
+  int color_class = get_color_class(mode, link_ok);
+  const struct color_seq *seq = &color_table[color_class];
+  size_t len = strlen(name);
+  if (color_class == COLOR_FILE) {
+    const struct color_seq *ext = find_ext_color(name, len);
+    if (ext != NULL) {
+      seq = ext;
+    }
+  }
+  size_t total = seq->len + len + color_reset.len;
+  if (total > out_buf_size) {
+    out_write(seq->seq, seq->len);
+    out_write(name, len);
+    out_write(color_reset.seq, color_reset.len);
+    return;
+  }
+  char *p = out_reserve(total);
+  memcpy(p, seq->seq, seq->len);
+  p += seq->len;
+  memcpy(p, name, len);
+  p += len;
+  memcpy(p, color_reset.seq, color_reset.len);
+}
+
+/**
+ * @brief struct dir_fdのファクトリーメソッド
+ * @param[IN] fd ディレクトリのfd
+ * @return struct dir_fdへのポインタ
+ */
+static struct dir_fd *new_dir_fd(int fd) {
+  struct dir_fd *d = xmalloc(sizeof(struct dir_fd));
+  d->fd = fd;
+  d->ref = 0;
+  return d;
+}
+
+/**
+ * @brief struct dir_fdの参照を解放する
+ * 参照がなくなった場合はfdをcloseする
+ *
+ * @param[IN] dir_fd 解放する構造体、NULLの場合は何もしない
+ */
+static void release_dir_fd(struct dir_fd *dir_fd) {
+  if (dir_fd == NULL) {
+    return;
+  }
+  /* 並列な再帰表示では子ディレクトリが別のスレッドから解放する */
+  if (__atomic_sub_fetch(&dir_fd->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(dir_fd->fd);
+    free(dir_fd);
+  }
+}
+
+/**
+ * @brief struct dir_pathのファクトリーメソッド
+ * 親ディレクトリの要素が指定された場合は、その参照を保持する。
+ *
+ * @param[IN] name 名前、親ディレクトリの要素がNULLの場合はパス
+ * @param[IN] up 親ディレクトリの要素
+ * @param[IN] parent 親ディレクトリのfd、NULLの場合はnameをそのまま使う
+ * @param[IN] depth 深さ
+ * @param[IN] next 次の要素へのポインタ
+ * @return struct dir_pathへのポインタ
+ */
+static struct dir_path *new_dir_path(const char *name, struct dir_path *up, struct dir_fd *parent, int depth, struct dir_path *next) {
+  size_t len = strlen(name);
+  struct dir_path *s = xmalloc(sizeof(struct dir_path) + len + 1);
+  memcpy(s->name, name, len + 1);
+  if (up != NULL) {
+    __atomic_add_fetch(&up->ref, 1, __ATOMIC_RELAXED);
+  }
+  s->up = up;
+  s->parent = parent;
+  s->next = next;
+  s->depth = depth;
+  s->ref = 1;
+  s->has_ino = false;
+  s->checked = false;
+  s->dev = 0;
+  s->ino = 0;
+  return s;
+}
+
+/**
+ * @brief struct dir_pathの参照を解放する
+ * 参照がなくなった場合は親ディレクトリの要素の参照も解放する
+ * @param[IN] dir 解放する要素
+ */
+static void release_dir_path(struct dir_path *dir) {
+  while (dir != NULL && __atomic_sub_fetch(&dir->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+    struct dir_path *up = dir->up;
+    free(dir);
+    dir = up;
+  }
+}
+
+/**
+ * @brief 親ディレクトリを辿ってパスを組み立てる
+ * 親のパスが'/'で終わっていない場合にだけ区切りの'/'を挟む。
+ * 長すぎる場合は途中で打ち切り、PATH_MAXより大きな値を返す。
+ *
+ * @param[IN]  dir 対象の要素
+ * @param[OUT] buf 格納先、PATH_MAX+1バイト以上のバッファを指定
+ * @return パスの長さ
+ */
+static size_t build_dir_path(const struct dir_path *dir, char *buf) {
+  size_t len = 0;
+  size_t name_len;
+  if (dir->up != NULL) {
+    len = build_dir_path(dir->up, buf);
+    if (len > PATH_MAX) {
+      return len;
+    }
+    if (len == 0 || buf[len - 1] != '/') {
+      if (len == PATH_MAX) {
+        return PATH_MAX + 1;
+      }
+      buf[len++] = '/';
+      buf[len] = '\0';
+    }
+  }
+  name_len = strlen(dir->name);
+  if (len + name_len > PATH_MAX) {
+    return PATH_MAX + 1;
+  }
+  memcpy(buf + len, dir->name, name_len + 1);
+  return len + name_len;
+}
+
+/**
+ * @brief 再帰的な表示のディレクトリの見出しを表示する
+ * @param[IN] path ディレクトリのパス
+ */
+static void print_dir_header(const char *path) {
+  out_printf("\n%s:\n", path);
+}
+
+/**
+ * @brief (dev, ino)のハッシュ値を求める
+ * @param[IN] dev デバイス番号
+ * @param[IN] ino inode番号
+ * @return ハッシュ値
+ */
+static size_t hash_dev_ino(uint64_t dev, uint64_t ino) {
+  uint64_t hash = (ino ^ (dev * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+  return hash ^ (hash >> 32);
+}
+
+/**
+ * @brief 表示済みのディレクトリのハッシュテーブルからスロットを探す
+ * 見つからなかった場合は空きスロットを返す
+ *
+ * @param[IN] table テーブル
+ * @param[IN] size  テーブルのサイズ、2のべき乗
+ * @param[IN] dev   デバイス番号
+ * @param[IN] ino   inode番号、0以外
+ * @return スロット
+ */
+static struct visited_entry *find_visited(struct visited_entry *table, size_t size, uint64_t dev, uint64_t ino) {
+  size_t mask = size - 1;
+  size_t i = hash_dev_ino(dev, ino) & mask;
+  while (table[i].ino != 0 && (table[i].ino != ino || table[i].dev != dev)) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+/**
+ * @brief ディレクトリを表示済みとして記録する
+ * inoが0の場合は識別できないため常に未表示として扱う
+ *
+ * @param[IN] dev デバイス番号
+ * @param[IN] ino inode番号
+ * @retval true  初めて記録した
+ * @retval false 既に記録されていた
+ */
+static bool visit_dir(dev_t dev, ino_t ino) {
+  struct visited_set *set = &visited;
+  struct visited_entry *entry;
+  bool first = false;
+  if (ino == 0) {
+    return true;
+  }
+  if (set->table == NULL) {
+    set->size = VISITED_INITIAL_SIZE;
+    set->table = xmalloc(sizeof(struct visited_entry) * set->size);
+    memset(set->table, 0, sizeof(struct visited_entry) * set->size);
+  }
+  entry = find_visited(set->table, set->size, dev, ino);
+  if (entry->ino == 0) {
+    if ((set->used + 1) * 2 > set->size) {
+      size_t i;
+      size_t size = set->size * 2;
+      struct visited_entry *table = xmalloc(sizeof(struct visited_entry) * size);
+      memset(table, 0, sizeof(struct visited_entry) * size);
+      for (i = 0; i < set->size; i++) {
+        if (set->table[i].ino != 0) {
+          *find_visited(table, size, set->table[i].dev, set->table[i].ino) = set->table[i];
+        }
+      }
+      free(set->table);
+      set->table = table;
+      set->size = size;
+      entry = find_visited(table, size, dev, ino);
+    }
+    entry->dev = dev;
+    entry->ino = ino;
+    set->used++;
+    first = true;
+  }
+  return first;
+}
+
+/**
+ * @brief ディレクトリが祖先のディレクトリと同一かを判定する
+ * 並列な再帰表示では表示済みかの判定が出力時まで遅れるため、循環による無限の走査をこれで防ぐ
+ *
+ * @param[IN] dir 判定するディレクトリ
+ * @retval true  祖先と同一
+ * @retval false 祖先と異なる
+ */
+static bool is_cycle(const struct dir_path *dir) {
+  const struct dir_path *up;
+  if (dir->ino == 0) {
+    return false;
+  }
+  for (up = dir->up; up != NULL; up = up->up) {
+    if (up->ino == dir->ino && up->dev == dir->dev) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief アリーナから領域を切り出す
+ * 現在の塊に空きがない場合は次の塊へ進み、塊がなければ新たに確保する。
+ *
+ * @param[IN/OUT] arena 確保元
+ * @param[IN] size 確保サイズ
+ * @param[IN] align アライメント、2の累乗でmax_align_t以下
+ * @return 確保された領域へのポインタ
+ */
+static void *arena_alloc(struct arena *arena, size_t size, size_t align) {
+  struct arena_chunk *chunk = arena->current;
+  size_t used = (arena->used + align - 1) & ~(align - 1);
+  if (chunk == NULL || chunk->size - used < size) {
+    struct arena_chunk *next = chunk != NULL ? chunk->next : arena->head;
+    if (next == NULL || next->size < size) {
+      size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+      struct arena_chunk *new_chunk = xmalloc(sizeof(struct arena_chunk) + chunk_size);
+      new_chunk->size = chunk_size;
+      new_chunk->next = next;
+      if (chunk != NULL) {
+        chunk->next = new_chunk;
+      } else {
+        arena->head = new_chunk;
+      }
+      next = new_chunk;
+    }
+    chunk = next;
+    arena->current = chunk;
+    used = 0;
+  }
+  arena->used = used + size;
+  return (char *)chunk->data + used;
+}
+
+/**
+ * @brief アリーナへ文字列を格納する
+ * @param[IN/OUT] arena 格納先
+ * @param[IN] str 文字列、終端文字は不要
+ * @param[IN] len 文字列の長さ
+ * @return 格納された'\0'終端の文字列
+ */
+static const char *arena_strdup(struct arena *arena, const char *str, size_t len) {
+  char *p = arena_alloc(arena, len + 1, 1);
+  memcpy(p, str, len);
+  p[len] = '\0';
+  return p;
+}
+
+/**
+ * @brief アリーナから切り出したすべての領域を開放する
+ * 塊はそのまま残し、先頭から再利用する。
+ *
+ * @param[IN/OUT] arena 対象のアリーナ
+ */
+static void reset_arena(struct arena *arena) {
+  arena->current = arena->head;
+  arena->used = 0;
+}
+
+/**
+ * @brief 可変長リストを初期化する
+ * エントリ情報構造体と文字列はディレクトリ単位のアリーナへ格納する。
+ *
+ * @param[OUT] list 初期化する構造体
+ * @param[IN] size 初期サイズ
+ */
+static void init_info_list(struct info_list *list, int size) {
+  list->array = xmalloc(sizeof(struct info*) * size);
+  list->size = size;
+  list->used = 0;
+  list->arena = &entry_arena;
+  list->links = &link_arena;
+}
+
+/**
+ * @brief 可変長リスト内のメモリを開放する
+ * リスト内に登録されたinfoと文字列もアリーナごと合わせて開放する。
+ *
+ * @param[IN] list 開放する構造体
+ */
+static void free_info_list(struct info_list *list) {
+  free(list->array);
+  reset_arena(list->arena);
+  reset_arena(list->links);
+}
+
+/**
+ * @brief 可変長リストへ情報を格納する
+ * 格納場所がない場合は拡張を行う
+ *
+ * @param[IN/OUT] list 格納先構造体
+ * @param[IN] info 格納するデータ
+ */
+static void add_info(struct info_list *list, struct info *info) {
+  if (list->size == list->used) {
+    list->size = list->size * 2;
+    list->array = xrealloc(list->array, sizeof(struct info*) * list->size);
+  }
+  list->array[list->used] = info;
+  list->used++;
+}
+
+/**
+ * @brief 表示オプションから取得が必要な情報を決定する
+ * ソートと再帰のためファイルタイプは常に必要とする。
+ * 属性を示す文字と色付けには許可属性が、
+ * ロングフォーマットには表示するすべての項目が必要になる。
+ * リンク先の情報は色付けでのみ、リンク先文字列はロングフォーマットでのみ使う。
+ * スナップショットファイルへ保存する場合は表示方法を問わず読み込めるようすべて取得する。
+ * 常駐する場合はサブディレクトリの入れ替わりとハードリンクの判定にinode番号を使う。
+ */
+static void init_stat_mask(void) {
+  bool save = save_snapshot_path != NULL;
+  stat_mask = STATX_TYPE;
+  if (classify || color) {
+    stat_mask |= STATX_MODE;
+  }
+  if (long_format || save) {
+    stat_mask |= STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID
+        | STATX_SIZE | STATX_MTIME;
+  }
+  if (serve_path != NULL) {
+    stat_mask |= STATX_INO;
+  }
+  link_stat_mask = color || save ? (STATX_TYPE | STATX_MODE) : 0;
+  need_link = long_format || save;
+}
+
+/**
+ * @brief statxが使えるかを調べる
+ * ワーカースレッドから参照するため、スレッド起動前に確定させておく。
+ */
+static void check_statx(void) {
+  struct statx stx;
+  if (statx(AT_FDCWD, "/", 0, STATX_TYPE, &stx) != 0 && errno == ENOSYS) {
+    statx_unsupported = true;
+  }
+}
+
+/**
+ * @brief 指定された情報のみを取得しstruct statへ格納する
+ * statxが使えない場合はfstatatで全情報を取得する。
+ * 取得しなかった項目は0となる。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからの相対パス
+ * @param[IN] flags AT_SYMLINK_NOFOLLOWなどのフラグ
+ * @param[IN] mask 取得する情報のstatxマスク
+ * @param[OUT] st 格納先
+ * @return 成功した場合0、失敗した場合はerrnoを設定し-1
+ */
+static int stat_entry(int dirfd, const char *path, int flags, unsigned int mask, struct stat *st) {
+  struct statx stx;
+  if (statx_unsupported) {
+    return fstatat(dirfd, path, st, flags);
+  }
+  if (statx(dirfd, path, flags, mask, &stx) != 0) {
+    return -1;
+  }
+  statx_to_stat(&stx, st);
+  return 0;
+}
+
+/**
+ * @brief statxの結果をstruct statへ変換する
+ * @param[IN] stx statxの結果
+ * @param[OUT] st 格納先
+ */
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = (stx->stx_mask & STATX_INO) ? stx->stx_ino : 0;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+/**
+ * @brief エントリの情報取得にstatが必要かを判定する
+ * ファイルタイプ以外の情報が不要な場合は、d_typeが分かっていればstatしない。
+ *
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @return statが必要な場合true
+ */
+static bool need_stat(unsigned char d_type) {
+  return stat_mask != STATX_TYPE || d_type == DT_UNKNOWN;
+}
+
+/**
+ * @brief statの結果から表示に使う項目をエントリ情報構造体へ格納する
+ * @param[OUT] info 格納先
+ * @param[IN] st statの結果
+ */
+static void set_info_stat(struct info *info, const struct stat *st) {
+  info->mode = st->st_mode;
+  info->nlink = st->st_nlink;
+  info->uid = st->st_uid;
+  info->gid = st->st_gid;
+  info->size = st->st_size;
+  info->rdev = st->st_rdev;
+  info->mtime = st->st_mtim.tv_sec;
+  info->dev = st->st_dev;
+  info->ino = st->st_ino;
+}
+
+/**
+ * @brief シンボリックリンクのリンク先を読み出して格納する
+ * 読み出せなかった場合は何もしない。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[OUT] info 格納先
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void read_link(int dirfd, const char *path, struct info *info, struct arena *links) {
+  char buf[PATH_MAX + 1];
+  int link_len = readlinkat(dirfd, path, buf, PATH_MAX);
+  if (link_len > 0) {
+    pthread_mutex_lock(&link_mutex);
+    info->link = arena_strdup(links, buf, link_len);
+    pthread_mutex_unlock(&link_mutex);
+  }
+}
+
+/**
+ * @brief エントリ情報構造体へ指定パスの各情報を格納する
+ * パスはディレクトリのfdからの相対で解決するため、
+ * 深い階層でもカーネルによるパスの探索はエントリ名の分だけで済む。
+ * ワーカースレッドからも呼び出される。
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[OUT] info 格納先
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @param[IN/OUT] links リンク先の格納先
+ * @return 成功した場合0、失敗した場合はinfo->errorにerrnoを設定し-1
+ */
+static int fill_info(int dirfd, const char *path, struct info *info, unsigned char d_type, struct arena *links) {
+  struct stat st;
+  info->error = 0;
+  if (!need_stat(d_type)) {
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = DTTOIF(d_type);
+  } else if (stat_entry(dirfd, path, AT_SYMLINK_NOFOLLOW, stat_mask, &st) != 0) {
+    info->error = errno;
+    return -1;
+  }
+  set_info_stat(info, &st);
+  info->link_ok = false;
+  info->link = NULL;
+  info->link_mode = 0;
+  if (S_ISLNK(info->mode)) {
+    struct stat link_stat;
+    if (need_link) {
+      read_link(dirfd, path, info, links);
+    }
+    if (link_stat_mask == 0) {
+      info->link_ok = true;
+    } else if (stat_entry(dirfd, path, 0, link_stat_mask, &link_stat) == 0) {
+      info->link_ok = true;
+      info->link_mode = link_stat.st_mode;
+    }
+  } else {
+    info->link_ok = true;
+  }
+  return 0;
+}
+
+/**
+ * @brief エントリ情報構造体のメモリを確保し名前を格納する
+ * @param[IN/OUT] list 名前の格納先
+ * @param[IN] name エントリの名前
+ * @return エントリ情報構造体
+ */
+static struct info *alloc_info(struct info_list *list, const char *name) {
+  struct info *info = arena_alloc(list->arena, sizeof(struct info), _Alignof(struct info));
+  info->name = arena_strdup(list->arena, name, strlen(name));
+  return info;
+}
+
+/**
+ * @brief エントリ情報構造体のファクトリメソッド
+ * メモリ確保から、指定パスの各情報格納までを行う
+ *
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのエントリの相対パス
+ * @param[IN] name エントリの名前
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @param[IN/OUT] list 名前とリンク先の格納先
+ * @return エントリ情報構造体、失敗した場合はerrnoを設定しNULL
+ */
+static struct info *new_info(int dirfd, const char *path, const char *name, unsigned char d_type, struct info_list *list) {
+  struct info *info = alloc_info(list, name);
+  if (fill_info(dirfd, path, info, d_type, list->links) != 0) {
+    errno = info->error;
+    return NULL;
+  }
+  return info;
+}
+
+/**
+ * @brief 情報取得を行うワーカースレッド
+ * キューから依頼を取り出し、結果をinfoへ書き込む。
+ *
+ * @param[IN] arg struct stat_pool
+ * @return 常にNULL
+ */
+static void *stat_worker(void *arg) {
+  struct stat_pool *pool = arg;
+  while (true) {
+    struct stat_job job;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == 0) {
+      pthread_cond_wait(&pool->not_empty, &pool->mutex);
+    }
+    job = pool->jobs[pool->head];
+    pool->head = (pool->head + 1) % STAT_QUEUE_SIZE;
+    pool->count--;
+    pthread_cond_signal(&pool->not_full);
+    pthread_mutex_unlock(&pool->mutex);
+    fill_info(job.dirfd, job.info->name, job.info, job.d_type, job.links);
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending--;
+    if (pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return NULL;
+}
+
+/**
+ * @brief ワーカースレッドを起動する
+ *
+ * @param[IN] threads スレッド数
+ * @return struct stat_pool
+ */
+static struct stat_pool *new_stat_pool(long threads) {
+  struct stat_pool *pool = xmalloc(sizeof(struct stat_pool));
+  long i;
+  pool->head = 0;
+  pool->count = 0;
+  pool->pending = 0;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->not_empty, NULL);
+  pthread_cond_init(&pool->not_full, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (i = 0; i < threads; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, stat_worker, pool);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+  return pool;
+}
+
+/**
+ * @brief ワーカースレッドを取得する
+ * 初回呼び出し時にスレッドを起動し、以降は使い回す。
+ *
+ * @return struct stat_pool、スレッド数が1以下の場合NULL
+ */
+static struct stat_pool *get_stat_pool(void) {
+  if (stat_threads > 1 && stat_pool == NULL) {
+    stat_pool = new_stat_pool(stat_threads);
+  }
+  return stat_pool;
+}
+
+/**
+ * @brief ワーカースレッドへ情報取得を依頼する
+ * キューが一杯の場合は空きができるまで待つ。
+ *
+ * @param[IN] pool ワーカースレッド
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] info 格納先、info->nameをdirfdからの相対パスとして使う
+ * @param[IN] d_type ディレクトリエントリのファイルタイプ
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void submit_stat_job(struct stat_pool *pool, int dirfd, struct info *info, unsigned char d_type, struct arena *links) {
+  struct stat_job *job;
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->count == STAT_QUEUE_SIZE) {
+    pthread_cond_wait(&pool->not_full, &pool->mutex);
+  }
+  job = &pool->jobs[(pool->head + pool->count) % STAT_QUEUE_SIZE];
+  job->info = info;
+  job->dirfd = dirfd;
+  job->d_type = d_type;
+  job->links = links;
+  pool->count++;
+  pool->pending++;
+  pthread_cond_signal(&pool->not_empty);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief 依頼したすべての情報取得の完了を待つ
+ * @param[IN] pool ワーカースレッド
+ */
+static void wait_stat_jobs(struct stat_pool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief io_uringのリングを作成する
+ * statxの発行に対応していない場合はNULLを返し、同期的な情報取得を使う。
+ *
+ * @return struct uring、使えない場合NULL
+ */
+static struct uring *new_uring(void) {
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  size_t sq_size;
+  size_t cq_size;
+  char *sq;
+  char *cq;
+  struct uring *ring;
+  int fd;
+  if (statx_unsupported) {
+    return NULL;
+  }
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) {
+    return NULL;
+  }
+  probe = xmalloc(probe_size);
+  memset(probe, 0, probe_size);
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) != 0
+      || probe->last_op < IORING_OP_STATX
+      || !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)) {
+    free(probe);
+    close(fd);
+    return NULL;
+  }
+  free(probe);
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) {
+      sq_size = cq_size;
+    }
+    cq_size = sq_size;
+  }
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq = sq;
+  } else {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sq_size);
+      close(fd);
+      return NULL;
+    }
+  }
+  ring = xmalloc(sizeof(struct uring));
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (cq != sq) {
+      munmap(cq, cq_size);
+    }
+    munmap(sq, sq_size);
+    free(ring);
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->used = 0;
+  return ring;
+}
+
+/**
+ * @brief io_uringのリングを取得する
+ * 初回呼び出し時に作成し、以降は使い回す。
+ *
+ * @return struct uring、指定されていないか使えない場合NULL
+ */
+static struct uring *get_uring(void) {
+  static bool initialized = false;
+  if (use_uring && !initialized) {
+    initialized = true;
+    uring = new_uring();
+  }
+  return uring;
+}
+
+/**
+ * @brief statxの依頼をサブミッションキューへ積む
+ * 実際の発行はwait_uringで行う。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] index 結果を格納するjobsのインデックス
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからの相対パス
+ * @param[IN] flags AT_SYMLINK_NOFOLLOWなどのフラグ
+ * @param[IN] mask 取得する情報のstatxマスク
+ */
+static void submit_uring_statx(struct uring *ring, int index, int dirfd, const char *path, int flags, unsigned int mask) {
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = mask;
+  sqe->off = (uintptr_t)&ring->jobs[index].stx;
+  sqe->statx_flags = flags;
+  sqe->user_data = index;
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 積んだ依頼を1回のシステムコールで発行し、すべての完了を待つ
+ * 結果はjobs[].resへ格納する。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] count 積んだ依頼の数
+ */
+static void wait_uring(struct uring *ring, int count) {
+  int submitted = 0;
+  int completed = 0;
+  while (completed < count) {
+    unsigned head = *ring->cq_head;
+    int ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+                      count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      flush_before_error();
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+    submitted += ret;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      ring->jobs[cqe->user_data].res = cqe->res;
+      head++;
+      completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @brief 積まれたエントリの情報取得をio_uringで行う
+ * まずすべてのエントリのstatxを発行し、
+ * シンボリックリンクのリンク先が必要な場合は続けてまとめて発行する。
+ * リンク先文字列の読み出しはio_uringで扱えないため同期的に行う。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void run_uring_jobs(struct uring *ring, int dirfd, struct arena *links) {
+  int i;
+  int link_jobs = 0;
+  struct stat st;
+  if (ring->used == 0) {
+    return;
+  }
+  for (i = 0; i < ring->used; i++) {
+    submit_uring_statx(ring, i, dirfd, ring->jobs[i].info->name, AT_SYMLINK_NOFOLLOW, stat_mask);
+  }
+  wait_uring(ring, ring->used);
+  for (i = 0; i < ring->used; i++) {
+    struct uring_job *job = &ring->jobs[i];
+    struct info *info = job->info;
+    if (job->res < 0) {
+      info->error = -job->res;
+      continue;
+    }
+    info->error = 0;
+    statx_to_stat(&job->stx, &st);
+    set_info_stat(info, &st);
+    info->link_ok = true;
+    info->link = NULL;
+    info->link_mode = 0;
+    if (S_ISLNK(info->mode)) {
+      if (need_link) {
+        read_link(dirfd, info->name, info, links);
+      }
+      if (link_stat_mask != 0) {
+        info->link_ok = false;
+        submit_uring_statx(ring, i, dirfd, info->name, 0, link_stat_mask);
+        link_jobs++;
+      }
+    }
+  }
+  if (link_jobs > 0) {
+    wait_uring(ring, link_jobs);
+    for (i = 0; i < ring->used; i++) {
+      struct uring_job *job = &ring->jobs[i];
+      struct info *info = job->info;
+      if (info->error == 0 && S_ISLNK(info->mode) && job->res == 0) {
+        info->link_ok = true;
+        info->link_mode = job->stx.stx_mode;
+      }
+    }
+  }
+  ring->used = 0;
+}
+
+/**
+ * @brief io_uringで情報取得するエントリを積む
+ * 積める数を超えた場合はその場で発行する。
+ *
+ * @param[IN/OUT] ring リング
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] info 格納先、info->nameをdirfdからの相対パスとして使う
+ * @param[IN/OUT] links リンク先の格納先
+ */
+static void add_uring_job(struct uring *ring, int dirfd, struct info *info, struct arena *links) {
+  if (ring->used == URING_ENTRIES) {
+    run_uring_jobs(ring, dirfd, links);
+  }
+  ring->jobs[ring->used].info = info;
+  ring->used++;
+}
+
+/**
+ * @brief 情報取得に失敗したエントリをリストから取り除く
+ * エラーは読み出し順に表示するため、逐次処理した場合と同じ出力になる。
+ *
+ * @param[IN/OUT] list 対象のリスト
+ * @param[IN] path エラー表示に使うディレクトリのパス、末尾は'/'
+ */
+static void remove_failed_info(struct info_list *list, const char *path) {
+  int i;
+  int used = 0;
+  for (i = 0; i < list->used; i++) {
+    struct info *info = list->array[i];
+    if (info->error != 0) {
+      print_error("%s%s: %s\n", path, info->name, strerror(info->error));
+      continue;
+    }
+    list->array[used] = info;
+    used++;
+  }
+  list->used = used;
+}
+
+/**
+ * @brief 名前の先頭8バイトからソート用のキーを作成する
+ * 8バイトに満たない部分は0で埋める。
+ *
+ * @param[IN] name 名前
+ * @return キー
+ */
+static uint64_t name_prefix(const char *name) {
+  uint64_t prefix = 0;
+  int i;
+  for (i = 0; i < 8 && name[i] != '\0'; i++) {
+    prefix |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+  }
+  return prefix;
+}
+
+/**
+ * @brief ソート用キー比較
+ * キーが一致し、名前が続いている場合のみ残りをstrcmpで比較する。
+ *
+ * @param[IN] a
+ * @param[IN] b
+ * @param[IN] offset キーを作成した名前の位置
+ * @return a>bなら正、a==bなら0、a<bなら負
+ */
+static int compare_key(const struct sort_key *a, const struct sort_key *b, size_t offset) {
+  if (a->prefix != b->prefix) {
+    return a->prefix < b->prefix ? -1 : 1;
+  }
+  if ((a->prefix & 0xff) == 0) {
+    return 0;
+  }
+  return strcmp(a->info->name + offset + 8, b->info->name + offset + 8);
+}
+
+/**
+ * @brief 少数の要素を挿入ソートする
+ * @param[IN/OUT] keys ソート対象
+ * @param[IN] n 要素数
+ * @param[IN] offset キーを作成した名前の位置
+ */
+static void insertion_sort_keys(struct sort_key *keys, size_t n, size_t offset) {
+  size_t i;
+  for (i = 1; i < n; i++) {
+    struct sort_key key = keys[i];
+    size_t j = i;
+    while (j > 0 && compare_key(&keys[j - 1], &key, offset) > 0) {
+      keys[j] = keys[j - 1];
+      j--;
+    }
+    keys[j] = key;
+  }
+}
+
+/**
+ * @brief キーの上位バイトから順に基数ソートする
+ * 要素数が少なくなった場合は挿入ソートへ切り替える。
+ * 8バイトすべてが一致した集合は、名前の続く8バイトでキーを作り直して続ける。
+ * 対象のバイトが0の集合は名前がそこで終わっており、同一のためそれ以上並べない。
+ *
+ * @param[IN/OUT] keys ソート対象
+ * @param[IN] tmp 作業領域、n要素以上
+ * @param[IN] n 要素数
+ * @param[IN] shift 対象とするバイトのシフト量
+ * @param[IN] offset キーを作成した名前の位置
+ */
+static void radix_sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n, int shift, size_t offset) {
+  size_t count[256];
+  size_t pos[256];
+  size_t i;
+  size_t start;
+  if (shift < 0) {
+    offset += 8;
+    for (i = 0; i < n; i++) {
+      keys[i].prefix = name_prefix(keys[i].info->name + offset);
+    }
+    shift = 56;
+  }
+  if (n <= SORT_INSERTION_MAX) {
+    insertion_sort_keys(keys, n, offset);
+    return;
+  }
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {
+    count[(keys[i].prefix >> shift) & 0xff]++;
+  }
+  start = 0;
+  for (i = 0; i < 256; i++) {
+    pos[i] = start;
+    start += count[i];
+  }
+  for (i = 0; i < n; i++) {
+    tmp[pos[(keys[i].prefix >> shift) & 0xff]++] = keys[i];
+  }
+  memcpy(keys, tmp, sizeof(struct sort_key) * n);
+  start = count[0];
+  for (i = 1; i < 256; i++) {
+    if (count[i] > 1) {
+      radix_sort_keys(keys + start, tmp, count[i], shift - 8, offset);
+    }
+    start += count[i];
+  }
+}
+
+/**
+ * @brief リスト内のソートを行う
+ * ディレクトリを先頭に集めた後、それぞれを名前順に並べる。
+ * 比較のたびにinfoを参照しないよう、キーを連続した配列に作成してソートする。
+ *
+ * @param[IN/OUT] ソート対象のリスト
+ */
+static void sort_list(struct info_list *list) {
+  size_t n = list->used;
+  size_t dirs = 0;
+  size_t d = 0;
+  size_t f = 0;
+  size_t i;
+  struct sort_key *keys;
+  if (n < 2) {
+    return;
+  }
+  keys = xmalloc(sizeof(struct sort_key) * n * 2);
+  for (i = 0; i < n; i++) {
+    if (S_ISDIR(list->array[i]->mode)) {
+      dirs++;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    struct info *info = list->array[i];
+    struct sort_key *key = S_ISDIR(info->mode) ? &keys[d++] : &keys[dirs + f++];
+    key->prefix = name_prefix(info->name);
+    key->info = info;
+  }
+  radix_sort_keys(keys, keys + n, dirs, 56, 0);
+  radix_sort_keys(keys + dirs, keys + n, n - dirs, 56, 0);
+  for (i = 0; i < n; i++) {
+    list->array[i] = keys[i].info;
+  }
+  free(keys);
+}
+
+/**
+ * @brief エントリ情報に基づいて情報を表示する
+ * @param[IN] info 表示する情報
+ */
+static void print_info(struct info *info) {
+  if (long_format) {
+    char buf[12];
+    get_mode_string(info->mode, buf);
+    out_puts(buf);
+    out_putc(' ');
+    out_int((int)info->nlink, 3);
+    out_putc(' ');
+    print_user(info->uid);
+    print_group(info->gid);
+    if (S_ISCHR(info->mode) || S_ISBLK(info->mode)) {
+      out_int((int)major(info->rdev), 4);
+      out_putc(',');
+      out_int((int)minor(info->rdev), 4);
+    } else {
+      out_int(info->size, 9);
+    }
+    out_putc(' ');
+    get_time_string(buf, info->mtime);
+    out_puts(buf);
+    out_putc(' ');
+  }
+  if (color) {
+    /* ln=targetの場合、リンク先が存在すればその分類と拡張子で色付けする */
+    bool as_target = color_link_target && S_ISLNK(info->mode) && info->link_ok;
+    print_name_with_color(info->name, as_target ? info->link_mode : info->mode, info->link_ok);
+  } else {
+    out_puts(info->name);
+  }
+  if (classify) {
+    print_type_indicator(info->mode);
+  }
+  if (long_format) {
+    if (info->link != NULL) {
+      out_puts(" -> ");
+      if (color) {
+        print_name_with_color(info->link, info->link_mode, info->link_ok);
+      } else {
+        out_puts(info->link);
+      }
+    }
+  }
+  out_putc('\n');
+}
+
+/**
+ * @brief 正規表現が固定の文字列と行頭、行末の指定だけからなる場合に固定の文字列として解析する
+ * 特殊文字の'\\'によるエスケープは、その文字自体として扱う。
+ *
+ * @param[IN]  pattern 正規表現
+ * @param[OUT] p       格納先、解析できた場合はtype、literal、lenを設定する
+ * @retval true  固定の文字列として解析した
+ * @retval false 正規表現での照合が必要
+ */
+static bool parse_regex_literal(const char *pattern, struct name_pattern *p) {
+  bool head = pattern[0] == '^';
+  bool tail = false;
+  const char *s = pattern + head;
+  char *literal = xmalloc(strlen(s) + 1);
+  size_t len = 0;
+  while (*s != '\0') {
+    if (*s == '\\' && s[1] != '\0' && strchr(".[]()*+?{}|^$\\", s[1]) != NULL) {
+      literal[len++] = s[1];
+      s += 2;
+    } else if (*s == '$' && s[1] == '\0') {
+      tail = true;
+      s++;
+    } else if (strchr(".[]()*+?{}|^$\\", *s) != NULL) {
+      free(literal);
+      return false;
+    } else {
+      literal[len++] = *s++;
+    }
+  }
+  literal[len] = '\0';
+  p->literal = literal;
+  p->len = len;
+  if (head && tail) {
+    p->type = MATCH_EXACT;
+  } else if (head) {
+    p->type = MATCH_PREFIX;
+  } else if (tail) {
+    p->type = MATCH_SUFFIX;
+  } else {
+    p->type = len == 0 ? MATCH_ANY : MATCH_CONTAINS;
+  }
+  return true;
+}
+
+/**
+ * @brief --include/--excludeのパターンを登録する
+ * ワイルドカードは先頭と末尾の'*'を除いた部分に特殊文字を含まなければ、
+ * 正規表現は固定の文字列と'^'、'$'だけからなれば、文字列の比較で照合する。
+ * それ以外はここで一度だけコンパイルしておく。
+ *
+ * @param[IN/OUT] filter  登録先
+ * @param[IN]     pattern パターン
+ * @param[IN]     regex   拡張正規表現の場合true、ワイルドカードの場合false
+ * @retval true  登録した
+ * @retval false 正規表現が不正
+ */
+static bool add_name_pattern(struct name_filter *filter, const char *pattern, bool regex) {
+  struct name_pattern p;
+  memset(&p, 0, sizeof(p));
+  if (regex) {
+    if (!parse_regex_literal(pattern, &p)) {
+      int err = regcomp(&p.regex, pattern, REG_EXTENDED | REG_NOSUB);
+      if (err != 0) {
+        char message[256];
+        regerror(err, &p.regex, message, sizeof(message));
+        fprintf(stderr, "invalid regex: %s: %s\n", pattern, message);
+        return false;
+      }
+      p.type = MATCH_REGEX;
+    }
+  } else {
+    size_t len = strlen(pattern);
+    size_t head = strspn(pattern, "*");
+    size_t tail = 0;
+    while (tail < len - head && pattern[len - 1 - tail] == '*') {
+      tail++;
+    }
+    p.len = len - head - tail;
+    if (strcspn(pattern + head, "*?[\\") < p.len) {
+      p.type = MATCH_GLOB;
+      p.glob = xmalloc(len + 1);
+      memcpy(p.glob, pattern, len + 1);
+    } else {
+      p.literal = xmalloc(p.len + 1);
+      memcpy(p.literal, pattern + head, p.len);
+      p.literal[p.len] = '\0';
+      if (head != 0 && p.len == 0) {
+        p.type = MATCH_ANY;
+      } else if (head != 0 && tail != 0) {
+        p.type = MATCH_CONTAINS;
+      } else if (head != 0) {
+        p.type = MATCH_SUFFIX;
+      } else if (tail != 0) {
+        p.type = MATCH_PREFIX;
+      } else {
+        p.type = MATCH_EXACT;
+      }
+    }
+  }
+  filter->patterns = xrealloc(filter->patterns, sizeof(struct name_pattern) * (filter->num + 1));
+  filter->patterns[filter->num++] = p;
+  return true;
+}
+
+/**
+ * @brief 名前がパターンに一致するか判定する
+ *
+ * @param[IN] p    パターン
+ * @param[IN] name 名前
+ * @param[IN] len  名前の長さ
+ * @retval true  一致する
+ * @retval false 一致しない
+ */
+static bool match_name(const struct name_pattern *p, const char *name, size_t len) {
+  switch (p->type) {
+    case MATCH_EXACT:
+      return len == p->len && memcmp(name, p->literal, len) == 0;
+    case MATCH_PREFIX:
+      return len >= p->len && memcmp(name, p->literal, p->len) == 0;
+    case MATCH_SUFFIX:
+      return len >= p->len && memcmp(name + len - p->len, p->literal, p->len) == 0;
+    case MATCH_CONTAINS:
+      return memmem(name, len, p->literal, p->len) != NULL;
+    case MATCH_ANY:
+      return true;
+    case MATCH_GLOB:
+      return fnmatch(p->glob, name, 0) == 0;
+    default:
+      return regexec(&p->regex, name, 0, NULL, 0) == 0;
+  }
+}
+
+/**
+ * @brief 名前がいずれかのパターンに一致するか判定する
+ *
+ * @param[IN] filter パターンの一覧
+ * @param[IN] name   名前
+ * @param[IN] len    名前の長さ
+ * @retval true  一致する
+ * @retval false 一致しない
+ */
+static bool match_name_filter(const struct name_filter *filter, const char *name, size_t len) {
+  int i;
+  for (i = 0; i < filter->num; i++) {
+    if (match_name(&filter->patterns[i], name, len)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief 表示対象外の隠しファイルか判定する
+ * @param[IN] name ファイル名
+ * @retval true  表示しない
+ * @retval false 表示する
+ */
+static bool is_hidden(const char *name) {
+  return filter != FILTER_ALL
+      && name[0] == '.'
+      && (filter == FILTER_DEFAULT
+          || name[1 + (name[1] == '.')] == '\0');
+}
+
+/**
+ * @brief 隠しファイルかパターンにより表示対象外か判定する
+ * エントリの情報を取得する前に名前だけで判定する。
+ * "."と".."はディレクトリ自身を表すためパターンの対象としない。
+ *
+ * @param[IN] name ファイル名
+ * @retval true  表示しない
+ * @retval false 表示する
+ */
+static bool is_excluded(const char *name) {
+  size_t len;
+  if (is_hidden(name)) {
+    return true;
+  }
+  if ((include_filter.num == 0 && exclude_filter.num == 0)
+      || (name[0] == '.' && name[1 + (name[1] == '.')] == '\0')) {
+    return false;
+  }
+  len = strlen(name);
+  if ((include_filter.num != 0 && !match_name_filter(&include_filter, name, len))
+      || match_name_filter(&exclude_filter, name, len)) {
+    if (show_stats) {
+      __atomic_add_fetch(&name_filter_skips, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief ディレクトリのエントリを表示する
+ * 再帰的な表示の場合はサブディレクトリを処理中のディレクトリの直後にキューイングする。
+ * 情報を取得済みのサブディレクトリはdev、inoを引き継ぎ、開く際のfstatを省く。
+ *
+ * @param[IN]     list     表示するエントリ
+ * @param[IN]     base     処理中のディレクトリ
+ * @param[IN]     fd       処理中のディレクトリのfd
+ * @param[IN/OUT] self     処理中のディレクトリのstruct dir_fd、未作成の場合NULL
+ * @param[IN/OUT] subque   最後にキューイングしたディレクトリ
+ * @param[IN]     path     処理中のディレクトリのパス、'/'で終わる
+ */
+static void print_list(struct info_list *list, struct dir_path *base, int fd, struct dir_fd **self, struct dir_path **subque, const char *path) {
+  int i;
+  for (i = 0; i < list->used; i++) {
+    struct info *info = list->array[i];
+    if (recursive && S_ISDIR(info->mode)) {
+      const char *name = info->name;
+      if (!(name[0] == '.'
+          && name[1 + (name[1] == '.')] == '\0')) {
+        if (*self == NULL) {
+          *self = new_dir_fd(fd);
+        }
+        (*self)->ref++;
+        (*subque)->next = new_dir_path(name, base, *self, base->depth + 1, (*subque)->next);
+        *subque = (*subque)->next;
+        /* 情報を取得済みであれば、開く際にfstatしない */
+        (*subque)->has_ino = info->ino != 0;
+        (*subque)->dev = info->dev;
+        (*subque)->ino = info->ino;
+      }
+    }
+    if (snapshot_out != NULL) {
+      add_snapshot_info(info);
+    }
+    print_info(info);
+  }
+}
+
+/**
+ * @brief パス名からファイル名を取り出す
+ * @param[IN] path パス名
+ * @return path名内のファイル名を指すポインタ
+ */
+static const char *find_filename(const char *path) {
+  int i;
+  size_t path_len = strlen(path);
+  for (i = path_len;i >= 0; i--) {
+    if (path[i] == '/') {
+      return &path[i+1];
+    }
+  }
+  return path;
+}
+
+/**
+ * @brief ディレクトリエントリの読み出しを開始する
+ * 読み出しバッファは全ディレクトリで共有し、初回に確保する。
+ *
+ * @param[OUT] reader 初期化する構造体
+ * @param[IN] dirfd 基点となるディレクトリのfd
+ * @param[IN] path dirfdからのディレクトリの相対パス
+ * @return 成功した場合true、失敗した場合はerrnoを設定しfalse
+ */
+static bool open_dir_reader(struct dir_reader *reader, int dirfd, const char *path) {
+  reader->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (reader->fd < 0) {
+    return false;
+  }
+  if (dirent_buf == NULL) {
+    dirent_buf = xmalloc(dirent_buf_size);
+  }
+  reader->buf = dirent_buf;
+  reader->pos = 0;
+  reader->end = 0;
+  return true;
+}
+
+/**
+ * @brief 次のディレクトリエントリを読み出す
+ * バッファを使い切った場合のみgetdents64を発行する。
+ * 返却するエントリはバッファ内を直接指しており、次の呼び出しまで有効。
+ *
+ * @param[IN/OUT] reader 読み出し中の構造体
+ * @return ディレクトリエントリ、終端もしくはエラーの場合NULL
+ */
+static struct linux_dirent64 *read_dir_entry(struct dir_reader *reader) {
+  struct linux_dirent64 *dent;
+  if (reader->pos >= reader->end) {
+    long n = syscall(SYS_getdents64, reader->fd, reader->buf, dirent_buf_size);
+    if (n <= 0) {
+      if (n < 0) {
+        print_error("getdents64: %s\n", strerror(errno));
+      }
+      return NULL;
+    }
+    reader->pos = 0;
+    reader->end = n;
+  }
+  dent = (struct linux_dirent64 *)(reader->buf + reader->pos);
+  reader->pos += dent->d_reclen;
+  return dent;
+}
+
+/**
+ * @brief getdents64で読み出した分をすべて返したかを判定する
+ * @param[IN] reader 読み出し中の構造体
+ * @return 次の読み出しでgetdents64を発行する場合true
+ */
+static bool is_batch_end(const struct dir_reader *reader) {
+  return reader->pos >= reader->end;
+}
+
+/**
+ * @brief ディレクトリエントリの読み出しを終了する
+ * @param[IN] reader 終了する構造体
+ */
+static void close_dir_reader(struct dir_reader *reader) {
+  close(reader->fd);
+}
+
+/**
+ * @brief ディレクトリのエントリの情報取得を開始し、リストへ追加する
+ * io_uringかワーカースレッドを使う場合は取得の完了を待たずに戻る。
+ *
+ * @param[IN/OUT] list   追加先
+ * @param[IN]     ring   io_uringのリング、使わない場合NULL
+ * @param[IN]     pool   ワーカースレッド、使わない場合NULL
+ * @param[IN]     fd     処理中のディレクトリのfd
+ * @param[IN]     name   エントリの名前
+ * @param[IN]     d_type ディレクトリエントリのファイルタイプ、不明の場合DT_UNKNOWN
+ * @param[IN]     path   処理中のディレクトリのパス、'/'で終わる
+ */
+static void add_entry(struct info_list *list, struct uring *ring, struct stat_pool *pool, int fd, const char *name, unsigned char d_type, const char *path) {
+  struct info *info;
+  if (ring != NULL && need_stat(d_type)) {
+    info = alloc_info(list, name);
+    add_uring_job(ring, fd, info, list->links);
+  } else if (pool != NULL && need_stat(d_type)) {
+    info = alloc_info(list, name);
+    submit_stat_job(pool, fd, info, d_type, list->links);
+  } else {
+    info = new_info(fd, name, name, d_type, list);
+  }
+  if (info != NULL) {
+    add_info(list, info);
+  } else {
+    print_error("%s%s: %s\n", path, name, strerror(errno));
+  }
+}
+
+/**
+ * @brief 指定パスのディレクトリエントリをリストする
+ * @param[IN] base パス
+ */
+static void list_dir(struct dir_path *base) {
+  char base_path[PATH_MAX + 1];
+  struct dir_reader reader;
+  struct linux_dirent64 *dent;
+  char path[PATH_MAX + 1];
+  size_t path_len;
+  struct info_list list;
+  struct dir_path *subque = base;
+  struct dir_fd *self = NULL;
+  const struct snapshot_dir *cached = NULL;
+  struct stat st;
+  bool has_stat = false;
+  struct uring *ring = walk.num != 0 ? walker_uring : get_uring();
+  struct stat_pool *pool = ring != NULL ? NULL : walk.num != 0 ? walker_pool : get_stat_pool();
+  int parent_fd = base->parent != NULL ? base->parent->fd : AT_FDCWD;
+  path_len = build_dir_path(base, base_path);
+  if (!open_dir_reader(&reader, parent_fd, base->name)) {
+    int error = errno;
+    if (base->depth != 0) {
+      print_dir_header(base_path);
+    }
+    if (snapshot_out != NULL) {
+      add_snapshot_dir(base_path, base->depth, error == ENOTDIR ? 0 : error, NULL);
+    }
+    errno = error;
+    if (errno == ENOTDIR) {
+      const char *name = find_filename(base_path);
+      struct info *info;
+      init_info_list(&list, 1);
+      info = new_info(parent_fd, base->name, name, DT_UNKNOWN, &list);
+      if (info != NULL) {
+        if (snapshot_out != NULL) {
+          add_snapshot_info(info);
+        }
+        print_info(info);
+        add_info(&list, info);
+      } else {
+        print_error("%s: %s\n", base_path, strerror(errno));
+      }
+      free_info_list(&list);
+    } else {
+      print_error("%s: %s\n", base_path, strerror(errno));
+    }
+    release_dir_fd(base->parent);
+    return;
+  }
+  release_dir_fd(base->parent);
+  if ((recursive && !base->has_ino) || snapshot_out != NULL || snapshot_in != NULL) {
+    has_stat = fstat(reader.fd, &st) == 0;
+  }
+  if (recursive && !base->has_ino && has_stat) {
+    base->has_ino = true;
+    base->dev = st.st_dev;
+    base->ino = st.st_ino;
+  }
+  if (recursive && !out_capture && base->has_ino) {
+    /* 表示するものだけを記録し、引数で指定されたものは重複していても表示する。
+       出力する側が自ら処理する場合も出力順に処理しているためここで判定する */
+    base->checked = true;
+    if (!visit_dir(base->dev, base->ino) && base->depth != 0) {
+      print_error("%s: not listing already-listed directory\n", base_path);
+      close_dir_reader(&reader);
+      return;
+    }
+  }
+  if (out_capture && is_cycle(base)) {
+    /* 表示済みかの判定は出力する側で行い、ここでは循環のみ打ち切る */
+    close_dir_reader(&reader);
+    return;
+  }
+  if (base->depth != 0) {
+    print_dir_header(base_path);
+  }
+  if (snapshot_out != NULL) {
+    add_snapshot_dir(base_path, base->depth, 0, has_stat ? &st : NULL);
+  }
+  if (path_len >= PATH_MAX - 1) {
+    print_error("too long path\n");
+    close_dir_reader(&reader);
+    return;
+  }
+  memcpy(path, base_path, path_len + 1);
+  if (path[path_len - 1] != '/') {
+    path[path_len] = '/';
+    path_len++;
+    path[path_len] = '\0';
+  }
+  init_info_list(&list, 100);
+  if (snapshot_in != NULL && has_stat) {
+    cached = find_cached_dir(base_path, &st);
+  }
+  if (cached != NULL) {
+    add_cached_entries(&list, cached, ring, pool, reader.fd, path);
+  }
+  while (cached == NULL && (dent = read_dir_entry(&reader)) != NULL) {
+    const char *name = dent->d_name;
+    if (!is_excluded(name)) {
+      add_entry(&list, ring, pool, reader.fd, name, dent->d_type, path);
+    }
+    if (!is_batch_end(&reader)) {
+      continue;
+    }
+    if (ring != NULL) {
+      run_uring_jobs(ring, reader.fd, list.links);
+    }
+    if (unsorted) {
+      /* 読み出したバッファ分を表示し、エントリの領域を使い回す */
+      if (ring != NULL) {
+        remove_failed_info(&list, path);
+      } else if (pool != NULL) {
+        wait_stat_jobs(pool);
+        remove_failed_info(&list, path);
+      }
+      print_list(&list, base, reader.fd, &self, &subque, path);
+      list.used = 0;
+      reset_arena(list.arena);
+      reset_arena(list.links);
+      if (out_interactive) {
+        out_flush();
+      }
+    }
+  }
+  if (ring != NULL) {
+    run_uring_jobs(ring, reader.fd, list.links);
+    remove_failed_info(&list, path);
+  } else if (pool != NULL) {
+    wait_stat_jobs(pool);
+    remove_failed_info(&list, path);
+  }
+  if (!unsorted) {
+    sort_list(&list);
+  }
+  print_list(&list, base, reader.fd, &self, &subque, path);
+  if (self == NULL) {
+    close_dir_reader(&reader);
+  }
+  free_info_list(&list);
+}
+
+/**
+ * @brief タスクを両端キューの末尾へ追加する
+ * @param[IN] deque 両端キュー
+ * @param[IN] task  タスク
+ */
+static void push_task(struct task_deque *deque, struct dir_task *task) {
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->tail == deque->size) {
+    if (deque->head != 0) {
+      memmove(deque->array, deque->array + deque->head,
+              sizeof(struct dir_task *) * (deque->tail - deque->head));
+      deque->tail -= deque->head;
+      deque->head = 0;
+    } else {
+      deque->size = deque->size != 0 ? deque->size * 2 : TASK_DEQUE_INITIAL_SIZE;
+      deque->array = xrealloc(deque->array, sizeof(struct dir_task *) * deque->size);
+    }
+  }
+  deque->array[deque->tail++] = task;
+  task->deque = deque;
+  pthread_mutex_unlock(&deque->mutex);
+}
+
+/**
+ * @brief 両端キューの末尾からタスクを取り出す
+ * @param[IN] deque 両端キュー
+ * @return タスク、空の場合NULL
+ */
+static struct dir_task *pop_task(struct task_deque *deque) {
+  struct dir_task *task = NULL;
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->tail != deque->head) {
+    task = deque->array[--deque->tail];
+    __atomic_store_n(&task->running, true, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+/**
+ * @brief 両端キューの先頭からタスクを盗む
+ * 先頭には浅い階層のタスクが残っているため、盗んだ側もまとまった仕事を得られる
+ * @param[IN] deque 両端キュー
+ * @return タスク、空の場合NULL
+ */
+static struct dir_task *steal_task(struct task_deque *deque) {
+  struct dir_task *task = NULL;
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->tail != deque->head) {
+    task = deque->array[deque->head++];
+    __atomic_store_n(&task->running, true, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+/**
+ * @brief 処理するタスクを取得する
+ * 自分の両端キューが空の場合は他のワーカーから盗む
+ * @param[IN] walker ワーカー
+ * @return タスク、見つからなかった場合NULL
+ */
+static struct dir_task *take_task(struct walker *walker) {
+  struct dir_task *task = pop_task(&walker->deque);
+  int i;
+  for (i = 1; task == NULL && i <= walk.num; i++) {
+    task = steal_task(&walk.walkers[(walker->index + i) % (walk.num + 1)].deque);
+    if (task != NULL) {
+      walker->steals++;
+    }
+  }
+  if (task != NULL) {
+    __atomic_sub_fetch(&walk.queued, 1, __ATOMIC_SEQ_CST);
+  }
+  return task;
+}
+
+/**
+ * @brief 両端キューから指定したタスクを取り除く
+ * @param[IN] deque 両端キュー
+ * @param[IN] task  タスク
+ * @return 取り除いた場合true、含まれていなかった場合false
+ */
+static bool remove_task(struct task_deque *deque, struct dir_task *task) {
+  bool found = false;
+  size_t i;
+  pthread_mutex_lock(&deque->mutex);
+  /* 出力を待っているタスクは末尾付近にあることが多いため末尾から探す */
+  for (i = deque->tail; i-- > deque->head;) {
+    if (deque->array[i] == task) {
+      memmove(deque->array + i, deque->array + i + 1,
+              sizeof(struct dir_task *) * (deque->tail - i - 1));
+      deque->tail--;
+      __atomic_store_n(&task->running, true, __ATOMIC_SEQ_CST);
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return found;
+}
+
+/**
+ * @brief 単調増加する時刻を取得する
+ * @return ナノ秒単位の時刻
+ */
+static long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * @brief 出力待ちのメモリ量を増減する
+ * @param[IN] size 増減する量
+ */
+static void add_buffered(long size) {
+  size_t buffered = __atomic_add_fetch(&walk.buffered, size, __ATOMIC_SEQ_CST);
+  size_t max = __atomic_load_n(&walk.buffered_max, __ATOMIC_RELAXED);
+  while (buffered > max
+      && !__atomic_compare_exchange_n(&walk.buffered_max, &max, buffered, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/**
+ * @brief 出力待ちのメモリ量が上限を下回るまで待つ
+ * ワーカーは新しいディレクトリに取り掛かる前にこれを呼び出す。
+ * 出力が待っているタスクはメインスレッドが自ら処理するため、全員が待っても停止しない。
+ */
+static void wait_for_space(void) {
+  if (__atomic_load_n(&walk.buffered, __ATOMIC_SEQ_CST) < walk_buffer_size) {
+    return;
+  }
+  long start = now_ns();
+  pthread_mutex_lock(&walk.mutex);
+  __atomic_add_fetch(&walk.stalled, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&walk.buffered, __ATOMIC_SEQ_CST) >= walk_buffer_size
+      && !walk.finished) {
+    pthread_cond_wait(&walk.space, &walk.mutex);
+  }
+  __atomic_sub_fetch(&walk.stalled, 1, __ATOMIC_SEQ_CST);
+  walk.stall_ns += now_ns() - start;
+  pthread_mutex_unlock(&walk.mutex);
+}
+
+/**
+ * @brief struct dir_taskのファクトリーメソッド
+ * @param[IN] dir    処理するディレクトリ
+ * @param[IN] parent 親ディレクトリのタスク
+ * @return struct dir_taskへのポインタ
+ */
+static struct dir_task *new_dir_task(struct dir_path *dir, struct dir_task *parent) {
+  struct dir_task *task = xmalloc(sizeof(struct dir_task));
+  task->dir = dir;
+  task->deque = NULL;
+  task->parent = parent;
+  task->child = NULL;
+  task->sibling = NULL;
+  task->text = NULL;
+  task->len = 0;
+  task->size = 0;
+  task->error = NULL;
+  task->error_len = 0;
+  task->running = false;
+  task->done = false;
+  task->skip = false;
+  return task;
+}
+
+/**
+ * @brief 1つのディレクトリを表示内容へ変換し、サブディレクトリをタスクとして追加する
+ * サブディレクトリは表示順の先頭から処理されるよう逆順に両端キューへ積む。
+ * メインスレッドが処理する場合は出力待ちのものがないため、直接出力バッファへ書き込む。
+ *
+ * @param[IN] walker ワーカー
+ * @param[IN] task   タスク
+ */
+static void run_task(struct walker *walker, struct dir_task *task) {
+  struct dir_path *dir = task->dir;
+  struct dir_path *sub;
+  struct dir_task **children = NULL;
+  struct dir_task **link = &task->child;
+  long count = 0;
+  long i;
+  dir->next = NULL;
+  if (__atomic_load_n(&task->skip, __ATOMIC_SEQ_CST)) {
+    /* 表示しないことが決まったものは読み出さない */
+    release_dir_fd(dir->parent);
+  } else {
+    list_dir(dir);
+  }
+  if (out_capture) {
+    /* 出力待ちの間は使用分だけを保持する */
+    if (out.used == 0) {
+      free(out.buf);
+      out.buf = NULL;
+    } else if (out.used < out.size) {
+      out.buf = xrealloc(out.buf, out.used);
+    }
+    add_buffered((long)out.used - (long)out.size);
+    task->text = out.buf;
+    task->len = out.used;
+    task->size = out.used;
+    out.buf = NULL;
+    out.size = 0;
+    out.used = 0;
+    task->error = err_out.buf;
+    task->error_len = err_out.used;
+    err_out.buf = NULL;
+    err_out.size = 0;
+    err_out.used = 0;
+  }
+  for (sub = dir->next; sub != NULL; sub = sub->next) {
+    *link = new_dir_task(sub, task);
+    link = &(*link)->sibling;
+    count++;
+  }
+  walker->tasks++;
+  if (count != 0) {
+    struct dir_task *child;
+    children = xmalloc(sizeof(struct dir_task *) * count);
+    for (i = 0, child = task->child; child != NULL; child = child->sibling) {
+      children[i++] = child;
+    }
+    __atomic_add_fetch(&walk.outstanding, count, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&walk.queued, count, __ATOMIC_SEQ_CST);
+    for (i = count - 1; i >= 0; i--) {
+      push_task(&walker->deque, children[i]);
+    }
+    free(children);
+    if (__atomic_load_n(&walk.sleepers, __ATOMIC_SEQ_CST) != 0) {
+      pthread_mutex_lock(&walk.mutex);
+      pthread_cond_broadcast(&walk.work);
+      pthread_mutex_unlock(&walk.mutex);
+    }
+  }
+  pthread_mutex_lock(&walk.mutex);
+  __atomic_store_n(&task->done, true, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&walk.done);
+  if (__atomic_sub_fetch(&walk.outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+    walk.finished = true;
+    pthread_cond_broadcast(&walk.work);
+  }
+  pthread_mutex_unlock(&walk.mutex);
+}
+
+/**
+ * @brief 並列な再帰表示でタスクを処理するスレッドの情報取得の手段を用意する
+ * io_uringはスレッドごとにリングを作り、情報取得のスレッドは指定された数をワーカーで分け合う。
+ */
+static void init_walker_stat(void) {
+  if (use_uring) {
+    walker_uring = new_uring();
+  }
+  if (walker_uring == NULL && stat_threads / walk.num > 1) {
+    walker_pool = new_stat_pool(stat_threads / walk.num);
+  }
+}
+
+/**
+ * @brief 並列な再帰表示のワーカースレッド
+ * 出力、キャッシュ、アリーナはスレッドごとに持つ
+ *
+ * @param[IN] arg struct walker
+ * @return NULL
+ */
+static void *walk_worker(void *arg) {
+  struct walker *walker = arg;
+  out_capture = true;
+  init_walker_stat();
+  for (;;) {
+    wait_for_space();
+    struct dir_task *task = take_task(walker);
+    if (task != NULL) {
+      run_task(walker, task);
+      continue;
+    }
+    pthread_mutex_lock(&walk.mutex);
+    __atomic_add_fetch(&walk.sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&walk.queued, __ATOMIC_SEQ_CST) == 0 && !walk.finished) {
+      pthread_cond_wait(&walk.work, &walk.mutex);
+    }
+    __atomic_sub_fetch(&walk.sleepers, 1, __ATOMIC_SEQ_CST);
+    bool finished = walk.finished;
+    pthread_mutex_unlock(&walk.mutex);
+    if (finished) {
+      break;
+    }
+  }
+  walker->user_cache = user_cache;
+  walker->group_cache = group_cache;
+  return NULL;
+}
+
+/**
+ * @brief タスクを出力するかを逐次処理と同じ順序で表示済みの記録と照合して決める
+ * 表示済みの記録には実際に出力するものだけを加え、先に現れたものを表示する。
+ * 表示しない場合は子のタスクも表示しないものとし、処理前であれば読み出しを省く。
+ *
+ * @param[IN] task 処理が完了したタスク
+ * @retval true  出力する
+ * @retval false 出力しない
+ */
+static bool check_task(struct dir_task *task) {
+  char path[PATH_MAX + 1];
+  struct dir_path *dir = task->dir;
+  struct dir_task *child;
+  bool listed = !task->skip;
+  if (listed && !dir->checked && dir->has_ino && !visit_dir(dir->dev, dir->ino) && dir->depth != 0) {
+    build_dir_path(dir, path);
+    fprintf(stderr, "%s: not listing already-listed directory\n", path);
+    listed = false;
+  }
+  if (!listed) {
+    for (child = task->child; child != NULL; child = child->sibling) {
+      __atomic_store_n(&child->skip, true, __ATOMIC_SEQ_CST);
+    }
+  }
+  release_dir_path(dir);
+  task->dir = NULL;
+  return listed;
+}
+
+/**
+ * @brief タスクの表示内容を出力し、溜めたエラーメッセージを出力した位置へ挟む
+ * 端末の場合は逐次処理と同様に、エラーメッセージより前の表示内容を先に書き出す。
+ *
+ * @param[IN] task 処理が完了したタスク
+ */
+static void write_task_output(const struct dir_task *task) {
+  size_t pos = 0;
+  size_t i = 0;
+  while (i < task->error_len) {
+    const char *message = task->error + i + sizeof(size_t);
+    size_t at;
+    memcpy(&at, task->error + i, sizeof(size_t));
+    if (at > pos) {
+      out_write(task->text + pos, at - pos);
+      pos = at;
+    }
+    if (out_interactive) {
+      out_flush();
+    }
+    fputs(message, stderr);
+    i += sizeof(size_t) + strlen(message) + 1;
+  }
+  if (task->len > pos) {
+    out_write(task->text + pos, task->len - pos);
+  }
+}
+
+/**
+ * @brief タスクの木を前順に辿り、逐次処理と同じ順序で表示内容を出力する
+ * 処理が終わっていないタスクに到達した場合、まだ誰も取り掛かっていなければ自ら処理し、
+ * 処理中であれば完了を待つ。出力したタスクの分だけ出力待ちのメモリ量を減らす。
+ *
+ * @param[IN] task 先頭のタスク
+ */
+static void emit_tasks(struct dir_task *task) {
+  struct walker *self = &walk.walkers[walk.num];
+  while (task != NULL) {
+    if (!__atomic_load_n(&task->done, __ATOMIC_SEQ_CST)
+        && !__atomic_load_n(&task->running, __ATOMIC_SEQ_CST)) {
+      if (remove_task(task->deque, task)) {
+        __atomic_sub_fetch(&walk.queued, 1, __ATOMIC_SEQ_CST);
+        run_task(self, task);
+      }
+    }
+    pthread_mutex_lock(&walk.mutex);
+    if (!task->done) {
+      long start = now_ns();
+      while (!task->done) {
+        pthread_cond_wait(&walk.done, &walk.mutex);
+      }
+      walk.emit_wait_ns += now_ns() - start;
+    }
+    pthread_mutex_unlock(&walk.mutex);
+    bool listed = check_task(task);
+    if (listed) {
+      write_task_output(task);
+    }
+    free(task->error);
+    task->error = NULL;
+    if (task->text != NULL) {
+      free(task->text);
+      task->text = NULL;
+      add_buffered(-(long)task->size);
+      if (__atomic_load_n(&walk.stalled, __ATOMIC_SEQ_CST) != 0) {
+        pthread_mutex_lock(&walk.mutex);
+        pthread_cond_broadcast(&walk.space);
+        pthread_mutex_unlock(&walk.mutex);
+      }
+    }
+    if (out_interactive) {
+      out_flush();
+    }
+    if (task->child != NULL) {
+      task = task->child;
+      continue;
+    }
+    /* 子孫を出力し終えたタスクを解放しながら次の兄弟まで戻る */
+    while (task != NULL && task->sibling == NULL) {
+      struct dir_task *parent = task->parent;
+      free(task);
+      task = parent;
+    }
+    if (task != NULL) {
+      struct dir_task *sibling = task->sibling;
+      free(task);
+      task = sibling;
+    }
+  }
+}
+
+/**
+ * @brief 再帰的な表示を複数のワーカースレッドで行う
+ * 各ワーカーは両端キューからディレクトリを取り出して処理し、
+ * 空になった場合は他のワーカーから盗む。
+ * メインスレッドは処理結果を逐次処理と同じ順序で出力する。
+ *
+ * @param[IN] head 引数で指定されたディレクトリのリスト
+ */
+static void walk_parallel(struct dir_path *head) {
+  struct dir_task *first = NULL;
+  struct dir_task **link = &first;
+  struct dir_task **roots;
+  struct dir_task *task;
+  long count = 0;
+  long i;
+  walk.num = walk_threads;
+  walk.walkers = xmalloc(sizeof(struct walker) * (walk.num + 1));
+  memset(walk.walkers, 0, sizeof(struct walker) * (walk.num + 1));
+  pthread_mutex_init(&walk.mutex, NULL);
+  pthread_cond_init(&walk.work, NULL);
+  pthread_cond_init(&walk.done, NULL);
+  pthread_cond_init(&walk.space, NULL);
+  while (head != NULL) {
+    struct dir_path *next = head->next;
+    *link = new_dir_task(head, NULL);
+    link = &(*link)->sibling;
+    head = next;
+    count++;
+  }
+  roots = xmalloc(sizeof(struct dir_task *) * count);
+  for (i = 0, task = first; task != NULL; task = task->sibling) {
+    roots[i++] = task;
+  }
+  walk.outstanding = count;
+  walk.queued = count;
+  for (i = 0; i <= walk.num; i++) {
+    struct walker *walker = &walk.walkers[i];
+    walker->index = i;
+    pthread_mutex_init(&walker->deque.mutex, NULL);
+  }
+  for (i = count - 1; i >= 0; i--) {
+    push_task(&walk.walkers[0].deque, roots[i]);
+  }
+  free(roots);
+  for (i = 0; i < walk.num; i++) {
+    int err = pthread_create(&walk.walkers[i].thread, NULL, walk_worker, &walk.walkers[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+  init_walker_stat();
+  emit_tasks(first);
+  pthread_mutex_lock(&walk.mutex);
+  pthread_cond_broadcast(&walk.space);
+  pthread_mutex_unlock(&walk.mutex);
+  for (i = 0; i < walk.num; i++) {
+    pthread_join(walk.walkers[i].thread, NULL);
+  }
+}
+
+/**
+ * @brief スナップショットファイルの作成を開始する
+ * 作成中は一時ファイルへ書き込み、完了時に指定パスへrenameする。
+ *
+ * @param[IN] path 保存先のパス
+ * @retval true  成功
+ * @retval false 失敗
+ */
+static bool begin_snapshot(const char *path) {
+  struct snapshot_writer *writer = xmalloc(sizeof(struct snapshot_writer));
+  size_t len = strlen(path);
+  memset(writer, 0, sizeof(struct snapshot_writer));
+  writer->path = xmalloc(len + 1);
+  memcpy(writer->path, path, len + 1);
+  writer->tmp_path = xmalloc(len + 5);
+  memcpy(writer->tmp_path, path, len);
+  memcpy(writer->tmp_path + len, ".tmp", 5);
+  writer->file = fopen(writer->tmp_path, "w");
+  writer->strings = tmpfile();
+  if (writer->file == NULL || writer->strings == NULL) {
+    perror(writer->file == NULL ? writer->tmp_path : "tmpfile");
+    if (writer->file != NULL) {
+      fclose(writer->file);
+      unlink(writer->tmp_path);
+    }
+    return false;
+  }
+  setvbuf(writer->file, NULL, _IOFBF, SNAPSHOT_BUF_SIZE);
+  setvbuf(writer->strings, NULL, _IOFBF, SNAPSHOT_BUF_SIZE);
+  memcpy(writer->header.magic, SNAPSHOT_MAGIC, sizeof(writer->header.magic));
+  writer->header.version = SNAPSHOT_VERSION;
+  writer->header.entry_size = sizeof(struct snapshot_entry);
+  writer->header.dir_size = sizeof(struct snapshot_dir);
+  writer->header.filter = filter;
+  writer->header.time = time(NULL);
+  writer->header.entry_offset = sizeof(struct snapshot_header);
+  /* 先頭の空文字列をオフセット0とし、文字列がないことを示す */
+  fputc('\0', writer->strings);
+  writer->header.string_size = 1;
+  fseek(writer->file, writer->header.entry_offset, SEEK_SET);
+  snapshot_out = writer;
+  return true;
+}
+
+/**
+ * @brief スナップショットファイルの文字列表へ文字列を追加する
+ * @param[IN] str 文字列
+ * @return 文字列表の先頭からのオフセット
+ */
+static uint64_t add_snapshot_string(const char *str) {
+  struct snapshot_writer *writer = snapshot_out;
+  uint64_t offset = writer->header.string_size;
+  size_t len = strlen(str) + 1;
+  fwrite(str, 1, len, writer->strings);
+  writer->header.string_size += len;
+  return offset;
+}
+
+/**
+ * @brief スナップショットファイルへディレクトリを追加する
+ * 以降に追加したエントリはこのディレクトリのものとなる。
+ *
+ * @param[IN] path  ディレクトリのパス
+ * @param[IN] depth 深さ
+ * @param[IN] error 開けなかった場合のerrno、開けた場合は0
+ * @param[IN] st    ディレクトリ自身の情報、取得できなかった場合NULL
+ */
+static void add_snapshot_dir(const char *path, int depth, int error, const struct stat *st) {
+  struct snapshot_writer *writer = snapshot_out;
+  struct snapshot_dir *dir;
+  if (writer->header.dir_num == writer->dir_size) {
+    writer->dir_size = writer->dir_size == 0 ? 64 : writer->dir_size * 2;
+    writer->dirs = xrealloc(writer->dirs, sizeof(struct snapshot_dir) * writer->dir_size);
+  }
+  dir = &writer->dirs[writer->header.dir_num++];
+  memset(dir, 0, sizeof(struct snapshot_dir));
+  dir->path = add_snapshot_string(path);
+  dir->first = writer->header.entry_num;
+  dir->count = 0;
+  dir->depth = depth;
+  dir->error = error;
+  if (st != NULL) {
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    dir->mtime_sec = st->st_mtim.tv_sec;
+    dir->mtime_nsec = st->st_mtim.tv_nsec;
+    dir->ctime_sec = st->st_ctim.tv_sec;
+    dir->ctime_nsec = st->st_ctim.tv_nsec;
+  }
+}
+
+/**
+ * @brief スナップショットファイルへ最後に追加したディレクトリのエントリを追加する
+ * @param[IN] info エントリ情報
+ */
+static void add_snapshot_info(const struct info *info) {
+  struct snapshot_writer *writer = snapshot_out;
+  struct snapshot_entry entry;
+  memset(&entry, 0, sizeof(struct snapshot_entry));
+  entry.name = add_snapshot_string(info->name);
+  entry.link = info->link != NULL ? add_snapshot_string(info->link) : 0;
+  entry.size = info->size;
+  entry.rdev = info->rdev;
+  entry.mtime = info->mtime;
+  entry.mode = info->mode;
+  entry.link_mode = info->link_mode;
+  entry.uid = info->uid;
+  entry.gid = info->gid;
+  entry.nlink = info->nlink;
+  entry.link_ok = info->link_ok;
+  fwrite(&entry, sizeof(struct snapshot_entry), 1, writer->file);
+  writer->header.entry_num++;
+  writer->dirs[writer->header.dir_num - 1].count++;
+}
+
+/**
+ * @brief スナップショットファイルの作成を完了する
+ * エントリに続けて文字列表とディレクトリを書き込み、最後にヘッダを書き込む。
+ *
+ * @retval true  成功
+ * @retval false 失敗
+ */
+static bool finish_snapshot(void) {
+  struct snapshot_writer *writer = snapshot_out;
+  struct snapshot_header *header = &writer->header;
+  char buf[64 * 1024];
+  size_t len;
+  size_t pad;
+  bool ok;
+  header->string_offset = header->entry_offset
+      + header->entry_num * sizeof(struct snapshot_entry);
+  rewind(writer->strings);
+  while ((len = fread(buf, 1, sizeof(buf), writer->strings)) != 0) {
+    fwrite(buf, 1, len, writer->file);
+  }
+  pad = (8 - header->string_size % 8) % 8;
+  memset(buf, 0, pad);
+  fwrite(buf, 1, pad, writer->file);
+  header->dir_offset = header->string_offset + header->string_size + pad;
+  fwrite(writer->dirs, sizeof(struct snapshot_dir), header->dir_num, writer->file);
+  fseek(writer->file, 0, SEEK_SET);
+  fwrite(header, sizeof(struct snapshot_header), 1, writer->file);
+  ok = !ferror(writer->strings) && !ferror(writer->file);
+  ok = fclose(writer->file) == 0 && ok;
+  fclose(writer->strings);
+  if (ok && rename(writer->tmp_path, writer->path) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    perror(writer->path);
+    unlink(writer->tmp_path);
+  }
+  free(writer->dirs);
+  free(writer->tmp_path);
+  free(writer->path);
+  free(writer);
+  snapshot_out = NULL;
+  return ok;
+}
+
+/**
+ * @brief スナップショットファイルをmmapし、ヘッダの内容が領域に収まるか確認する
+ * 個々のエントリとディレクトリが持つオフセットは表示時に確認する。
+ *
+ * @param[IN]  path スナップショットファイルのパス
+ * @param[OUT] snap 格納先
+ * @retval true  成功
+ * @retval false 失敗
+ */
+static bool open_snapshot(const char *path, struct snapshot *snap) {
+  const struct snapshot_header *header;
+  struct stat st;
+  size_t size;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  size = st.st_size;
+  if (size < sizeof(struct snapshot_header)) {
+    close(fd);
+    fprintf(stderr, "%s: not a snapshot file\n", path);
+    return false;
+  }
+  snap->base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (snap->base == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  madvise((void *)snap->base, size, MADV_SEQUENTIAL);
+  header = (const struct snapshot_header *)snap->base;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+      || header->version != SNAPSHOT_VERSION
+      || header->entry_size != sizeof(struct snapshot_entry)
+      || header->dir_size != sizeof(struct snapshot_dir)) {
+    fprintf(stderr, "%s: not a snapshot file\n", path);
+    munmap((void *)snap->base, size);
+    return false;
+  }
+  if (header->entry_offset % 8 != 0 || header->entry_offset > size
+      || header->entry_num > (size - header->entry_offset) / sizeof(struct snapshot_entry)
+      || header->string_offset > size
+      || header->string_size == 0
+      || header->string_size > size - header->string_offset
+      || snap->base[header->string_offset + header->string_size - 1] != '\0'
+      || header->dir_offset % 8 != 0 || header->dir_offset > size
+      || header->dir_num > (size - header->dir_offset) / sizeof(struct snapshot_dir)) {
+    fprintf(stderr, "%s: broken snapshot file\n", path);
+    munmap((void *)snap->base, size);
+    return false;
+  }
+  snap->path = path;
+  snap->size = size;
+  snap->header = header;
+  snap->entries = (const struct snapshot_entry *)(snap->base + header->entry_offset);
+  snap->strings = snap->base + header->string_offset;
+  snap->dirs = (const struct snapshot_dir *)(snap->base + header->dir_offset);
+  return true;
+}
+
+/**
+ * @brief スナップショットファイルのディレクトリが持つオフセットが領域に収まるか確認する
+ * @param[IN] snap mmapしたスナップショットファイル
+ * @param[IN] dir  確認するディレクトリ
+ * @retval true  正常
+ * @retval false 壊れている
+ */
+static bool check_snapshot_dir(const struct snapshot *snap, const struct snapshot_dir *dir) {
+  const struct snapshot_header *header = snap->header;
+  uint64_t i;
+  if (dir->path >= header->string_size
+      || dir->first > header->entry_num
+      || dir->count > header->entry_num - dir->first) {
+    return false;
+  }
+  for (i = 0; i < dir->count; i++) {
+    const struct snapshot_entry *entry = &snap->entries[dir->first + i];
+    if (entry->name >= header->string_size || entry->link >= header->string_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief スナップショットファイルのエントリをstruct infoとして展開する
+ * 文字列はmmapした領域を直接指す。
+ *
+ * @param[IN]  snap  mmapしたスナップショットファイル
+ * @param[IN]  entry 確認済みのエントリ
+ * @param[OUT] info  格納先
+ */
+static void view_snapshot_entry(const struct snapshot *snap, const struct snapshot_entry *entry, struct info *info) {
+  info->name = snap->strings + entry->name;
+  info->link = entry->link != 0 ? snap->strings + entry->link : NULL;
+  info->size = entry->size;
+  info->rdev = entry->rdev;
+  info->mtime = entry->mtime;
+  info->mode = entry->mode;
+  info->link_mode = entry->link_mode;
+  info->uid = entry->uid;
+  info->gid = entry->gid;
+  info->nlink = entry->nlink;
+  info->error = 0;
+  info->link_ok = entry->link_ok;
+  info->dev = 0;
+  info->ino = 0;
+}
+
+/**
+ * @brief スナップショットファイルの内容を表示する
+ * エントリはスタック上のstruct infoへ文字列表を指すポインタとして展開し、print_infoで表示する。
+ * ファイルシステムへはアクセスしない。
+ *
+ * @param[IN] snap mmapしたスナップショットファイル
+ * @retval true  成功
+ * @retval false 内容が壊れていた
+ */
+static bool render_snapshot(const struct snapshot *snap) {
+  const struct snapshot_header *header = snap->header;
+  uint64_t i;
+  uint64_t j;
+  for (i = 0; i < header->dir_num; i++) {
+    const struct snapshot_dir *dir = &snap->dirs[i];
+    const char *path;
+    if (!check_snapshot_dir(snap, dir)) {
+      flush_before_error();
+      fprintf(stderr, "%s: broken snapshot file\n", snap->path);
+      return false;
+    }
+    path = snap->strings + dir->path;
+    if (dir->depth != 0) {
+      print_dir_header(path);
+    }
+    if (dir->error != 0) {
+      flush_before_error();
+      fprintf(stderr, "%s: %s\n", path, strerror(dir->error));
+    }
+    for (j = 0; j < dir->count; j++) {
+      struct info info;
+      view_snapshot_entry(snap, &snap->entries[dir->first + j], &info);
+      print_info(&info);
+    }
+    if (out_interactive) {
+      out_flush();
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief パスのハッシュ値を求める
+ * FNV-1aによる
+ *
+ * @param[IN] path パス
+ * @return ハッシュ値
+ */
+static size_t hash_path(const char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *path != '\0'; path++) {
+    hash ^= (unsigned char)*path;
+    hash *= 1099511628211ULL;
+  }
+  return (size_t)hash;
+}
+
+/**
+ * @brief スナップショットファイルのディレクトリをパスから引くハッシュテーブルを作成する
+ * オープンアドレス法で、ディレクトリのインデックスに1を足した値を格納し、0を空きとする。
+ * パスが壊れているディレクトリは登録しない。
+ *
+ * @param[IN/OUT] snap mmapしたスナップショットファイル
+ */
+static void index_snapshot(struct snapshot *snap) {
+  const struct snapshot_header *header = snap->header;
+  uint64_t i;
+  snap->index_size = 64;
+  while (snap->index_size < header->dir_num * 2) {
+    snap->index_size *= 2;
+  }
+  snap->index = xmalloc(sizeof(uint64_t) * snap->index_size);
+  memset(snap->index, 0, sizeof(uint64_t) * snap->index_size);
+  for (i = 0; i < header->dir_num; i++) {
+    size_t mask = snap->index_size - 1;
+    size_t pos;
+    if (snap->dirs[i].path >= header->string_size) {
+      continue;
+    }
+    pos = hash_path(snap->strings + snap->dirs[i].path) & mask;
+    while (snap->index[pos] != 0) {
+      pos = (pos + 1) & mask;
+    }
+    snap->index[pos] = i + 1;
+  }
+}
+
+/**
+ * @brief 変更のないディレクトリのスナップショットファイル上の記録を探す
+ * (dev, ino)と更新時刻、変更時刻が記録と一致し、
+ * かつそれらがスナップショットファイルの作成開始より前である場合に変更がないとみなす。
+ * 作成開始と同じ秒以降の時刻は、記録した後に同じ時刻のまま変更された可能性があるため使わない。
+ *
+ * @param[IN] path ディレクトリのパス
+ * @param[IN] st   ディレクトリ自身の情報
+ * @return 再利用できるディレクトリ、できない場合NULL
+ */
+static const struct snapshot_dir *find_cached_dir(const char *path, const struct stat *st) {
+  const struct snapshot *snap = snapshot_in;
+  size_t mask = snap->index_size - 1;
+  size_t pos = hash_path(path) & mask;
+  for (; snap->index[pos] != 0; pos = (pos + 1) & mask) {
+    const struct snapshot_dir *dir = &snap->dirs[snap->index[pos] - 1];
+    if (strcmp(snap->strings + dir->path, path) != 0) {
+      continue;
+    }
+    if (dir->error == 0 && dir->ino != 0
+        && dir->dev == (uint64_t)st->st_dev && dir->ino == (uint64_t)st->st_ino
+        && dir->mtime_sec == st->st_mtim.tv_sec && dir->mtime_nsec == st->st_mtim.tv_nsec
+        && dir->ctime_sec == st->st_ctim.tv_sec && dir->ctime_nsec == st->st_ctim.tv_nsec
+        && dir->mtime_sec < snap->header->time && dir->ctime_sec < snap->header->time
+        && check_snapshot_dir(snap, dir)) {
+      __atomic_add_fetch(&snapshot_hits, 1, __ATOMIC_RELAXED);
+      return dir;
+    }
+    break;
+  }
+  __atomic_add_fetch(&snapshot_misses, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/**
+ * @brief 変更のないディレクトリのエントリをスナップショットファイルから追加する
+ * 名前の一覧のみを再利用し、各エントリの情報は取得し直す。
+ * ディレクトリの更新時刻はエントリ自身の変更では更新されないためである。
+ * --trust-snapshotが指定された場合は記録された情報をそのまま使う。
+ *
+ * @param[IN/OUT] list 追加先
+ * @param[IN]     dir  再利用するディレクトリ
+ * @param[IN]     ring io_uringのリング、使わない場合NULL
+ * @param[IN]     pool ワーカースレッド、使わない場合NULL
+ * @param[IN]     fd   処理中のディレクトリのfd
+ * @param[IN]     path 処理中のディレクトリのパス、'/'で終わる
+ */
+static void add_cached_entries(struct info_list *list, const struct snapshot_dir *dir, struct uring *ring, struct stat_pool *pool, int fd, const char *path) {
+  const struct snapshot *snap = snapshot_in;
+  uint64_t i;
+  for (i = 0; i < dir->count; i++) {
+    const struct snapshot_entry *entry = &snap->entries[dir->first + i];
+    if (is_excluded(snap->strings + entry->name)) {
+      continue;
+    }
+    if (trust_snapshot) {
+      struct info *info = arena_alloc(list->arena, sizeof(struct info), _Alignof(struct info));
+      view_snapshot_entry(snap, entry, info);
+      add_info(list, info);
+    } else {
+      add_entry(list, ring, pool, fd, snap->strings + entry->name, IFTODT(entry->mode), path);
+    }
+  }
+}
+
+/**
+ * @brief ディレクトリのパスと名前を連結する
+ * ディレクトリのパスが'/'で終わる場合は区切りを重ねない。
+ *
+ * @param[OUT] buf  格納先、PATH_MAX + 1バイト以上
+ * @param[IN]  dir  ディレクトリのパス
+ * @param[IN]  name 名前
+ * @return 連結したパスの長さ、PATH_MAXを超える場合はPATH_MAX + 1
+ */
+static size_t join_path(char *buf, const char *dir, const char *name) {
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  bool slash = dir_len != 0 && dir[dir_len - 1] != '/';
+  if (dir_len + slash + name_len > PATH_MAX) {
+    buf[0] = '\0';
+    return PATH_MAX + 1;
+  }
+  memcpy(buf, dir, dir_len);
+  if (slash) {
+    buf[dir_len] = '/';
+  }
+  memcpy(buf + dir_len + slash, name, name_len + 1);
+  return dir_len + slash + name_len;
+}
+
+/**
+ * @brief 問い合わせの照合のため、パス末尾の'/'を取り除く
+ * @param[IN/OUT] path パス
+ */
+static void normalize_path(char *path) {
+  size_t len = strlen(path);
+  while (len > 1 && path[len - 1] == '/') {
+    len--;
+    path[len] = '\0';
+  }
+}
+
+/**
+ * @brief 監視しているディレクトリをパスから探す
+ * @param[IN] path 末尾の'/'を取り除いたパス
+ * @return 見つかったディレクトリ、見つからない場合NULL
+ */
+static struct watch_dir *find_watch_dir(const char *path) {
+  struct watch_dir *dir;
+  if (watch.bucket_size == 0) {
+    return NULL;
+  }
+  dir = watch.buckets[hash_path(path) & (watch.bucket_size - 1)];
+  for (; dir != NULL; dir = dir->hash_next) {
+    if (strcmp(dir->path, path) == 0) {
+      return dir;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief 監視しているディレクトリをパスのハッシュテーブルへ登録する
+ * 登録数がバケット数を超える場合はバケット数を倍にする。
+ *
+ * @param[IN] dir 登録するディレクトリ
+ */
+static void add_watch_hash(struct watch_dir *dir) {
+  size_t pos;
+  if (watch.count + 1 > watch.bucket_size) {
+    size_t size = watch.bucket_size == 0 ? WATCH_HASH_INITIAL_SIZE : watch.bucket_size * 2;
+    struct watch_dir **buckets = xmalloc(sizeof(struct watch_dir *) * size);
+    size_t i;
+    memset(buckets, 0, sizeof(struct watch_dir *) * size);
+    for (i = 0; i < watch.bucket_size; i++) {
+      struct watch_dir *entry = watch.buckets[i];
+      while (entry != NULL) {
+        struct watch_dir *next = entry->hash_next;
+        pos = hash_path(entry->path) & (size - 1);
+        entry->hash_next = buckets[pos];
+        buckets[pos] = entry;
+        entry = next;
+      }
+    }
+    free(watch.buckets);
+    watch.buckets = buckets;
+    watch.bucket_size = size;
+  }
+  pos = hash_path(dir->path) & (watch.bucket_size - 1);
+  dir->hash_next = watch.buckets[pos];
+  watch.buckets[pos] = dir;
+  watch.count++;
+}
+
+/**
+ * @brief 監視しているディレクトリをパスのハッシュテーブルから外す
+ * @param[IN] dir 外すディレクトリ
+ */
+static void remove_watch_hash(struct watch_dir *dir) {
+  struct watch_dir **link = &watch.buckets[hash_path(dir->path) & (watch.bucket_size - 1)];
+  while (*link != dir) {
+    link = &(*link)->hash_next;
+  }
+  *link = dir->hash_next;
+  watch.count--;
+}
+
+/**
+ * @brief エントリが読み込み時にまとめて格納した領域にあるかを判定する
+ * @param[IN] dir  ディレクトリ
+ * @param[IN] info エントリ
+ * @retval true  まとめて格納した領域にある
+ * @retval false 個別に確保した
+ */
+static bool is_packed(const struct watch_dir *dir, const struct info *info) {
+  uintptr_t p = (uintptr_t)info;
+  return p >= (uintptr_t)dir->block && p < (uintptr_t)dir->block + dir->block_size;
+}
+
+/**
+ * @brief エントリと文字列を1つの領域へまとめて格納し直す
+ * 読み込み直後のアリーナ上のエントリと、更新で個別に確保したエントリのどちらにも使う。
+ * 個別に確保したエントリと以前の領域は解放する。
+ *
+ * @param[IN/OUT] dir   ディレクトリ
+ * @param[IN]     owned エントリのうち以前の領域にないものを個別に確保している場合true
+ */
+static void pack_watch_entries(struct watch_dir *dir, bool owned) {
+  size_t size = sizeof(struct info) * dir->used;
+  struct info *infos;
+  char *block;
+  char *str;
+  int i;
+  for (i = 0; i < dir->used; i++) {
+    const struct info *info = dir->entries[i];
+    size += strlen(info->name) + 1;
+    if (info->link != NULL) {
+      size += strlen(info->link) + 1;
+    }
+  }
+  block = xmalloc(size != 0 ? size : 1);
+  infos = (struct info *)block;
+  str = block + sizeof(struct info) * dir->used;
+  for (i = 0; i < dir->used; i++) {
+    struct info *info = dir->entries[i];
+    size_t len = strlen(info->name) + 1;
+    infos[i] = *info;
+    memcpy(str, info->name, len);
+    infos[i].name = str;
+    str += len;
+    if (info->link != NULL) {
+      len = strlen(info->link) + 1;
+      memcpy(str, info->link, len);
+      infos[i].link = str;
+      str += len;
+    }
+    if (owned && !is_packed(dir, info)) {
+      free(info);
+    }
+    dir->entries[i] = &infos[i];
+  }
+  free(dir->block);
+  dir->block = block;
+  dir->block_size = size;
+  dir->garbage = 0;
+}
+
+/**
+ * @brief ディレクトリのエントリをすべて解放する
+ * @param[IN/OUT] dir ディレクトリ
+ */
+static void free_watch_entries(struct watch_dir *dir) {
+  int i;
+  for (i = 0; i < dir->used; i++) {
+    if (!is_packed(dir, dir->entries[i])) {
+      free(dir->entries[i]);
+    }
+  }
+  free(dir->block);
+  dir->block = NULL;
+  dir->block_size = 0;
+  dir->used = 0;
+  dir->garbage = 0;
+}
+
+/**
+ * @brief 更新で追加するエントリを名前、リンク先と合わせて1つの領域に確保する
+ * @param[IN] info 複製元
+ * @return 複製したエントリ
+ */
+static struct info *copy_info(const struct info *info) {
+  size_t name_len = strlen(info->name) + 1;
+  size_t link_len = info->link != NULL ? strlen(info->link) + 1 : 0;
+  struct info *copy = xmalloc(sizeof(struct info) + name_len + link_len);
+  char *str = (char *)(copy + 1);
+  *copy = *info;
+  memcpy(str, info->name, name_len);
+  copy->name = str;
+  if (info->link != NULL) {
+    memcpy(str + name_len, info->link, link_len);
+    copy->link = str + name_len;
+  }
+  return copy;
+}
+
+/**
+ * @brief ディレクトリのエントリを読み込み、表示順に並べて保持する
+ * 情報取得はlist_dirと同じくio_uringやワーカースレッドを使う。
+ *
+ * @param[IN/OUT] dir ディレクトリ
+ * @retval true  成功
+ * @retval false 開けなかった
+ */
+static bool load_watch_dir(struct watch_dir *dir) {
+  char path[PATH_MAX + 1];
+  struct dir_reader reader;
+  struct linux_dirent64 *dent;
+  struct info_list list;
+  struct stat st;
+  struct uring *ring = get_uring();
+  struct stat_pool *pool = ring == NULL ? get_stat_pool() : NULL;
+  if (join_path(path, dir->path, "") > PATH_MAX) {
+    fprintf(stderr, "too long path\n");
+    return false;
+  }
+  if (!open_dir_reader(&reader, AT_FDCWD, dir->path)) {
+    perror(dir->path);
+    return false;
+  }
+  if (fstat(reader.fd, &st) == 0) {
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+  }
+  init_info_list(&list, 100);
+  while ((dent = read_dir_entry(&reader)) != NULL) {
+    if (!is_excluded(dent->d_name)) {
+      add_entry(&list, ring, pool, reader.fd, dent->d_name, dent->d_type, path);
+    }
+    if (ring != NULL && is_batch_end(&reader)) {
+      run_uring_jobs(ring, reader.fd, list.links);
+    }
+  }
+  if (ring != NULL) {
+    run_uring_jobs(ring, reader.fd, list.links);
+    remove_failed_info(&list, path);
+  } else if (pool != NULL) {
+    wait_stat_jobs(pool);
+    remove_failed_info(&list, path);
+  }
+  close_dir_reader(&reader);
+  sort_list(&list);
+  free_watch_entries(dir);
+  if (dir->size < list.used) {
+    dir->size = list.used;
+    dir->entries = xrealloc(dir->entries, sizeof(struct info *) * dir->size);
+  }
+  memcpy(dir->entries, list.array, sizeof(struct info *) * list.used);
+  dir->used = list.used;
+  pack_watch_entries(dir, false);
+  free_info_list(&list);
+  return true;
+}
+
+/**
+ * @brief 監視するディレクトリを作成し、索引と親の子の一覧へ登録する
+ * @param[IN] path   パス
+ * @param[IN] parent 親ディレクトリ、引数で指定されたものはNULL
+ * @return 作成したディレクトリ
+ */
+static struct watch_dir *new_watch_dir(const char *path, struct watch_dir *parent) {
+  struct watch_dir *dir = xmalloc(sizeof(struct watch_dir));
+  size_t len = strlen(path);
+  memset(dir, 0, sizeof(struct watch_dir));
+  dir->path = xmalloc(len + 1);
+  memcpy(dir->path, path, len + 1);
+  normalize_path(dir->path);
+  dir->name = find_filename(dir->path);
+  dir->wd = -1;
+  dir->parent_wd = -1;
+  dir->parent = parent;
+  dir->shallow = parent != NULL && !recursive;
+  if (parent != NULL) {
+    dir->sibling = parent->child;
+    parent->child = dir;
+  }
+  add_watch_hash(dir);
+  return dir;
+}
+
+/**
+ * @brief 監視するディレクトリが祖先と同じディレクトリを指しているかを判定する
+ * 親で読み込んだ自身のエントリの(dev, ino)を使うため、読み込む前に判定できる。
+ * 読み込まない場合も親での入れ替わりを判定できるよう、(dev, ino)を記録しておく。
+ *
+ * @param[IN/OUT] dir ディレクトリ
+ * @retval true  祖先と同じ
+ * @retval false 異なる、もしくは引数で指定されたもの
+ */
+static bool is_watch_cycle(struct watch_dir *dir) {
+  const struct watch_dir *up;
+  const struct info *info;
+  if (dir->parent == NULL || (info = find_watch_entry(dir->parent, dir->name)) == NULL) {
+    return false;
+  }
+  dir->dev = info->dev;
+  dir->ino = info->ino;
+  for (up = dir->parent; up != NULL; up = up->parent) {
+    if (up->ino == dir->ino && up->dev == dir->dev) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief ディレクトリを監視対象に加えて読み込む
+ * 再帰的な表示の場合はサブディレクトリも同様に加え、そうでない場合は1階層だけ監視する。
+ * 読み込み中の変更を取りこぼさないよう、読み込む前にinotifyの監視を開始する。
+ * 同じディレクトリを別のパスで監視済みの場合、inotifyは同じ監視記述子を返すため、
+ * 後から加えたものは更新を反映しない。
+ *
+ * @param[IN] path   パス
+ * @param[IN] parent 親ディレクトリ、引数で指定されたものはNULL
+ * @return 加えたディレクトリ
+ */
+static struct watch_dir *add_watch_tree(const char *path, struct watch_dir *parent) {
+  char sub[PATH_MAX + 1];
+  struct watch_dir *top = new_watch_dir(path, parent);
+  struct watch_dir **stack = xmalloc(sizeof(struct watch_dir *));
+  size_t stack_size = 1;
+  size_t num = 0;
+  stack[num++] = top;
+  while (num != 0) {
+    struct watch_dir *dir = stack[--num];
+    int wd;
+    int i;
+    if (!dir->shallow && is_watch_cycle(dir)) {
+      fprintf(stderr, "%s: not listing already-listed directory\n", dir->path);
+      dir->looping = true;
+      continue;
+    }
+    wd = inotify_add_watch(watch.fd, dir->path, WATCH_MASK);
+    if (wd < 0) {
+      perror(dir->path);
+    } else if (wd >= watch.wd_size || watch.by_wd[wd] == NULL) {
+      if (wd >= watch.wd_size) {
+        int size = watch.wd_size == 0 ? 64 : watch.wd_size;
+        while (size <= wd) {
+          size *= 2;
+        }
+        watch.by_wd = xrealloc(watch.by_wd, sizeof(struct watch_dir *) * size);
+        memset(watch.by_wd + watch.wd_size, 0, sizeof(struct watch_dir *) * (size - watch.wd_size));
+        watch.wd_size = size;
+      }
+      watch.by_wd[wd] = dir;
+      dir->wd = wd;
+    }
+    if (dir->shallow || !load_watch_dir(dir)) {
+      continue;
+    }
+    for (i = dir->used - 1; i >= 0; i--) {
+      const char *name = dir->entries[i]->name;
+      if (!S_ISDIR(dir->entries[i]->mode)
+          || (name[0] == '.' && name[1 + (name[1] == '.')] == '\0')
+          || join_path(sub, dir->path, name) > PATH_MAX) {
+        continue;
+      }
+      if (num == stack_size) {
+        stack_size *= 2;
+        stack = xrealloc(stack, sizeof(struct watch_dir *) * stack_size);
+      }
+      stack[num++] = new_watch_dir(sub, dir);
+    }
+  }
+  free(stack);
+  return top;
+}
+
+/**
+ * @brief ディレクトリとその子孫を監視対象から外して解放する
+ * @param[IN] dir 外すディレクトリ
+ */
+static void remove_watch_tree(struct watch_dir *dir) {
+  struct watch_dir *list = dir;
+  if (dir->parent != NULL) {
+    struct watch_dir **link = &dir->parent->child;
+    while (*link != dir) {
+      link = &(*link)->sibling;
+    }
+    *link = dir->sibling;
+  }
+  dir->sibling = NULL;
+  /* 子の一覧を処理待ちの一覧の先頭へつなぎながら辿る */
+  while (list != NULL) {
+    struct watch_dir *target = list;
+    list = target->sibling;
+    if (target->child != NULL) {
+      struct watch_dir *last = target->child;
+      while (last->sibling != NULL) {
+        last = last->sibling;
+      }
+      last->sibling = list;
+      list = target->child;
+    }
+    if (target->wd >= 0) {
+      inotify_rm_watch(watch.fd, target->wd);
+      watch.by_wd[target->wd] = NULL;
+    }
+    remove_watch_hash(target);
+    free_watch_entries(target);
+    free(target->entries);
+    free(target->path);
+    free(target);
+  }
+}
+
+/**
+ * @brief 引数で指定されたディレクトリの親ディレクトリを監視する
+ * 親のエントリは持たず、親自身の属性の変化を".."へ反映するためだけに使う。
+ * 親を別に監視済みの場合、inotifyは同じ監視記述子を返すため両方へ反映する。
+ *
+ * @param[IN/OUT] root 引数で指定されたディレクトリ
+ */
+static void watch_root_parent(struct watch_dir *root) {
+  char path[PATH_MAX + 1];
+  if (filter != FILTER_ALL || join_path(path, root->path, "..") > PATH_MAX) {
+    return;
+  }
+  root->parent_wd = inotify_add_watch(watch.fd, path, WATCH_MASK);
+  if (root->parent_wd < 0) {
+    perror(path);
+  }
+}
+
+/**
+ * @brief エントリとの表示順での大小を比較する
+ * sort_listと同じく、ディレクトリを先に名前順で並べる。
+ *
+ * @param[IN] info   比較するエントリ
+ * @param[IN] is_dir 比較対象がディレクトリか
+ * @param[IN] name   比較対象の名前
+ * @return infoが前であれば負、同じであれば0、後であれば正
+ */
+static int compare_entry(const struct info *info, bool is_dir, const char *name) {
+  bool info_dir = S_ISDIR(info->mode);
+  if (info_dir != is_dir) {
+    return info_dir ? -1 : 1;
+  }
+  return strcmp(info->name, name);
+}
+
+/**
+ * @brief エントリを挿入する位置を二分探索で求める
+ * @param[IN] dir    ディレクトリ
+ * @param[IN] is_dir 探すエントリがディレクトリか
+ * @param[IN] name   探すエントリの名前
+ * @return 表示順で前にあるエントリの数
+ */
+static int find_entry(const struct watch_dir *dir, bool is_dir, const char *name) {
+  int low = 0;
+  int high = dir->used;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (compare_entry(dir->entries[mid], is_dir, name) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/**
+ * @brief 名前からエントリを探す
+ * @param[IN] dir  ディレクトリ
+ * @param[IN] name エントリの名前
+ * @return 見つかったエントリ、見つからない場合NULL
+ */
+static const struct info *find_watch_entry(const struct watch_dir *dir, const char *name) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    int pos = find_entry(dir, i == 0, name);
+    if (pos < dir->used && compare_entry(dir->entries[pos], i == 0, name) == 0) {
+      return dir->entries[pos];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief 1つのエントリの情報を取得し直して反映する
+ * 取得できなかった場合は削除し、種別が変わった場合は位置を移す。
+ * サブディレクトリの追加、削除、入れ替わりは監視対象へ反映する。
+ * 個別に確保したエントリから外れたものが多くなった場合はまとめて格納し直す。
+ *
+ * @param[IN/OUT] dir  ディレクトリ
+ * @param[IN]     name エントリの名前
+ */
+static void update_entry(struct watch_dir *dir, const char *name) {
+  char path[PATH_MAX + 1];
+  struct info info;
+  bool exists;
+  int pos;
+  int i;
+  if (join_path(path, dir->path, name) > PATH_MAX) {
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    pos = find_entry(dir, i == 0, name);
+    if (pos < dir->used && compare_entry(dir->entries[pos], i == 0, name) == 0) {
+      if (is_packed(dir, dir->entries[pos])) {
+        dir->garbage++;
+      } else {
+        free(dir->entries[pos]);
+      }
+      memmove(&dir->entries[pos], &dir->entries[pos + 1], sizeof(struct info *) * (dir->used - pos - 1));
+      dir->used--;
+      break;
+    }
+  }
+  info.name = name;
+  exists = fill_info(AT_FDCWD, path, &info, DT_UNKNOWN, &link_arena) == 0;
+  if (exists) {
+    if (dir->used == dir->size) {
+      dir->size = dir->size == 0 ? 16 : dir->size * 2;
+      dir->entries = xrealloc(dir->entries, sizeof(struct info *) * dir->size);
+    }
+    pos = find_entry(dir, S_ISDIR(info.mode), name);
+    memmove(&dir->entries[pos + 1], &dir->entries[pos], sizeof(struct info *) * (dir->used - pos));
+    dir->entries[pos] = copy_info(&info);
+    dir->used++;
+  }
+  reset_arena(&link_arena);
+  if (dir->garbage > 16 && dir->garbage > dir->used) {
+    pack_watch_entries(dir, true);
+  }
+  if (!(name[0] == '.' && name[1 + (name[1] == '.')] == '\0')) {
+    struct watch_dir *child = find_watch_dir(path);
+    bool is_dir = exists && S_ISDIR(info.mode);
+    if (child != NULL && child->parent != dir) {
+      child = NULL;
+    }
+    if (child != NULL && (!is_dir || child->ino != info.ino || child->dev != info.dev)) {
+      remove_watch_tree(child);
+      child = NULL;
+    }
+    if (child == NULL && is_dir) {
+      add_watch_tree(path, dir);
+    }
+  }
+}
+
+/**
+ * @brief ディレクトリ自身を指す"."と子の".."を取得し直す
+ * すべて表示する場合のみ一覧に含まれる。
+ *
+ * @param[IN/OUT] dir ディレクトリ
+ */
+static void update_dot_entries(struct watch_dir *dir) {
+  struct watch_dir *child;
+  if (filter != FILTER_ALL) {
+    return;
+  }
+  update_entry(dir, ".");
+  for (child = dir->child; child != NULL; child = child->sibling) {
+    if (!child->shallow && !child->looping) {
+      update_entry(child, "..");
+    }
+  }
+}
+
+/**
+ * @brief ディレクトリ内のシンボリックリンクを取得し直す
+ * 色付けにはリンク先の有無と種別を使うため、同じディレクトリ内のエントリの変更で変わりうる。
+ * 他のディレクトリにあるリンク先の変更は反映しない。
+ *
+ * @param[IN/OUT] dir ディレクトリ
+ */
+static void update_links(struct watch_dir *dir) {
+  char name[PATH_MAX + 1];
+  int i;
+  if (link_stat_mask == 0) {
+    return;
+  }
+  for (i = 0; i < dir->used; i++) {
+    size_t len = strlen(dir->entries[i]->name);
+    if (!S_ISLNK(dir->entries[i]->mode) || len > PATH_MAX) {
+      continue;
+    }
+    /* 更新で元のエントリは解放されるため名前を複製しておく */
+    memcpy(name, dir->entries[i]->name, len + 1);
+    update_entry(dir, name);
+  }
+}
+
+/**
+ * @brief 同じinodeを指す他のハードリンクを取得し直す
+ * リンク数や属性はinodeで共有されるが、inotifyは変更に使ったパスのディレクトリにしか通知しない。
+ * 該当するエントリを探すため保持しているすべてのエントリを走査する。
+ * 監視していないディレクトリにあるリンクの追加、削除は反映しない。
+ *
+ * @param[IN] dir  変更を通知されたディレクトリ
+ * @param[IN] name 変更を通知されたエントリの名前、取得し直さない
+ * @param[IN] dev  デバイス番号
+ * @param[IN] ino  inode番号
+ */
+static void update_hard_links(const struct watch_dir *dir, const char *name, dev_t dev, ino_t ino) {
+  char **paths = NULL;
+  size_t num = 0;
+  size_t size = 0;
+  size_t i;
+  /* 更新で監視対象が変わりうるため、先にディレクトリのパスと名前を集めておく */
+  for (i = 0; i < watch.bucket_size; i++) {
+    const struct watch_dir *target;
+    for (target = watch.buckets[i]; target != NULL; target = target->hash_next) {
+      int j;
+      for (j = 0; j < target->used; j++) {
+        const struct info *info = target->entries[j];
+        size_t path_len;
+        size_t name_len;
+        if (S_ISDIR(info->mode) || info->ino != ino || info->dev != dev
+            || (target == dir && strcmp(info->name, name) == 0)) {
+          continue;
+        }
+        if (num == size) {
+          size = size == 0 ? 4 : size * 2;
+          paths = xrealloc(paths, sizeof(char *) * size);
+        }
+        path_len = strlen(target->path) + 1;
+        name_len = strlen(info->name) + 1;
+        paths[num] = xmalloc(path_len + name_len);
+        memcpy(paths[num], target->path, path_len);
+        memcpy(paths[num] + path_len, info->name, name_len);
+        num++;
+      }
+    }
+  }
+  for (i = 0; i < num; i++) {
+    struct watch_dir *target = find_watch_dir(paths[i]);
+    if (target != NULL) {
+      update_entry(target, paths[i] + strlen(paths[i]) + 1);
+    }
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+/**
+ * @brief すべての監視を破棄し、引数で指定されたディレクトリから読み込み直す
+ * inotifyのキューが溢れて変更を取りこぼした場合に使う。
+ */
+static void rebuild_watch(void) {
+  int i;
+  for (i = 0; i < watch.root_num; i++) {
+    size_t len = strlen(watch.roots[i]->path);
+    char *path = xmalloc(len + 1);
+    memcpy(path, watch.roots[i]->path, len + 1);
+    remove_watch_tree(watch.roots[i]);
+    watch.roots[i] = add_watch_tree(path, NULL);
+    watch_root_parent(watch.roots[i]);
+    free(path);
+  }
+}
+
+/**
+ * @brief イベントで通知されたエントリを取得し直す
+ * ロングフォーマットでは、リンク数が2以上のファイルは変更前後のinodeの他のリンクも取得し直す。
+ *
+ * @param[IN/OUT] dir  ディレクトリ
+ * @param[IN]     name エントリの名前
+ */
+static void update_notified_entry(struct watch_dir *dir, const char *name) {
+  const struct info *info;
+  bool old_link = false;
+  dev_t dev = 0;
+  ino_t ino = 0;
+  info = long_format ? find_watch_entry(dir, name) : NULL;
+  if (info != NULL && !S_ISDIR(info->mode) && info->nlink > 1) {
+    old_link = true;
+    dev = info->dev;
+    ino = info->ino;
+    update_hard_links(dir, name, dev, ino);
+  }
+  update_entry(dir, name);
+  info = long_format ? find_watch_entry(dir, name) : NULL;
+  if (info != NULL && !S_ISDIR(info->mode) && info->nlink > 1
+      && !(old_link && info->dev == dev && info->ino == ino)) {
+    update_hard_links(dir, name, info->dev, info->ino);
+  }
+}
+
+/**
+ * @brief inotifyのイベントを保持している一覧へ反映する
+ * エントリの追加、削除、移動はディレクトリ自身の更新時刻とリンク数も変えるため、
+ * 親ディレクトリでのこのディレクトリのエントリも取得し直す。
+ * 表示しない名前のエントリでも、ディレクトリ自身への反映は行う。
+ *
+ * @param[IN] event イベント
+ */
+static void apply_event(const struct inotify_event *event) {
+  struct watch_dir *dir;
+  int i;
+  watch.events++;
+  if (event->mask & IN_Q_OVERFLOW) {
+    rebuild_watch();
+    return;
+  }
+  for (i = 0; i < watch.root_num; i++) {
+    struct watch_dir *root = watch.roots[i];
+    if (root->parent_wd < 0 || root->parent_wd != event->wd) {
+      continue;
+    }
+    if (event->mask & IN_IGNORED) {
+      root->parent_wd = -1;
+    } else if (event->mask & (event->len == 0 ? IN_ATTRIB : WATCH_CHANGE_MASK)) {
+      update_entry(root, "..");
+    }
+  }
+  if (event->wd < 0 || event->wd >= watch.wd_size
+      || (dir = watch.by_wd[event->wd]) == NULL) {
+    return;
+  }
+  if (event->mask & IN_IGNORED) {
+    /* 削除されたディレクトリは親のイベントで取り除く */
+    watch.by_wd[event->wd] = NULL;
+    dir->wd = -1;
+    return;
+  }
+  if (dir->shallow) {
+    if (event->len != 0 && (event->mask & WATCH_CHANGE_MASK)) {
+      update_entry(dir->parent, dir->name);
+    }
+    return;
+  }
+  if (event->len == 0) {
+    if (event->mask & IN_ATTRIB) {
+      update_dot_entries(dir);
+    }
+    return;
+  }
+  if (!is_excluded(event->name)) {
+    update_notified_entry(dir, event->name);
+  }
+  if (event->mask & WATCH_CHANGE_MASK) {
+    update_dot_entries(dir);
+    update_links(dir);
+    if (dir->parent != NULL) {
+      /* 入れ替わっていた場合はdirが解放されるため最後に行う */
+      update_entry(dir->parent, dir->name);
+    }
+  }
+}
+
+/**
+ * @brief 溜まっているinotifyのイベントをすべて読み出して反映する
+ */
+static void read_events(void) {
+  char buf[WATCH_EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t len = read(watch.fd, buf, sizeof(buf));
+    char *p;
+    if (len <= 0) {
+      if (len < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (p = buf; p < buf + len; ) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      apply_event(event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+/**
+ * @brief 保持している一覧を出力バッファへ表示する
+ * 再帰的な表示の場合はサブディレクトリを逐次処理と同じ順序で続ける。
+ *
+ * @param[IN]     dir  ディレクトリ
+ * @param[IN/OUT] path ディレクトリのパス、子のパスの組み立てに使う
+ * @param[IN]     len  パスの長さ
+ * @param[IN]     top  問い合わせられたディレクトリであれば見出しを付けない
+ */
+static void render_watch_dir(const struct watch_dir *dir, char *path, size_t len, bool top) {
+  int i;
+  if (!top) {
+    print_dir_header(dir->path);
+  }
+  for (i = 0; i < dir->used; i++) {
+    print_info(dir->entries[i]);
+  }
+  if (!recursive) {
+    return;
+  }
+  /* ディレクトリは先頭に並んでいる */
+  for (i = 0; i < dir->used && S_ISDIR(dir->entries[i]->mode); i++) {
+    const char *name = dir->entries[i]->name;
+    size_t name_len = strlen(name);
+    bool slash = path[len - 1] != '/';
+    const struct watch_dir *child;
+    if ((name[0] == '.' && name[1 + (name[1] == '.')] == '\0')
+        || len + slash + name_len > PATH_MAX) {
+      continue;
+    }
+    if (slash) {
+      path[len] = '/';
+    }
+    memcpy(path + len + slash, name, name_len + 1);
+    child = find_watch_dir(path);
+    if (child != NULL && child->parent == dir && !child->looping) {
+      render_watch_dir(child, path, len + slash + name_len, false);
+    }
+    path[len] = '\0';
+  }
+}
+
+/**
+ * @brief ソケットへすべて書き込む
+ * @param[IN] fd  ソケット
+ * @param[IN] buf 書き込む内容
+ * @param[IN] len 長さ
+ * @retval true  成功
+ * @retval false 失敗
+ */
+static bool send_all(int fd, const char *buf, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    ssize_t n = send(fd, buf + pos, len - pos, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    pos += n;
+  }
+  return true;
+}
+
+/**
+ * @brief 1つの問い合わせに応答する
+ * 応答はヘッダと本文を出力バッファへ組み立て、1回で送る。
+ *
+ * @param[IN] fd   クライアントのソケット
+ * @param[IN] path 問い合わせられたパス
+ * @retval true  成功
+ * @retval false 送れなかった
+ */
+static bool answer_query(int fd, char *path) {
+  char buf[PATH_MAX + 1];
+  struct watch_reply reply;
+  const struct watch_dir *dir;
+  normalize_path(path);
+  dir = find_watch_dir(path);
+  out.used = 0;
+  out_reserve(sizeof(struct watch_reply));
+  reply.status = 0;
+  if (dir == NULL || dir->shallow || dir->looping) {
+    reply.status = ENOENT;
+  } else if (strlen(dir->path) > PATH_MAX) {
+    reply.status = ENAMETOOLONG;
+  } else {
+    if (long_format) {
+      half_year_ago = time(NULL) - HALF_YEAR_SECOND;
+    }
+    strcpy(buf, dir->path);
+    render_watch_dir(dir, buf, strlen(buf), true);
+  }
+  reply.length = out.used - sizeof(struct watch_reply);
+  memcpy(out.buf, &reply, sizeof(struct watch_reply));
+  watch.queries++;
+  return send_all(fd, out.buf, out.used);
+}
+
+/**
+ * @brief クライアントからの要求を読み出し、揃ったものから応答する
+ * @param[IN/OUT] client クライアントの接続
+ * @retval true  接続を続ける
+ * @retval false 切断する
+ */
+static bool read_queries(struct watch_client *client) {
+  ssize_t n = read(client->fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len);
+  char *end;
+  if (n <= 0) {
+    return n < 0 && errno == EINTR;
+  }
+  client->len += n;
+  while ((end = memchr(client->buf, '\n', client->len)) != NULL) {
+    size_t used = end + 1 - client->buf;
+    *end = '\0';
+    if (!answer_query(client->fd, client->buf)) {
+      return false;
+    }
+    memmove(client->buf, end + 1, client->len - used);
+    client->len -= used;
+  }
+  /* 改行のないまま溢れる要求は受け付けない */
+  return client->len < sizeof(client->buf) - 1;
+}
+
+/**
+ * @brief 常駐を終了するシグナルハンドラ
+ * @param[IN] sig シグナル番号
+ */
+static void stop_serving(int sig) {
+  (void)sig;
+  serve_stopped = 1;
+}
+
+/**
+ * @brief 一覧を保持し、変更を反映しながらUNIXソケットで問い合わせに応答する
+ * 1つのスレッドでinotifyとソケットをpollし、溜まった変更をすべて反映してから応答する。
+ * ソケットは読み込みを終えてから作成するため、現れた時点で問い合わせられる。
+ * SIGINTとSIGTERMで終了し、ソケットを削除する。
+ *
+ * @param[IN] head 引数で指定されたディレクトリ
+ * @param[IN] path ソケットのパス
+ * @return 終了コード
+ */
+static int serve(struct dir_path *head, const char *path) {
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct pollfd *fds = NULL;
+  struct watch_client *clients = NULL;
+  struct dir_path *dir;
+  int client_num = 0;
+  int listen_fd;
+  int i;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: too long socket path\n", path);
+    return EXIT_FAILURE;
+  }
+  watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch.fd < 0) {
+    perror("inotify_init1");
+    return EXIT_FAILURE;
+  }
+  for (dir = head; dir != NULL; dir = dir->next) {
+    watch.roots = xrealloc(watch.roots, sizeof(struct watch_dir *) * (watch.root_num + 1));
+    watch.roots[watch.root_num] = add_watch_tree(dir->name, NULL);
+    watch_root_parent(watch.roots[watch.root_num++]);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0
+      || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+      || listen(listen_fd, SOMAXCONN) != 0) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_serving;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  out_capture = true;
+  while (!serve_stopped) {
+    fds = xrealloc(fds, sizeof(struct pollfd) * (client_num + 2));
+    fds[0].fd = watch.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd;
+    fds[1].events = POLLIN;
+    for (i = 0; i < client_num; i++) {
+      fds[i + 2].fd = clients[i].fd;
+      fds[i + 2].events = POLLIN;
+    }
+    if (poll(fds, client_num + 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      read_events();
+    }
+    for (i = 0; i < client_num; ) {
+      if (fds[i + 2].revents != 0 && !read_queries(&clients[i])) {
+        close(clients[i].fd);
+        client_num--;
+        clients[i] = clients[client_num];
+        fds[i + 2] = fds[client_num + 2];
+        continue;
+      }
+      i++;
+    }
+    if (fds[1].revents & POLLIN) {
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        /* 読み出さないクライアントで止まらないよう送信を打ち切る */
+        struct timeval timeout = { 5, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        clients = xrealloc(clients, sizeof(struct watch_client) * (client_num + 1));
+        clients[client_num].fd = fd;
+        clients[client_num].len = 0;
+        client_num++;
+      }
+    }
+  }
+  unlink(path);
+  close(listen_fd);
+  for (i = 0; i < client_num; i++) {
+    close(clients[i].fd);
+  }
+  free(clients);
+  free(fds);
+  if (show_stats) {
+    print_stats();
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief 指定長を読み出すまで繰り返す
+ * @param[IN]  fd  読み出し元
+ * @param[OUT] buf 格納先
+ * @param[IN]  len 長さ
+ * @retval true  成功
+ * @retval false 失敗または途中で終端に達した
+ */
+static bool read_full(int fd, void *buf, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    ssize_t n = read(fd, (char *)buf + pos, len - pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    pos += n;
+  }
+  return true;
+}
+
+/**
+ * @brief 応答時間を昇順に並べるための比較関数
+ * @param[IN] a 比較対象
+ * @param[IN] b 比較対象
+ * @return aが小さければ負、等しければ0、大きければ正
+ */
+static int compare_latency(const void *a, const void *b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief 常駐しているプロセスへ一覧を問い合わせて表示する
+ * --query-countで2回以上を指定した場合は応答を表示せず、
+ * 1つの接続で繰り返し問い合わせた際の毎秒の問い合わせ数と応答時間を標準エラーへ表示する。
+ *
+ * @param[IN] head 問い合わせるディレクトリ
+ * @param[IN] path ソケットのパス
+ * @return 終了コード
+ */
+static int query(struct dir_path *head, const char *path) {
+  struct sockaddr_un addr;
+  struct dir_path *dir;
+  char *body = NULL;
+  size_t body_size = 0;
+  long *latency = NULL;
+  long total = 0;
+  long start;
+  long i;
+  int result = EXIT_SUCCESS;
+  int fd;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: too long socket path\n", path);
+    return EXIT_FAILURE;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  if (query_count > 1) {
+    for (dir = head; dir != NULL; dir = dir->next) {
+      total++;
+    }
+    latency = xmalloc(sizeof(long) * total * query_count);
+    total = 0;
+  }
+  start = now_ns();
+  for (i = 0; i < query_count && result == EXIT_SUCCESS; i++) {
+    for (dir = head; dir != NULL; dir = dir->next) {
+      char request[PATH_MAX + 2];
+      struct watch_reply reply;
+      size_t len = strlen(dir->name);
+      long begin = now_ns();
+      if (len > PATH_MAX) {
+        fprintf(stderr, "too long path\n");
+        continue;
+      }
+      memcpy(request, dir->name, len);
+      request[len] = '\n';
+      if (!send_all(fd, request, len + 1) || !read_full(fd, &reply, sizeof(reply))) {
+        flush_before_error();
+        fprintf(stderr, "%s: connection closed\n", path);
+        result = EXIT_FAILURE;
+        break;
+      }
+      if (body_size < reply.length) {
+        body_size = reply.length;
+        body = xrealloc(body, body_size);
+      }
+      if (!read_full(fd, body, reply.length)) {
+        flush_before_error();
+        fprintf(stderr, "%s: connection closed\n", path);
+        result = EXIT_FAILURE;
+        break;
+      }
+      if (query_count > 1) {
+        latency[total++] = now_ns() - begin;
+      } else if (reply.status != 0) {
+        flush_before_error();
+        fprintf(stderr, "%s: %s\n", dir->name, strerror(reply.status));
+        result = EXIT_FAILURE;
+      } else {
+        out_write(body, reply.length);
+      }
+    }
+  }
+  out_flush();
+  if (query_count > 1 && total != 0) {
+    double seconds = (now_ns() - start) / 1e9;
+    qsort(latency, total, sizeof(long), compare_latency);
+    fprintf(stderr, "queries: %ld, %.0f queries/s, p50 %.1f us, p99 %.1f us\n",
+            total, total / seconds, latency[total / 2] / 1e3, latency[total * 99 / 100] / 1e3);
+  }
+  free(latency);
+  free(body);
+  close(fd);
+  return result;
+}
+
+int main(int argc, char**argv) {
+  struct dir_path *head = parse_cmd_args(argc, argv);
+  if (head == NULL) {
+    return EXIT_FAILURE;
+  }
+  out_interactive = isatty(STDOUT_FILENO);
+  if (serve_path != NULL || query_path != NULL) {
+    int result = serve_path != NULL ? serve(head, serve_path) : query(head, query_path);
+    while (head != NULL) {
+      struct dir_path *tmp = head;
+      head = head->next;
+      release_dir_path(tmp);
+    }
+    return result;
+  }
+  if (load_snapshot_path != NULL) {
+    struct snapshot snap;
+    bool ok = open_snapshot(load_snapshot_path, &snap) && render_snapshot(&snap);
+    out_flush();
+    release_dir_path(head);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (incremental_path != NULL) {
+    snapshot_in = xmalloc(sizeof(struct snapshot));
+    if (!open_snapshot(incremental_path, snapshot_in)) {
+      return EXIT_FAILURE;
+    }
+    if (snapshot_in->header->filter != (uint32_t)filter) {
+      /* 隠しファイルの表示方針が異なる場合はエントリの一覧を再利用できない */
+      fprintf(stderr, "%s: saved with different -a/-A, not reused\n", incremental_path);
+      munmap((void *)snapshot_in->base, snapshot_in->size);
+      free(snapshot_in);
+      snapshot_in = NULL;
+    } else {
+      index_snapshot(snapshot_in);
+    }
+  }
+  if (save_snapshot_path != NULL && !begin_snapshot(save_snapshot_path)) {
+    return EXIT_FAILURE;
+  }
+  /* スナップショットファイルへは表示順に書き込むため、並列には処理しない */
+  if (recursive && !unsorted && walk_threads > 1 && snapshot_out == NULL) {
+    walk_parallel(head);
+    head = NULL;
+  }
+  while(head != NULL) {
+    list_dir(head);
+    if (out_interactive) {
+      out_flush();
+    }
+    struct dir_path *tmp = head;
+    head = head->next;
+    release_dir_path(tmp);
+  }
+  out_flush();
+  if (snapshot_out != NULL && !finish_snapshot()) {
+    return EXIT_FAILURE;
+  }
+  if (show_stats) {
+    print_stats();
+  }
+  return EXIT_SUCCESS;
+}